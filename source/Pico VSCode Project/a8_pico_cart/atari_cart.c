@@ -25,12 +25,20 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "pico/stdlib.h"
 #include "hardware/sync.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/structs/sio.h"
+#include "pico/multicore.h"
 
 #include "ff.h"
 #include "fatfs_disk.h"
+#include "flash_fs.h"
+#include "dir_index.h"
+#include "atari_cart.pio.h"
 
 #define ALL_GPIO_MASK   	0x3FFFFFFF
 #define ADDR_GPIO_MASK  	0x00001FFF
@@ -46,19 +54,26 @@
 
 #define RD4_PIN         26
 #define RD5_PIN         27
+#define S4_PIN          24
+#define S5_PIN          25
+#define DATA_PIN_BASE   13	// D0-D7 = gpio 13-20
 
+// all bus access in the emulation loops goes through these (test/bus_sim.c replaces them with a bus trace)
+#define READ_PINS           gpio_get_all()
 #define RD4_LOW             gpio_put(RD4_PIN, 0)
 #define RD4_HIGH            gpio_put(RD4_PIN, 1)
 #define RD5_LOW             gpio_put(RD5_PIN, 0)
 #define RD5_HIGH            gpio_put(RD5_PIN, 1)
 #define SET_DATA_MODE_OUT   gpio_set_dir_out_masked(DATA_GPIO_MASK)
 #define SET_DATA_MODE_IN    gpio_set_dir_in_masked(DATA_GPIO_MASK)
+#define PUT_DATA(d)         gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(d)) << DATA_PIN_BASE)
+#define GET_DATA(pins)      (((pins) & DATA_GPIO_MASK) >> DATA_PIN_BASE)
 
 #include "rom.h"
 #include "osrom.h"
 
-unsigned char cart_ram[128*1024];
-unsigned char cart_d5xx[256] = {0};
+unsigned char cart_ram[128*1024] __attribute__((aligned(16384)));	// aligned for the PIO/DMA window base
+unsigned char __scratch_y("atari_bus") cart_d5xx[256] = {0};	// core 0 only touches it while core 1 waits for a BUS_MSG
 char errorBuf[40];
 
 #define CART_CMD_OPEN_ITEM			0x00
@@ -67,9 +82,11 @@ char errorBuf[40];
 #define CART_CMD_UP_DIR				0x03
 #define CART_CMD_ROOT_DIR			0x04
 #define CART_CMD_SEARCH				0x05
+#define CART_CMD_GET_DIR_ENTRY_EX	0x06	// 16 bit entry number
+#define CART_CMD_OPEN_ITEM_EX		0x07	// 16 bit entry number
 #define CART_CMD_LOAD_SOFT_OS		0x10
 #define CART_CMD_SOFT_OS_CHUNK		0x11
-#define CART_CMD_MOUNT_ATR			0x20	// unused, done automatically by firmware
+#define CART_CMD_MOUNT_ATR			0x20	// put the last opened ATR in a drive (D1: is also done by ACTIVATE_CART)
 #define CART_CMD_READ_ATR_SECTOR	0x21
 #define CART_CMD_WRITE_ATR_SECTOR	0x22
 #define CART_CMD_ATR_HEADER			0x23
@@ -111,17 +128,115 @@ char errorBuf[40];
 #define CART_TYPE_2K				31  // 2k
 #define CART_TYPE_PHOENIX_8K		32	// 8k
 #define CART_TYPE_BLIZZARD_4K		33	// 4k
+#define CART_TYPE_XEGS_256K			34	// 256k (served from flash)
+#define CART_TYPE_XEGS_512K			35	// 512k
+#define CART_TYPE_XEGS_1024K		36	// 1M
+#define CART_TYPE_SW_XEGS_256K		37	// 256k
+#define CART_TYPE_SW_XEGS_512K		38	// 512k
+#define CART_TYPE_SW_XEGS_1024K		39	// 1M
+#define CART_TYPE_MEGACART_256K		40	// 256k
+#define CART_TYPE_MEGACART_512K		41	// 512k
+#define CART_TYPE_MEGACART_1024K	42	// 1M
+#define CART_TYPE_ATARIMAX_8MBIT	43	// 1M (starts in bank 127)
+#define CART_TYPE_ATARIMAX_8MBIT_NEW 44	// 1M (starts in bank 0)
+#define CART_TYPE_SIC_256K			45	// 256k
+#define CART_TYPE_SIC_512K			46	// 512k
+#define CART_TYPE_MEGAMAX_2M		47	// 2M
 #define CART_TYPE_ATR				254
 #define CART_TYPE_XEX				255
 
-typedef struct {
-	char isDir;
-	char filename[13];
-	char long_filename[32];
-	char full_path[210];
-} DIR_ENTRY;	// 256 bytes = 256 entries in 64k
+/*
+ Directory listings
+ ------------------
+ A listing is an array of 8 byte DIR_ENTRYs from the start of cart_ram, and a pool of the
+ names growing down from the end of the listing area. Pool offsets count back from the end
+ in 2 byte units, so 16 bits covers all of cart_ram. Search results share one copy of each
+ directory path in the pool.
+
+ The menu ROM only has 8 bit entry numbers, so it sees the listing a page at a time, with
+ "[Previous page]"/"[Next page]" folder entries at either end. Opening one of those moves
+ the page and reports the directory as changed, so the menu reads it again.
+ A menu that knows about big listings can use the 16 bit commands instead:
+  READ_CUR_DIR also returns the total number of entries in $D503/$D504,
+  GET_DIR_ENTRY_EX/OPEN_ITEM_EX take a 16 bit entry number in $D500/$D501.
+*/
 
+typedef struct {
+	uint8_t isDir;		// also used for the search "score" while sorting
+	uint8_t unused;
+	uint16_t path;		// search results: pool offset of the directory, 0 = current directory
+	uint16_t name;		// pool offset of the long file name (up to 31 chars)
+	uint16_t filename;	// pool offset of the 8.3 name
+} DIR_ENTRY;
+
+#define DIR_POOL_STR(off)	((char *)dir_pool_end - ((uint32_t)(off) << 1))
+
+#define DIR_PAGE_SIZE		250		// entries per page seen by the menu ROM
+#define DIR_PREV_PAGE		-1
+#define DIR_NEXT_PAGE		-2
+#define MAX_SEARCH_RESULTS	DIR_PAGE_SIZE	// always one page, the menu forgets the search on a page change
+
+DIR_ENTRY *dir_entries = (DIR_ENTRY *)&cart_ram[0];
+uint8_t *dir_pool_end = &cart_ram[sizeof(cart_ram)];
+int dir_pool_size = 0;		// bytes
 int num_dir_entries = 0; // how many entries in the current directory
+int dir_page = 0;
+
+// read_directory() leaves its listing in cart_ram, so going back to the same directory (or
+// another page of it) doesn't need the flash at all until something else uses cart_ram
+uint32_t listing_path_crc = 0;
+int listing_valid = 0;
+
+void drop_read_ahead();	// the ATR read-ahead is kept in cart_ram too
+
+void init_listing(int size) {
+	listing_valid = 0;
+	drop_read_ahead();	// cart_ram is about to be used for the listing
+	dir_pool_end = &cart_ram[size];
+	dir_pool_size = 0;
+	num_dir_entries = 0;
+}
+
+uint16_t add_dir_string(const char *str, int maxlen) {
+	// returns the pool offset, or 0 if the listing is full
+	int len = strnlen(str, maxlen);
+	int size = (len + 2) & ~1;
+	if ((uint8_t *)&dir_entries[num_dir_entries + 1] > dir_pool_end - dir_pool_size - size)
+		return 0;
+	dir_pool_size += size;
+	char *dst = DIR_POOL_STR(dir_pool_size >> 1);
+	memcpy(dst, str, len);
+	dst[len] = 0;
+	return dir_pool_size >> 1;
+}
+
+int add_dir_entry(int isDir, const char *name, const char *filename, uint16_t path) {
+	// returns 0 if the listing is full
+	DIR_ENTRY *dst = &dir_entries[num_dir_entries];
+	dst->isDir = isDir;
+	dst->unused = 0;
+	dst->path = path;
+	dst->name = add_dir_string(name, 31);
+	if (strcmp(name, filename) == 0 && strlen(name) <= 12)
+		dst->filename = dst->name;
+	else
+		dst->filename = add_dir_string(filename, 12);
+	if (!dst->name || !dst->filename)
+		return 0;
+	num_dir_entries++;
+	return 1;
+}
+
+uint16_t last_result_path;
+
+uint16_t add_result_path(const char *path) {
+	// results arrive a directory at a time, so this shares the path between them
+	if (!path[0])
+		return 0;
+	if (!last_result_path || strcmp(DIR_POOL_STR(last_result_path), path) != 0)
+		last_result_path = add_dir_string(path, 209);
+	return last_result_path;
+}
 
 int entry_compare(const void* p1, const void* p2)
 {
@@ -129,7 +244,26 @@ int entry_compare(const void* p1, const void* p2)
 	DIR_ENTRY* e2 = (DIR_ENTRY*)p2;
 	if (e1->isDir && !e2->isDir) return -1;
 	else if (!e1->isDir && e2->isDir) return 1;
-	else return strcasecmp(e1->long_filename, e2->long_filename);
+	else return strcasecmp(DIR_POOL_STR(e1->name), DIR_POOL_STR(e2->name));
+}
+
+int dir_page_entry(int n) {
+	// the entry shown by the menu ROM as item n, or DIR_PREV_PAGE/DIR_NEXT_PAGE
+	if (dir_page > 0) {
+		if (n == 0) return DIR_PREV_PAGE;
+		n--;
+	}
+	int i = dir_page * DIR_PAGE_SIZE + n;
+	if (n >= DIR_PAGE_SIZE || i >= num_dir_entries)
+		return DIR_NEXT_PAGE;
+	return i;
+}
+
+int dir_page_count() {
+	int first = dir_page * DIR_PAGE_SIZE;
+	int n = num_dir_entries - first;
+	if (n > DIR_PAGE_SIZE) n = DIR_PAGE_SIZE + 1;	// + next page
+	return n + (dir_page > 0 ? 1 : 0);
 }
 
 char *get_filename_ext(char *filename) {
@@ -149,19 +283,47 @@ int is_valid_file(char *filename) {
 FILINFO fno;
 char search_fname[FF_LFN_BUF + 1];
 
-// polyfill :-)
-char *stristr(const char *str, const char *strSearch) {
-    char *sors, *subs, *res = NULL;
-    if ((sors = strdup (str)) != NULL) {
-        if ((subs = strdup (strSearch)) != NULL) {
-            res = strstr (strlwr (sors), strlwr (subs));
-            if (res != NULL)
-                res = (char*)str + (res - sors);
-            free (subs);
-        }
-        free (sors);
-    }
-    return res;
+// One FatFs session for all of cart mode, shared by the menu commands and the ATR code.
+// The volume only changes in USB mode, which is a separate boot, so once mounted it stays
+// mounted and FatFs keeps its FAT window and free cluster count from one command to the next.
+FATFS FatFs;
+int fatFsMounted = 0;
+
+int mount_fatfs() {
+	if (!fatFsMounted) {
+		if (!fatfs_is_mounted())
+			mount_fatfs_disk();
+		if (f_mount(&FatFs, "", 1) != FR_OK)
+			return 0;
+		fatFsMounted = 1;
+	}
+	return 1;
+}
+
+// USB mode (msc_disk.c), with the disk to ourselves: FatFs is mounted afresh each time,
+// since the host may have changed the volume in between
+void mark_search_index_stale() {
+	fatFsMounted = 0;
+	if (mount_fatfs())
+		search_index_mark_stale();
+	fatFsMounted = 0;
+}
+
+void update_search_index(int size) {
+	// the index and its scratch copy get size bytes each from the start of cart_ram
+	fatFsMounted = 0;
+	if (mount_fatfs())
+		search_index_update(&cart_ram[size], &cart_ram[0], size, is_valid_file);
+	fatFsMounted = 0;
+}
+
+int add_search_result(void *ctx, const char *dir, const char *name, const char *sfn, int score) {
+	if (num_dir_entries == MAX_SEARCH_RESULTS)
+		return 0;
+	uint16_t path = add_result_path(dir);
+	if (dir[0] && !path)
+		return 0;
+	return add_dir_entry(score, name, sfn, path);	// isDir holds the "score" until sorted
 }
 
 int scan_files(char *path, char *search)
@@ -173,7 +335,7 @@ int scan_files(char *path, char *search)
 	res = f_opendir(&dir, path);
 	if (res == FR_OK) {
 		for (;;) {
-			if (num_dir_entries == 255) break;
+			if (num_dir_entries == MAX_SEARCH_RESULTS) break;
 			res = f_readdir(&dir, &fno);
 			if (res != FR_OK || fno.fname[0] == 0) break;
 			if (fno.fattrib & (AM_HID | AM_SYS)) continue;
@@ -184,33 +346,20 @@ int scan_files(char *path, char *search)
 					strcat(path, fno.altname);
 				else
 					strcat(path, fno.fname);
-				if (strlen(path) >= 210) continue;	// no more room for path in DIR_ENTRY
+				if (strlen(path) >= 210) {	// too deep
+					path[i] = 0;
+					continue;
+				}
 				res = scan_files(path, search);
 				if (res != FR_OK) break;
 				path[i] = 0;
 			}
 			else if (is_valid_file(fno.fname))
 			{
-				char *match = stristr(fno.fname, search);
-				if (match) {
-					DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-					dst += num_dir_entries;
-					// fill out a record
-					dst->isDir = (match == fno.fname) ? 1 : 0;	// use this for a "score"
-					strncpy(dst->long_filename, fno.fname, 31);
-					dst->long_filename[31] = 0;
-					// 8.3 name
-					if (fno.altname[0])
-						strcpy(dst->filename, fno.altname);
-					else {	// no altname when lfn is 8.3
-						strncpy(dst->filename, fno.fname, 12);
-						dst->filename[12] = 0;
-					}
-					// full path for search results
-					strcpy(dst->full_path, path);
-
-					num_dir_entries++;
-				}
+				const char *match = stristr(fno.fname, search);
+				if (match && !add_search_result(NULL, path, fno.fname,
+						fno.altname[0] ? fno.altname : fno.fname, match == fno.fname))
+					break;
 			}
 		}
 		f_closedir(&dir);
@@ -221,20 +370,30 @@ int scan_files(char *path, char *search)
 int search_directory(char *path, char *search) {
 	char pathBuf[256];
 	strcpy(pathBuf, path);
-	num_dir_entries = 0;
-	int i;
-	FATFS FatFs;
-	if (f_mount(&FatFs, "", 1) == FR_OK) {
-		if (scan_files(pathBuf, search) == FR_OK) {
-			// sort by score, name
-			qsort((DIR_ENTRY *)&cart_ram[0], num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
-			DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-			// reset the "scores" back to 0
-			for (i=0; i<num_dir_entries; i++)
-				dst[i].isDir = 0;
-			return 1;
-
+	int i, ret = 0;
+	// results go in the bottom 64k, the search index is kept in the top 64k
+	// (less a byte, its pool offsets are 16 bit) and uses the bottom half as scratch space
+	init_listing(65536);
+	dir_page = 0;
+	last_result_path = 0;
+	if (mount_fatfs()) {
+		SEARCH_INDEX *ix = search_index_load(&cart_ram[65536], 65535);
+		if (!ix)	// none yet, or the host didn't eject the drive after USB mode
+			ix = search_index_update(&cart_ram[65536], &cart_ram[0], 65535, is_valid_file);
+		if (ix) {
+			search_index_find(ix, pathBuf, search, add_search_result, NULL);
+			ret = 1;
 		}
+		else if (scan_files(pathBuf, search) == FR_OK)
+			ret = 1;	// index didn't fit, search the hard way
+	}
+	if (ret) {
+		// sort by score, name
+		qsort(dir_entries, num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
+		// reset the "scores" back to 0
+		for (i=0; i<num_dir_entries; i++)
+			dir_entries[i].isDir = 0;
+		return 1;
 	}
 	strcpy(errorBuf, "Problem searching flash");
 	return 0;
@@ -242,49 +401,55 @@ int search_directory(char *path, char *search) {
 
 int read_directory(char *path) {
 	int ret = 0;
-	num_dir_entries = 0;
-	DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-
-    if (!fatfs_is_mounted())
-       mount_fatfs_disk();
+	uint32_t path_crc = crc32(strlen(path), path, strlen(path));
+	if (listing_valid && listing_path_crc == path_crc) {
+		if (dir_page * DIR_PAGE_SIZE >= num_dir_entries)
+			dir_page = 0;
+		return 1;
+	}
+	init_listing(sizeof(cart_ram));
 
-	FATFS FatFs;
-	if (f_mount(&FatFs, "", 1) == FR_OK) {
+	if (mount_fatfs()) {
 		DIR dir;
 		if (f_opendir(&dir, path) == FR_OK) {
-			while (num_dir_entries < 255) {
-				if (f_readdir(&dir, &fno) != FR_OK || fno.fname[0] == 0)
-					break;
-				if (fno.fattrib & (AM_HID | AM_SYS))
-					continue;
-				dst->isDir = fno.fattrib & AM_DIR ? 1 : 0;
-				if (!dst->isDir)
-					if (!is_valid_file(fno.fname)) continue;
-				// copy file record to first ram block
-				// long file name
-				strncpy(dst->long_filename, fno.fname, 31);
-				dst->long_filename[31] = 0;
-				// 8.3 name
-				if (fno.altname[0])
-		            strcpy(dst->filename, fno.altname);
-				else {	// no altname when lfn is 8.3
-					strncpy(dst->filename, fno.fname, 12);
-					dst->filename[12] = 0;
+			// use the saved listing if the directory hasn't changed since it was made
+			uint32_t sig;
+			int have_sig = dir_signature(&dir, &sig);
+			int n = have_sig ? dir_index_read(path, sig, &cart_ram[0], sizeof(cart_ram), sizeof(DIR_ENTRY), &dir_pool_size) : -1;
+			if (n >= 0)
+				num_dir_entries = n;
+			else {
+				while (1) {
+					if (f_readdir(&dir, &fno) != FR_OK || fno.fname[0] == 0)
+						break;
+					if (fno.fattrib & (AM_HID | AM_SYS))
+						continue;
+					int isDir = fno.fattrib & AM_DIR ? 1 : 0;
+					if (!isDir)
+						if (!is_valid_file(fno.fname)) continue;
+					// no altname when lfn is 8.3
+					if (!add_dir_entry(isDir, fno.fname, fno.altname[0] ? fno.altname : fno.fname, 0)) {
+						have_sig = 0;	// listing is truncated, don't save it
+						break;
+					}
 				}
-				dst->full_path[0] = 0; // path only for search results
-	            dst++;
-				num_dir_entries++;
+				qsort(dir_entries, num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
+				if (have_sig)
+					dir_index_write(path, sig, dir_entries, sizeof(DIR_ENTRY), num_dir_entries,
+						DIR_POOL_STR(dir_pool_size >> 1), dir_pool_size);
 			}
 			f_closedir(&dir);
+			listing_path_crc = path_crc;
+			listing_valid = 1;
 		}
 		else
 			strcpy(errorBuf, "Can't read directory");
-		f_mount(0, "", 1);
-		qsort((DIR_ENTRY *)&cart_ram[0], num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
 		ret = 1;
 	}
 	else
 		strcpy(errorBuf, "Can't read flash memory");
+	if (dir_page * DIR_PAGE_SIZE >= num_dir_entries)
+		dir_page = 0;
 	return ret;
 }
 
@@ -303,91 +468,457 @@ typedef struct {
   uint8_t unused[5];
 } ATRHeader;
 
+// Writes are left in FatFs (the FIL buffer, then flash_fs's write buffer) rather than
+// synced one 128 byte page at a time, which rewrote the data and directory sectors and
+// committed the flash map for every page. The ATR is synced once the Atari has stopped
+// writing for ATR_IDLE_SYNC_MS, at most ATR_MAX_DIRTY_MS after the first unsynced write,
+// and before any command other than ATR sector I/O (e.g. mounting another image).
+#define ATR_IDLE_SYNC_MS	500
+#define ATR_MAX_DIRTY_MS	2000
+#define ATR_CLMT_SIZE		32		// cluster link map, room for 15 fragments
+#define ATR_MAX_DRIVES		4		// D1: to D4:
+
+// Read-ahead. DOS boots and file loads read sectors in order, so once a read starts where the
+// last read from that drive ended, the bytes after it are fetched into atr_read_ahead while
+// core 0 waits for the next command (core 1 is busy with the bus), 512 bytes at a time so a
+// command is never held up for long. The buffer slides along once the reads are half way
+// through it. It waits while the drive has unsynced writes, the sync comes first.
+#define ATR_READ_AHEAD_SIZE	8192
+#define atr_read_ahead		(&cart_ram[0])	// cart_ram is free in ATR mode
+
+// Each drive has its own FIL, and so its own sector buffer. The device byte of the ATR
+// commands picks the drive, 0 (from menu ROMs that only know D1:) is D1:.
 typedef struct {
-	char path[256];
+	int mounted;
 	ATRHeader atrHeader;
 	int	filesize;
 	FIL fil;
+	DWORD clmt[ATR_CLMT_SIZE];
+	int nextRead;		// file offset after the last read, to spot sequential reads
+	int dirty;			// written since the last sync
+	int syncError;		// a deferred sync failed, reported by the next write
+	uint32_t firstWrite, lastWrite;	// ms since boot
 } MountedATR;
 
-MountedATR mountedATRs[1] = {0};
+MountedATR mountedATRs[ATR_MAX_DRIVES] = {0};
 
-FATFS FatFs;
-int doneFatFsInit = 0;
+MountedATR *read_ahead_drive = NULL;	// NULL = nothing read ahead
+int read_ahead_offset;		// file offset of atr_read_ahead[0]
+int read_ahead_len;			// bytes wanted
+int read_ahead_filled;		// bytes read so far
+
+void drop_read_ahead() {
+	read_ahead_drive = NULL;
+}
+
+MountedATR *atr_drive(uint8_t device) {
+	// device is the drive number or the SIO device id ($31-$34)
+	if (device >= 0x31)
+		device -= 0x30;
+	if (device == 0)
+		device = 1;
+	if (device > ATR_MAX_DRIVES)
+		return NULL;
+	return &mountedATRs[device - 1];
+}
+
+void sync_atr(MountedATR *mountedATR) {
+	if (!mountedATR->dirty)
+		return;
+	if (f_sync(&mountedATR->fil) != FR_OK)
+		mountedATR->syncError = 1;
+	mountedATR->dirty = 0;
+}
+
+void sync_all_atrs() {
+	for (int i=0; i<ATR_MAX_DRIVES; i++)
+		sync_atr(&mountedATRs[i]);
+}
+
+void sync_atr_if_idle() {
+	// called while waiting for the next command
+	uint32_t now = to_ms_since_boot(get_absolute_time());
+	for (int i=0; i<ATR_MAX_DRIVES; i++)
+		if (mountedATRs[i].dirty && now - mountedATRs[i].lastWrite >= ATR_IDLE_SYNC_MS)
+			sync_atr(&mountedATRs[i]);
+}
+
+void unmount_atr(MountedATR *mountedATR) {
+	if (read_ahead_drive == mountedATR)
+		drop_read_ahead();
+	if (!mountedATR->mounted)
+		return;
+	sync_atr(mountedATR);
+	f_close(&mountedATR->fil);
+	mountedATR->mounted = 0;
+	mountedATR->syncError = 0;	// it belonged to this image, not the next one
+}
 
-int mount_atr(char *filename) {
+int mount_atr(MountedATR *mountedATR, char *filename) {
 	// returns 0 for success or error code
 	// 1 = no media, 2 = no file, 3 = bad atr
-	if (!doneFatFsInit) {
-		if (f_mount(&FatFs, "", 1) != FR_OK)
-			return 1;
-		doneFatFsInit = 1;
-	}
-	MountedATR *mountedATR = &mountedATRs[0];
+	if (!mount_fatfs())
+		return 1;
+	unmount_atr(mountedATR);
 	if (f_open(&mountedATR->fil, filename, FA_READ|FA_WRITE) != FR_OK)
 		return 2;
+	// an image in two drives would have two FIL buffers out of step, take it out of the other one
+	for (int i=0; i<ATR_MAX_DRIVES; i++)
+		if (&mountedATRs[i] != mountedATR && mountedATRs[i].mounted && mountedATRs[i].fil.obj.sclust == mountedATR->fil.obj.sclust)
+			unmount_atr(&mountedATRs[i]);
 	UINT br;
 	if (f_read(&mountedATR->fil, &mountedATR->atrHeader, ATR_HEADER_SIZE, &br) != FR_OK || br != ATR_HEADER_SIZE ||
 			mountedATR->atrHeader.signature != ATR_SIGNATURE) {
 		f_close(&mountedATR->fil);
 		return 3;
 	}
+	// with a cluster link map f_lseek() doesn't walk the FAT chain for every sector,
+	// a more fragmented image just seeks the slow way
+	mountedATR->clmt[0] = ATR_CLMT_SIZE;
+	mountedATR->fil.cltbl = mountedATR->clmt;
+	if (f_lseek(&mountedATR->fil, CREATE_LINKMAP) != FR_OK)
+		mountedATR->fil.cltbl = 0;
 	// success
-	strcpy(mountedATR->path, filename);
+	mountedATR->mounted = 1;
 	mountedATR->filesize = f_size(&mountedATR->fil);
+	mountedATR->nextRead = -1;
+	mountedATR->dirty = 0;
+	mountedATR->syncError = 0;
 	return 0;
 }
 
-int read_atr_sector(uint16_t sector, uint8_t page, uint8_t *buf) {
+int atr_offset(MountedATR *mountedATR, uint16_t sector) {
+	// file offset of a sector, the first 3 sectors are always 128 bytes
+	if (sector <= 3)
+		return ATR_HEADER_SIZE + (sector - 1) * 128;
+	return ATR_HEADER_SIZE + (3 * 128) + ((sector - 4) * mountedATR->atrHeader.secSize);
+}
+
+int read_ahead_hit(MountedATR *mountedATR, int offset, uint8_t *buf, int len) {
+	if (mountedATR != read_ahead_drive || offset < read_ahead_offset ||
+			offset + len > read_ahead_offset + read_ahead_filled)
+		return 0;
+	memcpy(buf, atr_read_ahead + (offset - read_ahead_offset), len);
+	return 1;
+}
+
+void atr_read_done(MountedATR *mountedATR, int offset, int len) {
+	// spot sequential reads and move the read-ahead on to what comes after them
+	int sequential = (offset == mountedATR->nextRead);
+	int end = offset + len;
+	mountedATR->nextRead = end;
+	if (!sequential || end >= mountedATR->filesize)
+		return;
+	int keep = 0;
+	if (read_ahead_drive == mountedATR && end >= read_ahead_offset && end <= read_ahead_offset + read_ahead_len) {
+		if (end - read_ahead_offset < ATR_READ_AHEAD_SIZE / 2)
+			return;	// still plenty ahead
+		keep = read_ahead_filled - (end - read_ahead_offset);
+		if (keep > 0)
+			memmove(atr_read_ahead, atr_read_ahead + (end - read_ahead_offset), keep);
+		else
+			keep = 0;
+	}
+	listing_valid = 0;	// atr_read_ahead is in cart_ram
+	read_ahead_drive = mountedATR;
+	read_ahead_offset = end;
+	read_ahead_len = mountedATR->filesize - end;
+	if (read_ahead_len > ATR_READ_AHEAD_SIZE)
+		read_ahead_len = ATR_READ_AHEAD_SIZE;
+	read_ahead_filled = keep;
+}
+
+void read_ahead_step() {
+	// called while waiting for the next command
+	if (!read_ahead_drive || read_ahead_drive->dirty || read_ahead_filled >= read_ahead_len)
+		return;
+	int n = read_ahead_len - read_ahead_filled;
+	if (n > 512)
+		n = 512;
+	UINT br;
+	if (f_lseek(&read_ahead_drive->fil, read_ahead_offset + read_ahead_filled) != FR_OK ||
+			f_read(&read_ahead_drive->fil, atr_read_ahead + read_ahead_filled, n, &br) != FR_OK || br != n) {
+		read_ahead_len = read_ahead_filled;	// give up, the read itself will report it
+		return;
+	}
+	read_ahead_filled += n;
+}
+
+void atr_written(MountedATR *mountedATR, int offset, int len) {
+	if (read_ahead_drive == mountedATR && offset < read_ahead_offset + read_ahead_len && offset + len > read_ahead_offset)
+		drop_read_ahead();
+	uint32_t now = to_ms_since_boot(get_absolute_time());
+	if (!mountedATR->dirty) {
+		mountedATR->dirty = 1;
+		mountedATR->firstWrite = now;
+	}
+	mountedATR->lastWrite = now;
+	if (now - mountedATR->firstWrite >= ATR_MAX_DIRTY_MS)
+		sync_atr(mountedATR);	// don't leave a long save unsynced
+}
+
+int read_atr_sector(MountedATR *mountedATR, uint16_t sector, uint8_t page, uint8_t *buf) {
 	// returns 0 for success or error code
 	// 1 = no ATR mounted, 2 = invalid sector
-	MountedATR *mountedATR = &mountedATRs[0];
-	if (!mountedATR->path[0]) return 1;
+	if (!mountedATR || !mountedATR->mounted) return 1;
 	if (sector == 0) return 2;
 
-	int offset = ATR_HEADER_SIZE;
-	// first 3 sectors are always 128 bytes
-	if (sector <=3)
-		offset += (sector - 1) * 128;
-	else
-		offset += (3 * 128) + ((sector - 4) * mountedATR->atrHeader.secSize) + (page * 128);
+	int offset = atr_offset(mountedATR, sector) + (sector <= 3 ? 0 : page * 128);
 	// check we're not reading beyond the end of the file..
 	if (offset > (mountedATR->filesize - 128)) {
 		memset(buf, 0 , 128);	// return blank sector?
 		return 0;
 	}
 	UINT br;
-	if (f_lseek(&mountedATR->fil, offset) != FR_OK || f_read(&mountedATR->fil, buf, 128, &br) != FR_OK || br != 128)
+	if (!read_ahead_hit(mountedATR, offset, buf, 128) &&
+			(f_lseek(&mountedATR->fil, offset) != FR_OK || f_read(&mountedATR->fil, buf, 128, &br) != FR_OK || br != 128))
 		return 2;
+	atr_read_done(mountedATR, offset, 128);
 	return 0;
 }
 
-int write_atr_sector(uint16_t sector, uint8_t page, uint8_t *buf) {
+int write_atr_sector(MountedATR *mountedATR, uint16_t sector, uint8_t page, uint8_t *buf) {
 	// returns 0 for success or error code
 	// 1 = no ATR mounted, 2 = write error
-	MountedATR *mountedATR = &mountedATRs[0];
-	if (!mountedATR->path[0]) return 1;
+	if (!mountedATR || !mountedATR->mounted) return 1;
 	if (sector == 0) return 2;
 
-	int offset = ATR_HEADER_SIZE;
-	// first 3 sectors are always 128 bytes
-	if (sector <=3)
-		offset += (sector - 1) * 128;
-	else
-		offset += (3 * 128) + ((sector - 4) * mountedATR->atrHeader.secSize) + (page * 128);
+	int offset = atr_offset(mountedATR, sector) + (sector <= 3 ? 0 : page * 128);
 	// check we're not writing beyond the end of the file..
 	if (offset > (mountedATR->filesize - 128))
 		return 2;
+	if (mountedATR->syncError) {
+		mountedATR->syncError = 0;
+		return 2;
+	}
 	UINT bw;
-	if (f_lseek(&mountedATR->fil, offset) != FR_OK || f_write(&mountedATR->fil, buf, 128, &bw) != FR_OK || f_sync(&mountedATR->fil) != FR_OK  || bw != 128)
+	if (f_lseek(&mountedATR->fil, offset) != FR_OK || f_write(&mountedATR->fil, buf, 128, &bw) != FR_OK || bw != 128)
 		return 2;
+	atr_written(mountedATR, offset, 128);
 	return 0;
 }
 
 /* CARTRIDGE/XEX HANDLING */
 
+typedef struct {
+	uint8_t car_type;	// type in the .CAR file header
+	uint8_t cart_type;	// CART_TYPE_xxx
+	int size;
+} CAR_TYPE;
+
+static const CAR_TYPE car_types[] = {
+	{ 1,	CART_TYPE_8K,					8192 },
+	{ 2,	CART_TYPE_16K,					16384 },
+	{ 3,	CART_TYPE_OSS_16K_034M,			16384 },
+	{ 8,	CART_TYPE_WILLIAMS_64K,			65536 },
+	{ 9,	CART_TYPE_EXPRESS_64K,			65536 },
+	{ 10,	CART_TYPE_DIAMOND_64K,			65536 },
+	{ 11,	CART_TYPE_SDX_64K,				65536 },
+	{ 12,	CART_TYPE_XEGS_32K,				32768 },
+	{ 13,	CART_TYPE_XEGS_64K,				65536 },
+	{ 14,	CART_TYPE_XEGS_128K,			131072 },
+	{ 15,	CART_TYPE_OSS_16K_TYPE_B,		16384 },
+	{ 17,	CART_TYPE_ATRAX_128K,			131072 },
+	{ 18,	CART_TYPE_BOUNTY_BOB,			40960 },
+	{ 22,	CART_TYPE_WILLIAMS_64K,			32768 },
+	{ 23,	CART_TYPE_XEGS_256K,			262144 },
+	{ 24,	CART_TYPE_XEGS_512K,			524288 },
+	{ 25,	CART_TYPE_XEGS_1024K,			1048576 },
+	{ 26,	CART_TYPE_MEGACART_16K,			16384 },
+	{ 27,	CART_TYPE_MEGACART_32K,			32768 },
+	{ 28,	CART_TYPE_MEGACART_64K,			65536 },
+	{ 29,	CART_TYPE_MEGACART_128K,		131072 },
+	{ 30,	CART_TYPE_MEGACART_256K,		262144 },
+	{ 31,	CART_TYPE_MEGACART_512K,		524288 },
+	{ 32,	CART_TYPE_MEGACART_1024K,		1048576 },
+	{ 33,	CART_TYPE_SW_XEGS_32K,			32768 },
+	{ 34,	CART_TYPE_SW_XEGS_64K,			65536 },
+	{ 35,	CART_TYPE_SW_XEGS_128K,			131072 },
+	{ 36,	CART_TYPE_SW_XEGS_256K,			262144 },
+	{ 37,	CART_TYPE_SW_XEGS_512K,			524288 },
+	{ 38,	CART_TYPE_SW_XEGS_1024K,		1048576 },
+	{ 39,	CART_TYPE_PHOENIX_8K,			8192 },
+	{ 40,	CART_TYPE_BLIZZARD_16K,			16384 },
+	{ 41,	CART_TYPE_ATARIMAX_1MBIT,		131072 },
+	{ 42,	CART_TYPE_ATARIMAX_8MBIT,		1048576 },
+	{ 43,	CART_TYPE_SDX_128K,				131072 },
+	{ 44,	CART_TYPE_OSS_8K,				8192 },
+	{ 45,	CART_TYPE_OSS_16K_043M,			16384 },
+	{ 46,	CART_TYPE_BLIZZARD_4K,			4096 },
+	{ 50,	CART_TYPE_TURBOSOFT_64K,		65536 },
+	{ 51,	CART_TYPE_TURBOSOFT_128K,		131072 },
+	{ 52,	CART_TYPE_MICROCALC,			32768 },
+	{ 54,	CART_TYPE_SIC_128K,				131072 },
+	{ 55,	CART_TYPE_SIC_256K,				262144 },
+	{ 56,	CART_TYPE_SIC_512K,				524288 },
+	{ 57,	CART_TYPE_2K,					2048 },
+	{ 58,	CART_TYPE_4K,					4096 },
+	{ 61,	CART_TYPE_MEGAMAX_2M,			2097152 },
+	{ 75,	CART_TYPE_ATARIMAX_8MBIT_NEW,	1048576 },
+};
+
+// the SDK fifo functions live in flash, core 1 may be waiting while core 0 programs it
+static __force_inline void bus_fifo_push(uint32_t data) {
+	while (!multicore_fifo_wready()) ;
+	sio_hw->fifo_wr = data;
+	__sev();
+}
+
+static __force_inline uint32_t bus_fifo_pop() {
+	while (!multicore_fifo_rvalid())
+		__wfe();
+	return sio_hw->fifo_rd;
+}
+
+/*
+ Large carts
+ -----------
+ Images bigger than cart_ram aren't read into SRAM. load_file() resolves the file through
+ FatFs and the flash_fs map into cart_chunks[], the flash location of each 512 byte chunk.
+ cart_ram becomes a cache of whole banks: the banks needed at start are copied in before the
+ cart is activated, the rest when the Atari switches to them. Core 1 tells core 0 about every
+ bank switch over the FIFO and core 0 copies the bank core 1 is on (bank_cache_active) if it
+ isn't cached, with DMA from the non-caching XIP alias so the XIP cache stays with core 1.
+ Once cart_ram is full the least recently switched to bank is evicted to make room.
+ The 6502 can't be held off, so until the copy lands (a few hundred us) core 1 reads a newly
+ selected bank straight from XIP flash; it picks the bank_cache[] entry up on the next access.
+ Core 0 never evicts the active or the fixed bank. Core 1 stores bank_cache_active before it
+ reads bank_cache[] and core 0 clears the entry before it reads bank_cache_active (with a
+ barrier on both sides), so either core 1 sees the cleared entry or core 0 sees the bank is
+ active again and puts it back.
+*/
+
+#define MAX_FLASH_CART_SIZE	(2048*1024)
+
+uint16_t cart_chunks[MAX_FLASH_CART_SIZE / 512 + 1];	// flash_fs map entry of each 512 bytes of the file
+uint32_t cart_image_offset;			// 16 for .CAR (header), 0 for .ROM
+bool flash_cart = false;			// cart served from flash rather than cart_ram
+unsigned char * volatile bank_cache[128];	// SRAM copy of each bank, NULL until cached
+uint32_t bank_cache_used, bank_cache_bank_size;
+volatile uint32_t bank_cache_active;		// bank core 1 is serving in the banked window
+uint32_t bank_cache_fixed;			// bank in the unbanked window, ~0 if none
+uint32_t bank_cache_use[128], bank_cache_clock;	// when core 1 last switched to each bank
+int bank_cache_dma = -1;
+
+static __force_inline uint8_t cart_flash_read(uint32_t offset) {
+	offset += cart_image_offset;
+	return *(const uint8_t *)(XIP_BASE + FLASH_FS_ENTRY_OFFSET(cart_chunks[offset >> 9]) + (offset & 0x1FF));
+}
+
+int map_cart_file(FIL *fil) {
+	// build cart_chunks[] from the cluster link map of the file
+	DWORD clmt[128];
+	FATFS *fs = fil->obj.fs;
+	int n = 0, num_chunks = (f_size(fil) + 511) / 512;
+
+	if (num_chunks > count_of(cart_chunks))
+		return 0;
+	clmt[0] = count_of(clmt);
+	fil->cltbl = clmt;
+	if (f_lseek(fil, CREATE_LINKMAP) != FR_OK) {
+		fil->cltbl = 0;
+		return 0;
+	}
+	fil->cltbl = 0;
+	for (DWORD *frag = &clmt[1]; frag[0] && n < num_chunks; frag += 2) {
+		for (DWORD cl = 0; cl < frag[0]; cl++) {
+			LBA_t sect = fs->database + (LBA_t)fs->csize * (frag[1] + cl - 2);
+			for (int i=0; i<fs->csize && n < num_chunks; i++) {
+				uint16_t entry = flash_fs_map_entry(sect + i);
+				if (!entry) return 0;	// never written
+				if (!flash_fs_entry_ok(entry)) return 0;	// bad, leave it to f_read to report
+				cart_chunks[n++] = entry;
+			}
+		}
+	}
+	return n == num_chunks;
+}
+
+void __not_in_flash_func(flash_copy)(unsigned char *dst, uint32_t offset, uint32_t len) {
+	// copy part of the mapped image to SRAM by DMA, a 512 byte chunk at a time
+	// (len is rounded up to whole words, dst must be word aligned)
+	if (bank_cache_dma < 0)
+		bank_cache_dma = dma_claim_unused_channel(true);
+	dma_channel_config c = dma_channel_get_default_config(bank_cache_dma);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, true);
+	offset += cart_image_offset;
+	while (len) {
+		uint32_t n = 512 - (offset & 0x1FF);
+		if (n > len) n = len;
+		const uint8_t *src = (const uint8_t *)(XIP_NOCACHE_NOALLOC_BASE +
+			FLASH_FS_ENTRY_OFFSET(cart_chunks[offset >> 9]) + (offset & 0x1FF));
+		dma_channel_configure(bank_cache_dma, &c, dst, src, (n + 3) / 4, true);
+		dma_channel_wait_for_finish_blocking(bank_cache_dma);
+		dst += n;
+		offset += n;
+		len -= n;
+	}
+	__dmb();
+}
+
+static unsigned char *__not_in_flash_func(evict_bank)() {
+	// free the slot of the least recently used bank, NULL if only the ones in use are left
+	while (1) {
+		int victim = -1;
+		for (int b=0; b<count_of(bank_cache); b++)
+			if (bank_cache[b] && b != bank_cache_active && b != bank_cache_fixed &&
+				(victim < 0 || bank_cache_use[b] < bank_cache_use[victim]))
+				victim = b;
+		if (victim < 0)
+			return NULL;
+		unsigned char *slot = bank_cache[victim];
+		bank_cache[victim] = NULL;
+		__dmb();
+		if (bank_cache_active != victim)
+			return slot;
+		bank_cache[victim] = slot;	// core 1 has just switched to it
+	}
+}
+
+int __not_in_flash_func(cache_bank)(uint32_t bank) {
+	unsigned char *slot;
+	if (bank >= count_of(bank_cache) || bank_cache[bank])
+		return 1;
+	if (bank_cache_used + bank_cache_bank_size <= sizeof(cart_ram)) {
+		slot = &cart_ram[bank_cache_used];
+		bank_cache_used += bank_cache_bank_size;
+	}
+	else if (!(slot = evict_bank()))
+		return 0;
+	flash_copy(slot, bank * bank_cache_bank_size, bank_cache_bank_size);
+	bank_cache[bank] = slot;
+	return 1;
+}
+
+void __not_in_flash_func(bank_cache_touch)(uint32_t bank) {
+	if (bank < count_of(bank_cache))
+		bank_cache_use[bank] = ++bank_cache_clock;
+}
+
+void init_bank_cache(uint32_t bank_size, uint32_t active, uint32_t fixed) {
+	for (int i=0; i<count_of(bank_cache); i++) {
+		bank_cache[i] = NULL;
+		bank_cache_use[i] = 0;
+	}
+	bank_cache_used = 0;
+	bank_cache_bank_size = bank_size;
+	bank_cache_active = active;
+	bank_cache_fixed = fixed;
+	bank_cache_clock = 0;
+}
+
+void __not_in_flash_func(bank_cache_main)() {
+	// core 0, while core 1 serves a flash cart. Switches that didn't fit in the FIFO only
+	// cost recency, the bank core 1 is on is always read from bank_cache_active.
+	while (1) {
+		bank_cache_touch(bus_fifo_pop());
+		cache_bank(bank_cache_active);
+	}
+}
+
 int load_file(char *filename) {
-	FATFS FatFs;
 	int cart_type = CART_TYPE_NONE;
 	int car_file = 0, xex_file = 0, expectedSize = 0;
 	unsigned char carFileHeader[16];
@@ -398,7 +929,9 @@ int load_file(char *filename) {
 	if (strncasecmp(filename+strlen(filename)-4, ".XEX", 4) == 0)
 		xex_file = 1;
 
-	if (f_mount(&FatFs, "", 1) != FR_OK) {
+	listing_valid = 0;	// cart_ram is about to be overwritten
+	drop_read_ahead();
+	if (!mount_fatfs()) {
 		strcpy(errorBuf, "Can't read flash memory");
 		return 0;
 	}
@@ -415,41 +948,13 @@ int load_file(char *filename) {
 			goto closefile;
 		}
 		int car_type = carFileHeader[7];
-		if (car_type == 1)			{ cart_type = CART_TYPE_8K; expectedSize = 8192; }
-		else if (car_type == 2)		{ cart_type = CART_TYPE_16K; expectedSize = 16384; }
-		else if (car_type == 3) 	{ cart_type = CART_TYPE_OSS_16K_034M; expectedSize = 16384; }
-		else if (car_type == 8)		{ cart_type = CART_TYPE_WILLIAMS_64K; expectedSize = 65536; }
-		else if (car_type == 9)		{ cart_type = CART_TYPE_EXPRESS_64K; expectedSize = 65536; }
-		else if (car_type == 10)	{ cart_type = CART_TYPE_DIAMOND_64K; expectedSize = 65536; }
-		else if (car_type == 11)	{ cart_type = CART_TYPE_SDX_64K; expectedSize = 65536; }
-		else if (car_type == 12) 	{ cart_type = CART_TYPE_XEGS_32K; expectedSize = 32768; }
-		else if (car_type == 13) 	{ cart_type = CART_TYPE_XEGS_64K; expectedSize = 65536; }
-		else if (car_type == 14) 	{ cart_type = CART_TYPE_XEGS_128K; expectedSize = 131072; }
-		else if (car_type == 15) 	{ cart_type = CART_TYPE_OSS_16K_TYPE_B; expectedSize = 16384; }
-		else if (car_type == 17) 	{ cart_type = CART_TYPE_ATRAX_128K; expectedSize = 131072; }
-		else if (car_type == 18) 	{ cart_type = CART_TYPE_BOUNTY_BOB; expectedSize = 40960; }
-		else if (car_type == 22)	{ cart_type = CART_TYPE_WILLIAMS_64K; expectedSize = 32768; }
-		else if (car_type == 26)	{ cart_type = CART_TYPE_MEGACART_16K; expectedSize = 16384; }
-		else if (car_type == 27)	{ cart_type = CART_TYPE_MEGACART_32K; expectedSize = 32768; }
-		else if (car_type == 28)	{ cart_type = CART_TYPE_MEGACART_64K; expectedSize = 65536; }
-		else if (car_type == 29)	{ cart_type = CART_TYPE_MEGACART_128K; expectedSize = 131072; }
-		else if (car_type == 33)	{ cart_type = CART_TYPE_SW_XEGS_32K; expectedSize = 32768; }
-		else if (car_type == 34)	{ cart_type = CART_TYPE_SW_XEGS_64K; expectedSize = 65536; }
-		else if (car_type == 35)	{ cart_type = CART_TYPE_SW_XEGS_128K; expectedSize = 131072; }
-		else if (car_type == 39)	{ cart_type = CART_TYPE_PHOENIX_8K;  expectedSize = 8192; }
-		else if (car_type == 40)	{ cart_type = CART_TYPE_BLIZZARD_16K; expectedSize = 16384; }
-		else if (car_type == 41)	{ cart_type = CART_TYPE_ATARIMAX_1MBIT; expectedSize = 131072; }
-		else if (car_type == 43)	{ cart_type = CART_TYPE_SDX_128K; expectedSize = 131072; }
-		else if (car_type == 44)	{ cart_type = CART_TYPE_OSS_8K; expectedSize = 8192; }
-		else if (car_type == 45) 	{ cart_type = CART_TYPE_OSS_16K_043M; expectedSize = 16384; }
-		else if (car_type == 46) 	{ cart_type = CART_TYPE_BLIZZARD_4K; expectedSize = 4096; }
-		else if (car_type == 50)	{ cart_type = CART_TYPE_TURBOSOFT_64K; expectedSize = 65536; }
-		else if (car_type == 51)	{ cart_type = CART_TYPE_TURBOSOFT_128K; expectedSize = 131072; }
-		else if (car_type == 52)	{ cart_type = CART_TYPE_MICROCALC; expectedSize = 32768; }
-		else if (car_type == 54)	{ cart_type = CART_TYPE_SIC_128K; expectedSize = 131072; }
-		else if (car_type == 57)	{ cart_type = CART_TYPE_2K; expectedSize = 2048; }
-		else if (car_type == 58)	{ cart_type = CART_TYPE_4K; expectedSize = 4096; }
-		else {
+		for (int i=0; i<count_of(car_types); i++)
+			if (car_types[i].car_type == car_type) {
+				cart_type = car_types[i].cart_type;
+				expectedSize = car_types[i].size;
+				break;
+			}
+		if (cart_type == CART_TYPE_NONE) {
 			strcpy(errorBuf, "Unsupported CAR type");
 			goto closefile;
 		}
@@ -458,19 +963,58 @@ int load_file(char *filename) {
 	// set a default error
 	strcpy(errorBuf, "Can't read file");
 
+	// find the file in flash, so it can be copied (or served) without going through FatFs
+	flash_cart = false;
+	cart_image_offset = car_file ? 16 : 0;
+	int mapped = map_cart_file(&fil);
+
+	if (!xex_file && f_size(&fil) - cart_image_offset > sizeof(cart_ram))
+	{	// too big for SRAM, serve it from flash
+		size = f_size(&fil) - cart_image_offset;
+		if (!car_file) {
+			if (size == 256*1024) { cart_type = CART_TYPE_XEGS_256K; expectedSize = size; }
+			else if (size == 512*1024) { cart_type = CART_TYPE_XEGS_512K; expectedSize = size; }
+			else if (size == 1024*1024) { cart_type = CART_TYPE_XEGS_1024K; expectedSize = size; }
+		}
+		if (expectedSize <= sizeof(cart_ram)) {
+			strcpy(errorBuf, "Cart file too big (>128k)");
+			cart_type = CART_TYPE_NONE;
+		}
+		else if (size != expectedSize) {
+			strcpy(errorBuf, "CAR file is wrong size");
+			cart_type = CART_TYPE_NONE;
+		}
+		else if (!mapped) {
+			strcpy(errorBuf, "Can't map file in flash");
+			cart_type = CART_TYPE_NONE;
+		}
+		else
+			flash_cart = true;
+		goto closefile;
+	}
+
 	unsigned char *dst = &cart_ram[0];
 	int bytes_to_read = 128 * 1024;
 	if (xex_file) {
 		dst += 4;	// leave room for the file length at the start of sram
 		bytes_to_read -= 4;
 	}
-	// read the file to SRAM
-	if (f_read(&fil, dst, bytes_to_read, &br) != FR_OK) {
+	if (mapped) {
+		// copy the file to SRAM straight from flash
+		size = f_size(&fil) - cart_image_offset;
+		if (size > bytes_to_read) {
+			strcpy(errorBuf, "Cart file/XEX too big (>128k)");
+			cart_type = CART_TYPE_NONE;
+			goto closefile;
+		}
+		flash_copy(dst, 0, size);
+	}
+	// otherwise read the file to SRAM
+	else if (f_read(&fil, dst, bytes_to_read, &br) != FR_OK) {
 		cart_type = CART_TYPE_NONE;
 		goto closefile;
 	}
-	size += br;
-	if (br == bytes_to_read) {
+	else if ((size = br) == bytes_to_read) {
 		// that's 128k read, is there any more?
 		if (f_read(&fil, carFileHeader, 1, &br) != FR_OK) {
 			cart_type = CART_TYPE_NONE;
@@ -531,8 +1075,6 @@ int load_file(char *filename) {
 closefile:
 	f_close(&fil);
 cleanup:
-	f_mount(0, "", 1);
-
 	return cart_type;
 }
 
@@ -547,9 +1089,21 @@ cleanup:
  Atari polls $D500 until it reads $11. At this point it knows the mcu is back
  and it is safe to rts back to code in cartridge ROM again.
  Results of the command are in $D501-$D5DF
+
+ The bus is served by core 1. Its menu loop and stack live in SCRATCH_X, the $D5xx mailbox in
+ SCRATCH_Y and the cart loops in SRAM. The only flash it reads is a bank of a large cart
+ that core 0 hasn't copied into SRAM yet (see Large carts). Core 0 runs the commands (FatFs,
+ loading files etc.) and the two cores talk over the SIO FIFO:
+   core 1 -> core 0: command byte written to $D5DF
+   core 0 -> core 1: BUS_MSG_xxx, what to serve next
+ Core 1 only waits on the FIFO between commands, when the Atari is running from its own RAM.
 */
 
-int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
+#define BUS_MSG_MENU		0x000	// serve the boot rom until the next command
+#define BUS_MSG_ATR_MODE	0x100	// boot rom with RD5 low (ATR mode)
+#define BUS_MSG_CART		0x200	// emulate the cart type in the low byte, never returns
+
+int __scratch_x("atari_bus") emulate_boot_rom(int atrMode) {
 	if (atrMode) RD5_LOW; else RD5_HIGH;
 	RD4_LOW;
     cart_d5xx[0x00] = 0x11;	// signal that we are here
@@ -559,7 +1113,7 @@ int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
     while (1)
     {
         // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+		while (!((pins = READ_PINS) & PHI2_GPIO_MASK)) ;
 
         if (!(pins & CCTL_GPIO_MASK))
         {   // CCTL low
@@ -567,9 +1121,9 @@ int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
             {   // atari is reading
                 SET_DATA_MODE_OUT;
                 addr = pins & ADDR_GPIO_MASK;
-                gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(cart_d5xx[addr&0xFF])) << 13);
+                PUT_DATA(cart_d5xx[addr&0xFF]);
                 // wait for phi2 low
-                while (gpio_get_all() & PHI2_GPIO_MASK) ;
+                while (READ_PINS & PHI2_GPIO_MASK) ;
                 SET_DATA_MODE_IN;
             }
             else
@@ -577,9 +1131,9 @@ int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
                 addr = pins & 0xFF;
 				last = pins;
                 // read data bus on falling edge of phi2
-                while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
+                while ((pins = READ_PINS) & PHI2_GPIO_MASK)
                     last = pins;
-                data = (last & DATA_GPIO_MASK) >> 13;
+                data = GET_DATA(last);
                 cart_d5xx[addr] = data;
                 if (addr == 0xDF)	// write to $D5DF
                     break;
@@ -589,936 +1143,602 @@ int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
         {   // normal cartridge read
             SET_DATA_MODE_OUT;
             addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(A8PicoCart_rom[addr])) << 13);
+            PUT_DATA(A8PicoCart_rom[addr]);
             // wait for phi2 low
-            while (gpio_get_all() & PHI2_GPIO_MASK) ;
+            while (READ_PINS & PHI2_GPIO_MASK) ;
             SET_DATA_MODE_IN;
         }
     }
     return data;
 }
 
-void __not_in_flash_func(emulate_standard_8k)() {
+/*
+ Standard 8k & 16k carts are served by PIO (see atari_cart.pio). The address state machine
+ pushes the SRAM address of each S4/S5 read, a pair of chained DMA channels fetch the byte
+ and the data state machine drives it onto the bus until PHI2 falls. Data-valid latency is
+ fixed by the PIO program rather than by how quickly the cpu loop comes round.
+*/
+void start_pio_cart(bool is16k) {
+	PIO pio = pio0;
+	uint sm_addr = 0, sm_data = 1;
+	uint offset;
+	pio_sm_config c;
+
+	// address state machine
+	if (is16k) {
+		offset = pio_add_program(pio, &atari_cart_16k_program);
+		c = atari_cart_16k_program_get_default_config(offset);
+		sm_config_set_jmp_pin(&c, PHI2_PIN);
+	}
+	else {
+		offset = pio_add_program(pio, &atari_cart_8k_program);
+		c = atari_cart_8k_program_get_default_config(offset);
+		sm_config_set_jmp_pin(&c, S5_PIN);
+	}
+	sm_config_set_in_pins(&c, 0);
+	sm_config_set_in_shift(&c, false, false, 32);
+	sm_config_set_out_shift(&c, true, false, 32);
+	pio_sm_init(pio, sm_addr, offset, &c);
+	// x = window base (cart_ram is 16k aligned)
+	pio_sm_put(pio, sm_addr, ((uint32_t)&cart_ram[0]) >> (is16k ? 14 : 13));
+	pio_sm_exec(pio, sm_addr, pio_encode_pull(false, false));
+	pio_sm_exec(pio, sm_addr, pio_encode_mov(pio_x, pio_osr));
+
+	// data state machine
+	offset = pio_add_program(pio, &atari_cart_data_program);
+	c = atari_cart_data_program_get_default_config(offset);
+	sm_config_set_out_pins(&c, DATA_PIN_BASE, 8);
+	sm_config_set_out_shift(&c, true, false, 32);
+	for (int i=0; i<8; i++)
+		pio_gpio_init(pio, DATA_PIN_BASE + i);
+	pio_sm_set_consecutive_pindirs(pio, sm_data, DATA_PIN_BASE, 8, false);
+	pio_sm_init(pio, sm_data, offset, &c);
+
+	// dma: address from the rx fifo is written to the read trigger of the byte channel,
+	// which copies cart_ram[addr] to the data state machine and re-arms the address channel
+	int dma_addr = dma_claim_unused_channel(true);
+	int dma_byte = dma_claim_unused_channel(true);
+	dma_channel_config dc = dma_channel_get_default_config(dma_addr);
+	channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+	channel_config_set_read_increment(&dc, false);
+	channel_config_set_write_increment(&dc, false);
+	channel_config_set_dreq(&dc, pio_get_dreq(pio, sm_addr, false));
+	channel_config_set_high_priority(&dc, true);
+	dma_channel_configure(dma_addr, &dc, &dma_hw->ch[dma_byte].al3_read_addr_trig, &pio->rxf[sm_addr], 1, false);
+
+	dc = dma_channel_get_default_config(dma_byte);
+	channel_config_set_transfer_data_size(&dc, DMA_SIZE_8);
+	channel_config_set_read_increment(&dc, false);
+	channel_config_set_write_increment(&dc, false);
+	channel_config_set_dreq(&dc, pio_get_dreq(pio, sm_data, true));
+	channel_config_set_chain_to(&dc, dma_addr);
+	channel_config_set_high_priority(&dc, true);
+	dma_channel_configure(dma_byte, &dc, &pio->txf[sm_data], NULL, 1, false);
+
+	dma_channel_start(dma_addr);
+	pio_sm_set_enabled(pio, sm_data, true);
+	pio_sm_set_enabled(pio, sm_addr, true);
+}
+
+void emulate_standard_8k() {
 	// 8k
 	RD4_LOW;
 	RD5_HIGH;
-
-    uint32_t pins;
-    uint16_t addr;
+	start_pio_cart(false);
 	while (1)
-	{      
-		// wait for s5 low
-        while ((pins = gpio_get_all()) & S5_GPIO_MASK) ;
-        SET_DATA_MODE_OUT;
-		// while s5 low
-		while(!((pins = gpio_get_all()) & S5_GPIO_MASK)) {
-			addr = pins & ADDR_GPIO_MASK;
-			gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-		}
-        SET_DATA_MODE_IN;
-	}
+		__wfe();
 }
 
-void __not_in_flash_func(emulate_standard_16k)() {
+void emulate_standard_16k() {
 	// 16k
 	RD4_HIGH;
 	RD5_HIGH;
-
-    uint32_t pins;
-    uint16_t addr;
+	start_pio_cart(true);
 	while (1)
-	{
-		// wait for either s4 or s5 low
-		while (((pins = gpio_get_all()) & S4_S5_GPIO_MASK) == S4_S5_GPIO_MASK) ;
-		SET_DATA_MODE_OUT;
-		if (!(pins & S4_GPIO_MASK)) {
-			// while s4 low
-			while(!((pins = gpio_get_all()) & S4_GPIO_MASK)) {
-				addr = pins & ADDR_GPIO_MASK;
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-			}
-		}
-		else {
-			// while s5 low
-			while(!((pins = gpio_get_all()) & S5_GPIO_MASK)) {
-				addr = pins & ADDR_GPIO_MASK;
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x2000|addr]) << 13);
-			}
-		}
-		SET_DATA_MODE_IN;
-	}
+		__wfe();
 }
 
-void __not_in_flash_func(emulate_XEGS_32k)(char switchable) {
-	// 32k
-	RD4_HIGH;
-	RD5_HIGH;
+/*
+ Banked cartridge bus engine
+ ---------------------------
+ Every banked cart type is described by a CART_DESC: which of the S4 ($8000-$9FFF) and
+ S5 ($A000-$BFFF) windows it serves, where they start in cart_ram, the initial RD4/RD5
+ state and how an access to $D5xx (CCTL) is decoded. bus_engine() is force inlined into one
+ function per CART_EMULATORS entry, in SRAM, with its descriptor as a compile time constant.
+ So each type gets its own loop, as when they were written out by hand: the windows it
+ doesn't serve, the split and flash paths it doesn't use and the function pointers all fold
+ away, and the decoders (also force inlined) are compiled in. Nothing is read from the
+ descriptors, which are in flash, while the loop runs.
+
+ To add a cart type: write a descriptor (plus a cctl_xxx function if none of the existing
+ decoders fit), add it to CART_EMULATORS and add its CAR header id to car_types[].
+*/
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
+#define CCTL_NONE		0	// $D5xx ignored
+#define CCTL_ADDR		1	// any access, decoded from the address lines
+#define CCTL_WRITE		2	// writes only, data read on falling edge of phi2
+#define CCTL_READ_WRITE	3	// writes as CCTL_WRITE, reads answered by cctl_read()
 
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+#define WINDOW_S4		0	// 8k bank at $8000
+#define WINDOW_S5		1	// 8k bank at $A000
+#define WINDOW_S4_S5	2	// 16k bank at $8000-$BFFF
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x6000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 2 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 3));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
-				}
-			}
+#define BANK_SIZE(d)	((d)->bank_window == WINDOW_S4_S5 ? 16384 : 8192)
+
+typedef struct {
+	unsigned char *s4, *s4_hi;	// $8000 ($9000 when split)
+	unsigned char *s5, *s5_hi;	// $A000 ($B000 when split)
+	unsigned char *d5xx;		// $D5xx read window (XEX loader)
+	bool rd4_high, rd5_high;	// 400/800 MMU
+	uint32_t bank;
+	uint32_t flash_bank;		// bank in the banked window (flash carts)
+	uint8_t reg;				// last value written to $D5xx
+} CART_STATE;
+
+typedef struct CART_DESC CART_DESC;
+struct CART_DESC {
+	bool s4, s5;				// windows served
+	bool s4_split, s5_split;	// window is made of two independently banked 4k halves
+	bool rd4, rd5;				// initial RD4/RD5
+	uint32_t s4_base, s4_hi_base, s5_base, s5_hi_base;	// initial window offsets in cart_ram
+	uint8_t cctl;				// CCTL_xxx
+	uint16_t cctl_mask, cctl_match;	// only $D5xx addresses where (addr & mask) == match
+	uint8_t bank_window;		// WINDOW_xxx (cctl_bank)
+	uint32_t bank_mask;
+	uint8_t disable_bit;		// bit in the bank value that switches the cart off (cctl_bank)
+	bool flash;					// banks come from the bank cache / flash (large carts)
+	uint32_t init_bank, fixed_bank;	// flash carts: initial bank, bank in the unbanked window
+	void (*cctl_access)(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data);
+	uint8_t (*cctl_read)(const CART_DESC *d, CART_STATE *s, uint16_t addr);
+	void (*s4_read)(const CART_DESC *d, CART_STATE *s, uint16_t addr);
+};
+
+static __force_inline void set_rd4(CART_STATE *s, bool high) {
+	gpio_put(RD4_PIN, high);
+	s->rd4_high = high;
+}
+
+static __force_inline void set_rd5(CART_STATE *s, bool high) {
+	gpio_put(RD5_PIN, high);
+	s->rd5_high = high;
+}
+
+static __force_inline void map_bank(const CART_DESC *d, CART_STATE *s, unsigned char *ptr) {
+	if (d->bank_window == WINDOW_S4)
+		s->s4 = ptr;
+	else if (d->bank_window == WINDOW_S5)
+		s->s5 = ptr;
+	else {
+		s->s4 = ptr;
+		s->s5 = ptr ? ptr + 0x2000 : NULL;
+	}
+}
+
+static __force_inline void select_bank(const CART_DESC *d, CART_STATE *s, uint32_t bank) {
+	if (d->flash) {
+		// publish the bank before looking it up, see Large carts. NULL = not cached yet,
+		// read it from flash until core 0 has copied it
+		bank_cache_active = bank;
+		__dmb();
+		unsigned char *ptr = bank_cache[bank];
+		s->flash_bank = bank;
+		if (multicore_fifo_wready()) {	// every switch, for core 0's LRU
+			sio_hw->fifo_wr = bank;
+			__sev();
 		}
+		map_bank(d, s, ptr);
 	}
+	else
+		map_bank(d, s, &cart_ram[BANK_SIZE(d) * bank]);
 }
 
-void __not_in_flash_func(emulate_XEGS_64k)(char switchable) {
-	// 64k
-	RD4_HIGH;
-	RD5_HIGH;
+static __force_inline uint8_t read_flash_bank(const CART_DESC *d, CART_STATE *s, uint16_t offset) {
+	unsigned char *ptr = bank_cache[s->flash_bank];
+	if (ptr) {	// core 0 has cached it now
+		map_bank(d, s, ptr);
+		return ptr[offset];
+	}
+	return cart_flash_read(s->flash_bank * BANK_SIZE(d) + offset);
+}
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
+static __force_inline void bus_engine(const CART_DESC *d) {
+	CART_STATE state = {0}, *s = &state;
+	uint32_t pins, last;
+	uint16_t addr;
+	uint8_t data;
+	const uint32_t cctl_mask = CCTL_GPIO_MASK | d->cctl_mask;
+	const uint16_t s5_flash_offset = d->bank_window == WINDOW_S4_S5 ? 0x2000 : 0;
+
+	s->s4 = &cart_ram[d->s4_base];
+	s->s4_hi = &cart_ram[d->s4_hi_base];
+	s->s5 = &cart_ram[d->s5_base];
+	s->s5_hi = &cart_ram[d->s5_hi_base];
+	s->d5xx = &cart_ram[0];
+	if (d->flash) {
+		select_bank(d, s, d->init_bank);
+		if (d->bank_window == WINDOW_S4)
+			s->s5 = bank_cache[d->fixed_bank];
+	}
+	set_rd4(s, d->rd4);
+	set_rd5(s, d->rd5);
 
 	while (1)
 	{
 		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+		while (!((pins = READ_PINS) & PHI2_GPIO_MASK)) ;
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
+		if (d->s4 && (pins & (S4_GPIO_MASK|RW_GPIO_MASK)) == RW_GPIO_MASK && s->rd4_high)
+		{	// s4 low, atari reading
+			SET_DATA_MODE_OUT;
+			addr = pins & ADDR_GPIO_MASK;
+			if (d->s4_split)
+				data = (addr & 0x1000) ? s->s4_hi[addr & 0xFFF] : s->s4[addr & 0xFFF];
+			else if (!d->flash || s->s4)
+				data = s->s4[addr];
+			else	// flash cart, bank not cached yet
+				data = read_flash_bank(d, s, addr);
+			PUT_DATA(data);
+			if (d->s4_read)
+				d->s4_read(d, s, addr);
 		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0xE000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
+		else if (d->s5 && (pins & (S5_GPIO_MASK|RW_GPIO_MASK)) == RW_GPIO_MASK && s->rd5_high)
+		{	// s5 low, atari reading
+			SET_DATA_MODE_OUT;
+			addr = pins & ADDR_GPIO_MASK;
+			if (d->s5_split)
+				data = (addr & 0x1000) ? s->s5_hi[addr & 0xFFF] : s->s5[addr & 0xFFF];
+			else if (!d->flash || s->s5)
+				data = s->s5[addr];
+			else
+				data = read_flash_bank(d, s, s5_flash_offset + addr);
+			PUT_DATA(data);
 		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 3 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 7));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
-				}
+		else if (d->cctl == CCTL_ADDR && (pins & cctl_mask) == d->cctl_match)
+		{	// CCTL low
+			d->cctl_access(d, s, pins & ADDR_GPIO_MASK, 0);
+		}
+		else if ((d->cctl == CCTL_WRITE || d->cctl == CCTL_READ_WRITE) && (pins & cctl_mask) == d->cctl_match)
+		{	// CCTL low, CCTL_WRITE or CCTL_READ_WRITE
+			addr = pins & ADDR_GPIO_MASK;
+			if (!(pins & RW_GPIO_MASK))
+			{	// atari is writing
+				last = pins;
+				// read data bus on falling edge of phi2
+				while ((pins = READ_PINS) & PHI2_GPIO_MASK)
+					last = pins;
+				d->cctl_access(d, s, addr, GET_DATA(last));
+				continue;
+			}
+			else if (d->cctl == CCTL_READ_WRITE)
+			{	// atari is reading
+				SET_DATA_MODE_OUT;
+				PUT_DATA(d->cctl_read(d, s, addr));
 			}
+			else
+				continue;
 		}
+		else
+			continue;	// nothing for us yet, sample again while phi2 is high
+		// wait for phi2 low
+		while (READ_PINS & PHI2_GPIO_MASK) ;
+		SET_DATA_MODE_IN;
 	}
 }
 
-void __not_in_flash_func(emulate_XEGS_128k)(char switchable) {
-	// 128k
-	RD4_HIGH;
-	RD5_HIGH;
+/* $D5xx decoders - named in the descriptors, inlined into each type's loop */
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
+// bank number in the low bits of the data (CCTL_WRITE) or address (CCTL_ADDR)
+static __force_inline void cctl_bank(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	uint32_t val = (d->cctl == CCTL_ADDR) ? addr : data;
+	select_bank(d, s, val & d->bank_mask);
+	if (d->disable_bit) {
+		bool enabled = !(val & d->disable_bit);
+		if (d->s4) set_rd4(s, enabled);
+		set_rd5(s, enabled);
+	}
+}
 
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+// SDX, Diamond & Express - inverted bank number in A0-A2 (and A4 on 128k SDX), A3 disables
+static __force_inline void cctl_sdx(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	uint32_t bank = ((~addr) & 0x7) | (((~addr) & 0x10) >> 1);
+	select_bank(d, s, bank & d->bank_mask);
+	set_rd5(s, !(addr & 0x8));
+}
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x1E000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 4 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 0xF));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
-				}
-			}
-		}
+static __force_inline void cctl_oss_b(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	int a0 = addr & 1, a3 = addr & 8;
+	if (a3 && !a0) set_rd5(s, false);
+	else {
+		set_rd5(s, true);
+		if (!a3 && !a0) s->bank = 1;
+		else if (!a3 && a0) s->bank = 3;
+		else if (a3 && a0) s->bank = 2;
+		s->s5 = &cart_ram[4096 * s->bank];
 	}
 }
 
-void __not_in_flash_func(emulate_bounty_bob)() {
-	// 40k
-	RD4_HIGH;
-	RD5_HIGH;
+static __force_inline void cctl_oss_a(CART_STATE *s, uint16_t addr, bool is034M) {
+	addr &= 0xF;
+	if (addr & 0x8) set_rd5(s, false);
+	else {
+		set_rd5(s, true);
+		if (addr == 0x0) s->bank = 0;
+		if (addr == 0x3 || addr == 0x7) s->bank = is034M ? 1 : 2;
+		if (addr == 0x4) s->bank = is034M ? 2 : 1;
+		s->s5 = &cart_ram[4096 * s->bank];
+	}
+}
 
-    uint32_t pins;
-    uint16_t addr;
-	unsigned char *bankPtr1 = &cart_ram[0], *bankPtr2 =  &cart_ram[0x4000];
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-		
-        if (!(pins & S4_GPIO_MASK))
-		{	// s4 low
-			SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-			if (addr & 0x1000) {
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr2+(addr&0xFFF)))) << 13);
-				if (addr == 0x1FF6) bankPtr2 = &cart_ram[0x4000];
-				else if (addr == 0x1FF7) bankPtr2 = &cart_ram[0x5000];
-				else if (addr == 0x1FF8) bankPtr2 = &cart_ram[0x6000];
-				else if (addr == 0x1FF9) bankPtr2 = &cart_ram[0x7000];
-			}
-			else {
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr1+(addr&0xFFF)))) << 13);
-				if (addr == 0x0FF6) bankPtr1 = &cart_ram[0];
-				else if (addr == 0x0FF7) bankPtr1 = &cart_ram[0x1000];
-				else if (addr == 0x0FF8) bankPtr1 = &cart_ram[0x2000];
-				else if (addr == 0x0FF9) bankPtr1 = &cart_ram[0x3000];
-			}
-		}
-		else if (!(pins & S5_GPIO_MASK))
-		{	// s5 low
-			SET_DATA_MODE_OUT;
-			addr = pins & ADDR_GPIO_MASK;
-			gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x8000|addr]) << 13);
-		}
-		// wait for phi2 low
-		while (gpio_get_all() & PHI2_GPIO_MASK) ;
-		SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_atarimax_128k)() {
-	// 128k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *ramPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		ramPtr = &cart_ram[0] + (8192 * (bank & 0xF));
-
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-            if ((addr & 0xE0) == 0) {
-				bank = addr & 0xF;
-				if (addr & 0x10)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-            }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline void cctl_oss_034m(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	cctl_oss_a(s, addr, true);
 }
 
-void __not_in_flash_func(emulate_williams)() {
-	// williams 32k, 64k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-            if ((addr & 0xF0) == 0) {
-				bank = addr & 0x07;
-				if (addr & 0x08)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-            }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline void cctl_oss_043m(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	cctl_oss_a(s, addr, false);
 }
 
-void __not_in_flash_func(emulate_OSS_B)() {
-	// OSS type B
-	RD5_HIGH;
-	RD4_LOW;
-    uint32_t pins;
-    uint16_t addr;
-	uint32_t bank = 1;
-	unsigned char *bankPtr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-		// select the right SRAM block, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (4096*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-			if (addr & 0x1000)
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr&0xFFF]) << 13);
-			else
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-		}
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			int a0 = addr & 1, a3 = addr & 8;
-			if (a3 && !a0) { RD5_LOW; rd5_high = false; }
-			else {
-				RD5_HIGH;
-				rd5_high = true;
-				if (!a3 && !a0) bank = 1;
-				else if (!a3 && a0) bank = 3;
-				else if (a3 && a0) bank = 2;
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline void cctl_sic(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	s->reg = data;
+	select_bank(d, s, data & d->bank_mask);
+	set_rd5(s, !(data & 0x40));
+	set_rd4(s, data & 0x20);
 }
 
-void __not_in_flash_func(emulate_OSS_A)(char is034M) {
-	// OSS type A (034M, 043M)
-	RD5_HIGH;
-	RD4_LOW;
-    uint32_t pins;
-    uint16_t addr;
-	uint32_t bank = 0;
-	unsigned char *bankPtr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-		// select the right SRAM block, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (4096*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-			if (addr & 0x1000)
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr|0x2000]) << 13);	// 4k bank #3 always mapped to $Bxxx
-			else
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-		}
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & 0xF;
-			if (addr & 0x8) { RD5_LOW; rd5_high = false; }
-			else {
-				RD5_HIGH; rd5_high = true;
-				if (addr == 0x0) bank = 0;
-				if (addr == 0x3 || addr == 0x7) bank = is034M ? 1 : 2;
-				if (addr == 0x4) bank = is034M ? 2 : 1;
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline uint8_t cctl_read_reg(const CART_DESC *d, CART_STATE *s, uint16_t addr) {
+	return s->reg;
 }
 
-void __not_in_flash_func(emulate_megacart)(int size) {
-	// 16k - 128k
-	RD4_HIGH;
-	RD5_HIGH;
-
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	uint32_t bank_mask = 0x00;
-	if (size == 32) bank_mask = 0x1;
-	else if (size == 64) bank_mask = 0x3;
-	else if (size == 128) bank_mask = 0x7;
-
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
-
-	unsigned char *ramPtr = &cart_ram[0];
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr+(addr|0x2000)))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low n bits written to $D5xx
-			int bank = data & bank_mask;
-			ramPtr = &cart_ram[0] + 16384 * (bank&0x7);
-			if (data & 0x80) {
-				RD4_LOW; RD5_LOW;
-				rd4_high = rd5_high = false;
-			} else {
-				RD4_HIGH; RD5_HIGH;
-				rd4_high = rd5_high = true;
-			}
-		}
+static __force_inline void cctl_microcalc(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	s->bank = (s->bank + 1) % 5;
+	if (s->bank == 4)	// disable
+		set_rd5(s, false);
+	else {
+		set_rd5(s, true);
+		select_bank(d, s, s->bank);
 	}
 }
 
-void __not_in_flash_func(emulate_SIC)() {
-	// 128k
-	RD5_HIGH;
-	RD4_LOW;
-
-    uint32_t pins, last;
-    uint16_t addr;
-	uint8_t SIC_byte = 0;
-	unsigned char *ramPtr = &cart_ram[0];
-	bool rd4_high = false, rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-        {   // s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-        }
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + (addr|0x2000)))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xE0) == 0)
-			{
-				if (pins & RW_GPIO_MASK)
-				{   // read from $D5xx
-		            SET_DATA_MODE_OUT;
-					gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)SIC_byte) << 13);
-					// wait for phi2 low
-					while (gpio_get_all() & PHI2_GPIO_MASK) ;
-					SET_DATA_MODE_IN;
-				}
-				else
-				{	// write to $D5xx
-					last = pins;
-					// read data bus on falling edge of phi2
-					while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-						last = pins;
-					SIC_byte = (last & DATA_GPIO_MASK) >> 13;
-					// switch bank
-					ramPtr = &cart_ram[0] + 16384 * (SIC_byte&0x7);
-					if (SIC_byte & 0x40) { RD5_LOW; rd5_high = false; } else { RD5_HIGH; rd5_high = true; }
-					if (SIC_byte & 0x20) { RD4_HIGH; rd4_high = true; } else { RD4_LOW; rd4_high = false; }
-				}
-			}
-		}
-	}
+// blizzard & phoenix - any access switches the cart off
+static __force_inline void cctl_disable(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	if (d->s4) set_rd4(s, false);
+	set_rd5(s, false);
 }
 
-void __not_in_flash_func(emulate_SDX)(int size) {
-	// 64k/128k
-	RD5_HIGH;
-	RD4_LOW;
-
-	unsigned char *ramPtr = &cart_ram[0];
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xF0) == 0xE0) {
-				// 64k & 128k versions
-				if (size == 64) ramPtr = &cart_ram[0]; else ramPtr = &cart_ram[65536];
-				ramPtr += ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-			}
-			if (size == 128 && (addr & 0xF0) == 0xF0) {
-				// 128k version only
-				ramPtr = &cart_ram[0] + ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline void cctl_xex(const CART_DESC *d, CART_STATE *s, uint16_t addr, uint8_t data) {
+	addr &= 0xFF;
+	if (addr == 0)
+		s->bank = (s->bank & 0xFF00) | data;
+	else if (addr == 1)
+		s->bank = (s->bank & 0x00FF) | ((data << 8) & 0xFF00);
+	s->d5xx = &cart_ram[256 * (s->bank & 0x01FF)];
 }
 
-void __not_in_flash_func(emulate_diamond_express)(uint8_t cctlAddr) {
-	// 64k
-	RD5_HIGH;
-	RD4_LOW;
-
-	unsigned char *ramPtr = &cart_ram[0];
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xF0) == cctlAddr) {
-				ramPtr = &cart_ram[0] + ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH;  rd5_high = true; }
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+static __force_inline uint8_t cctl_read_xex(const CART_DESC *d, CART_STATE *s, uint16_t addr) {
+	return s->d5xx[addr & 0xFF];
 }
 
-void __not_in_flash_func(emulate_blizzard)() {
-	//16k
-	RD4_HIGH;
-	RD5_HIGH;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-        {   // s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-		}
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x2000|addr]) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-			RD4_LOW; RD5_LOW;
-			rd4_high = rd5_high = false;
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+// bounty bob - reads of $8FF6-$8FF9/$9FF6-$9FF9 select the 4k bank of each half of the S4 window
+static __force_inline void s4_read_bounty_bob(const CART_DESC *d, CART_STATE *s, uint16_t addr) {
+	if ((addr & 0xFFF) < 0xFF6 || (addr & 0xFFF) > 0xFF9)
+		return;
+	if (addr & 0x1000)
+		s->s4_hi = &cart_ram[0x4000 + 0x1000 * ((addr & 0xFFF) - 0xFF6)];
+	else
+		s->s4 = &cart_ram[0x1000 * ((addr & 0xFFF) - 0xFF6)];
 }
 
-void __not_in_flash_func(emulate_turbosoft)(int size) {
-	// 64k/128k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	uint32_t bank_mask = 0x00;
-	if (size == 64) bank_mask = 0x7;
-	else if (size == 128) bank_mask = 0xF;
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			bank = addr & bank_mask;
-			if (addr & 0x10)
-				{ RD5_LOW; rd5_high = false; }
-			else
-				{ RD5_HIGH; rd5_high = true; }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
+/* Cart descriptors */
 
-void __not_in_flash_func(emulate_atrax)() {
-	// 128k
-	RD4_LOW;
-	RD5_HIGH;
+#define XEGS_DESC(banks, switchable) { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, \
+	.s5_base = 8192 * ((banks) - 1), .cctl = CCTL_WRITE, .bank_window = WINDOW_S4, .bank_mask = (banks) - 1, \
+	.disable_bit = (switchable) ? 0x80 : 0, .cctl_access = cctl_bank }
 
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	bool rd5_high = true;	// 400/800 MMU
+static const CART_DESC xegs_32k = XEGS_DESC(4, false);
+static const CART_DESC xegs_64k = XEGS_DESC(8, false);
+static const CART_DESC xegs_128k = XEGS_DESC(16, false);
+static const CART_DESC sw_xegs_32k = XEGS_DESC(4, true);
+static const CART_DESC sw_xegs_64k = XEGS_DESC(8, true);
+static const CART_DESC sw_xegs_128k = XEGS_DESC(16, true);
 
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+#define XEGS_FLASH_DESC(banks, switchable) { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, \
+	.cctl = CCTL_WRITE, .bank_window = WINDOW_S4, .bank_mask = (banks) - 1, \
+	.disable_bit = (switchable) ? 0x80 : 0, .cctl_access = cctl_bank, .flash = true, .fixed_bank = (banks) - 1 }
 
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-        }
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 4 bits written to $D5xx
-			bank = data & 0xF;
-			if (data & 0x80)
-				{ RD5_LOW; rd5_high = false; }
-			else
-				{ RD5_HIGH; rd5_high = true; }
-        }
-	}
-}
+static const CART_DESC xegs_256k = XEGS_FLASH_DESC(32, false);
+static const CART_DESC xegs_512k = XEGS_FLASH_DESC(64, false);
+static const CART_DESC xegs_1024k = XEGS_FLASH_DESC(128, false);
+static const CART_DESC sw_xegs_256k = XEGS_FLASH_DESC(32, true);
+static const CART_DESC sw_xegs_512k = XEGS_FLASH_DESC(64, true);
+static const CART_DESC sw_xegs_1024k = XEGS_FLASH_DESC(128, true);
 
-void __not_in_flash_func(emulate_microcalc)() {
-	// 32k
-	RD4_LOW;
-	RD5_HIGH;
+#define MEGACART_DESC(banks) { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, \
+	.s5_base = 0x2000, .cctl = CCTL_WRITE, .bank_window = WINDOW_S4_S5, .bank_mask = (banks) - 1, \
+	.disable_bit = 0x80, .cctl_access = cctl_bank }
 
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
+static const CART_DESC megacart_16k = MEGACART_DESC(1);
+static const CART_DESC megacart_32k = MEGACART_DESC(2);
+static const CART_DESC megacart_64k = MEGACART_DESC(4);
+static const CART_DESC megacart_128k = MEGACART_DESC(8);
 
-	while (1)
+#define MEGACART_FLASH_DESC(banks) { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, \
+	.cctl = CCTL_WRITE, .bank_window = WINDOW_S4_S5, .bank_mask = (banks) - 1, \
+	.disable_bit = 0x80, .cctl_access = cctl_bank, .flash = true }
+
+static const CART_DESC megacart_256k = MEGACART_FLASH_DESC(16);
+static const CART_DESC megacart_512k = MEGACART_FLASH_DESC(32);
+static const CART_DESC megacart_1024k = MEGACART_FLASH_DESC(64);
+
+static const CART_DESC megamax_2m = { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S4_S5, .bank_mask = 0x7F, .disable_bit = 0x80, .cctl_access = cctl_bank, .flash = true };
+
+static const CART_DESC bounty_bob = { .s4 = true, .s5 = true, .s4_split = true, .rd4 = true, .rd5 = true,
+	.s4_hi_base = 0x4000, .s5_base = 0x8000, .s4_read = s4_read_bounty_bob };
+
+static const CART_DESC atarimax_128k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xE0,
+	.bank_window = WINDOW_S5, .bank_mask = 0xF, .disable_bit = 0x10, .cctl_access = cctl_bank };
+
+static const CART_DESC atarimax_8mbit = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7F, .disable_bit = 0x80, .cctl_access = cctl_bank,
+	.flash = true, .init_bank = 127 };
+
+static const CART_DESC atarimax_8mbit_new = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7F, .disable_bit = 0x80, .cctl_access = cctl_bank, .flash = true };
+
+static const CART_DESC williams = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xF0,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7, .disable_bit = 0x08, .cctl_access = cctl_bank };
+
+static const CART_DESC oss_b = { .s5 = true, .s5_split = true, .rd5 = true, .s5_base = 4096,
+	.cctl = CCTL_ADDR, .cctl_access = cctl_oss_b };
+
+static const CART_DESC oss_034m = { .s5 = true, .s5_split = true, .rd5 = true, .s5_hi_base = 0x3000,
+	.cctl = CCTL_ADDR, .cctl_access = cctl_oss_034m };
+
+static const CART_DESC oss_043m = { .s5 = true, .s5_split = true, .rd5 = true, .s5_hi_base = 0x3000,
+	.cctl = CCTL_ADDR, .cctl_access = cctl_oss_043m };
+
+static const CART_DESC sic_128k = { .s4 = true, .s5 = true, .rd5 = true, .s5_base = 0x2000,
+	.cctl = CCTL_READ_WRITE, .cctl_mask = 0xE0, .bank_window = WINDOW_S4_S5, .bank_mask = 0x7,
+	.cctl_access = cctl_sic, .cctl_read = cctl_read_reg };
+
+#define SIC_FLASH_DESC(banks) { .s4 = true, .s5 = true, .rd5 = true, \
+	.cctl = CCTL_READ_WRITE, .cctl_mask = 0xE0, .bank_window = WINDOW_S4_S5, .bank_mask = (banks) - 1, \
+	.cctl_access = cctl_sic, .cctl_read = cctl_read_reg, .flash = true }
+
+static const CART_DESC sic_256k = SIC_FLASH_DESC(16);
+static const CART_DESC sic_512k = SIC_FLASH_DESC(32);
+
+static const CART_DESC sdx_64k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xF0, .cctl_match = 0xE0,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7, .cctl_access = cctl_sdx };
+
+static const CART_DESC sdx_128k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xE0, .cctl_match = 0xE0,
+	.bank_window = WINDOW_S5, .bank_mask = 0xF, .cctl_access = cctl_sdx };
+
+static const CART_DESC diamond_64k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xF0, .cctl_match = 0xD0,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7, .cctl_access = cctl_sdx };
+
+static const CART_DESC express_64k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_mask = 0xF0, .cctl_match = 0x70,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7, .cctl_access = cctl_sdx };
+
+static const CART_DESC blizzard_16k = { .s4 = true, .s5 = true, .rd4 = true, .rd5 = true, .s5_base = 0x2000,
+	.cctl = CCTL_ADDR, .cctl_access = cctl_disable };
+
+static const CART_DESC turbosoft_64k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S5, .bank_mask = 0x7, .disable_bit = 0x10, .cctl_access = cctl_bank };
+
+static const CART_DESC turbosoft_128k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S5, .bank_mask = 0xF, .disable_bit = 0x10, .cctl_access = cctl_bank };
+
+static const CART_DESC atrax_128k = { .s5 = true, .rd5 = true, .cctl = CCTL_WRITE,
+	.bank_window = WINDOW_S5, .bank_mask = 0xF, .disable_bit = 0x80, .cctl_access = cctl_bank };
+
+static const CART_DESC microcalc = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR,
+	.bank_window = WINDOW_S5, .cctl_access = cctl_microcalc };
+
+static const CART_DESC phoenix_8k = { .s5 = true, .rd5 = true, .cctl = CCTL_ADDR, .cctl_access = cctl_disable };
+
+static const CART_DESC xex_loader = { .cctl = CCTL_READ_WRITE, .cctl_access = cctl_xex, .cctl_read = cctl_read_xex };
+
+//	cart type					descriptor
+#define CART_EMULATORS(X) \
+	X(CART_TYPE_XEGS_32K,		xegs_32k) \
+	X(CART_TYPE_XEGS_64K,		xegs_64k) \
+	X(CART_TYPE_XEGS_128K,		xegs_128k) \
+	X(CART_TYPE_SW_XEGS_32K,	sw_xegs_32k) \
+	X(CART_TYPE_SW_XEGS_64K,	sw_xegs_64k) \
+	X(CART_TYPE_SW_XEGS_128K,	sw_xegs_128k) \
+	X(CART_TYPE_BOUNTY_BOB,		bounty_bob) \
+	X(CART_TYPE_ATARIMAX_1MBIT,	atarimax_128k) \
+	X(CART_TYPE_WILLIAMS_64K,	williams) \
+	X(CART_TYPE_OSS_16K_TYPE_B,	oss_b) \
+	X(CART_TYPE_OSS_8K,			oss_b) \
+	X(CART_TYPE_OSS_16K_034M,	oss_034m) \
+	X(CART_TYPE_OSS_16K_043M,	oss_043m) \
+	X(CART_TYPE_MEGACART_16K,	megacart_16k) \
+	X(CART_TYPE_MEGACART_32K,	megacart_32k) \
+	X(CART_TYPE_MEGACART_64K,	megacart_64k) \
+	X(CART_TYPE_MEGACART_128K,	megacart_128k) \
+	X(CART_TYPE_SIC_128K,		sic_128k) \
+	X(CART_TYPE_SDX_64K,		sdx_64k) \
+	X(CART_TYPE_SDX_128K,		sdx_128k) \
+	X(CART_TYPE_DIAMOND_64K,	diamond_64k) \
+	X(CART_TYPE_EXPRESS_64K,	express_64k) \
+	X(CART_TYPE_BLIZZARD_16K,	blizzard_16k) \
+	X(CART_TYPE_TURBOSOFT_64K,	turbosoft_64k) \
+	X(CART_TYPE_TURBOSOFT_128K,	turbosoft_128k) \
+	X(CART_TYPE_ATRAX_128K,		atrax_128k) \
+	X(CART_TYPE_MICROCALC,		microcalc) \
+	X(CART_TYPE_PHOENIX_8K,		phoenix_8k) \
+	X(CART_TYPE_BLIZZARD_4K,	phoenix_8k) \
+	X(CART_TYPE_XEX,			xex_loader) \
+	X(CART_TYPE_XEGS_256K,		xegs_256k) \
+	X(CART_TYPE_XEGS_512K,		xegs_512k) \
+	X(CART_TYPE_XEGS_1024K,		xegs_1024k) \
+	X(CART_TYPE_SW_XEGS_256K,	sw_xegs_256k) \
+	X(CART_TYPE_SW_XEGS_512K,	sw_xegs_512k) \
+	X(CART_TYPE_SW_XEGS_1024K,	sw_xegs_1024k) \
+	X(CART_TYPE_MEGACART_256K,	megacart_256k) \
+	X(CART_TYPE_MEGACART_512K,	megacart_512k) \
+	X(CART_TYPE_MEGACART_1024K,	megacart_1024k) \
+	X(CART_TYPE_ATARIMAX_8MBIT,	atarimax_8mbit) \
+	X(CART_TYPE_ATARIMAX_8MBIT_NEW, atarimax_8mbit_new) \
+	X(CART_TYPE_SIC_256K,		sic_256k) \
+	X(CART_TYPE_SIC_512K,		sic_512k) \
+	X(CART_TYPE_MEGAMAX_2M,		megamax_2m)
+
+// one bus loop per cart type, see Banked cartridge bus engine
+#define X(type, desc) static void __no_inline_not_in_flash_func(bus_engine_##type)() { bus_engine(&desc); }
+CART_EMULATORS(X)
+#undef X
+
+void __not_in_flash_func(emulate_cartridge)(int cartType) {
+	switch (cartType)
 	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-			bank = (bank + 1) % 5;
-			if (bank == 4)	// disable
-				{ RD5_LOW; rd5_high = false; }
-			else
-				{ RD5_HIGH; rd5_high = true; }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_phoenix_8k)() {
-    // 8k
-    RD4_LOW;
-    RD5_HIGH;
-
-    uint32_t pins;
-    uint16_t addr;
-    bool rd5_high = true;	// 400/800 MMU
-
-    while (1)
-    {
-        // wait for phi2 high
-        while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            RD5_LOW;
-            rd5_high = false;
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
+	case CART_TYPE_8K:
+	case CART_TYPE_4K:	// patch in load_file()
+	case CART_TYPE_2K:
+		emulate_standard_8k();
+		break;
+	case CART_TYPE_16K:
+		emulate_standard_16k();
+		break;
+#define X(type, desc) case type: bus_engine_##type(); break;
+	CART_EMULATORS(X)
+#undef X
+	default:
+		// no cartridge (cartType = 0)
+		RD4_LOW;
+		RD5_LOW;
+		while (1) ;
 	}
 }
 
-void __not_in_flash_func(feed_XEX_loader)(void) {
-	RD4_LOW;
-	RD5_LOW;
-
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	
-	uint32_t bank = 0;
-	unsigned char *ramPtr = &cart_ram[0];
-	while (1)
+int start_flash_cart(int cartType) {
+	// copy the banks needed at start into the cache (fixed window first), then as many more as fit
+	const CART_DESC *d = NULL;
+	switch (cartType)
 	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            if (pins & RW_GPIO_MASK)
-            {   // atari is reading
-                SET_DATA_MODE_OUT;
-                addr = pins & ADDR_GPIO_MASK;
-                gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(ramPtr[addr&0xFF])) << 13);
-            }
-			else
-            {   // atari is writing
-                addr = pins & 0xFF;
-                last = pins;
-                // read data bus on falling edge of phi2
-                while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-                    last = pins;
-				data = (last & DATA_GPIO_MASK) >> 13;
-				if (addr == 0)
-					bank = (bank&0xFF00) | data;
-				else if (addr == 1)
-					bank = (bank&0x00FF) | ((data<<8) & 0xFF00);
-				ramPtr = &cart_ram[0] + 256 * (bank & 0x01FF);
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
+#define X(type, desc) case type: d = &desc; break;
+	CART_EMULATORS(X)
+#undef X
 	}
+	if (!d || !d->flash)
+		return 0;
+	init_bank_cache(BANK_SIZE(d), d->init_bank, d->bank_window == WINDOW_S4 ? d->fixed_bank : ~0u);
+	if (d->bank_window == WINDOW_S4)
+		cache_bank(d->fixed_bank);
+	cache_bank(d->init_bank);
+	for (uint32_t bank = 0; bank <= d->bank_mask && bank_cache_used < sizeof(cart_ram); bank++)
+		cache_bank(bank);
+	return 1;
 }
 
-void emulate_cartridge(int cartType) {
-	if (cartType == CART_TYPE_8K) emulate_standard_8k();
-	else if (cartType == CART_TYPE_16K) emulate_standard_16k();
-	else if (cartType == CART_TYPE_XEGS_32K) emulate_XEGS_32k(0);
-	else if (cartType == CART_TYPE_XEGS_64K) emulate_XEGS_64k(0);
-	else if (cartType == CART_TYPE_XEGS_128K) emulate_XEGS_128k(0);
-	else if (cartType == CART_TYPE_SW_XEGS_32K) emulate_XEGS_32k(1);
-	else if (cartType == CART_TYPE_SW_XEGS_64K) emulate_XEGS_64k(1);
-	else if (cartType == CART_TYPE_SW_XEGS_128K) emulate_XEGS_128k(1);
-	else if (cartType == CART_TYPE_BOUNTY_BOB) emulate_bounty_bob();
-	else if (cartType == CART_TYPE_ATARIMAX_1MBIT) emulate_atarimax_128k();
-	else if (cartType == CART_TYPE_WILLIAMS_64K) emulate_williams();
-	else if (cartType == CART_TYPE_OSS_16K_TYPE_B) emulate_OSS_B();
-	else if (cartType == CART_TYPE_OSS_8K) emulate_OSS_B();
-	else if (cartType == CART_TYPE_OSS_16K_034M) emulate_OSS_A(1);
-	else if (cartType == CART_TYPE_OSS_16K_043M) emulate_OSS_A(0);
-	else if (cartType == CART_TYPE_MEGACART_16K) emulate_megacart(16);
-	else if (cartType == CART_TYPE_MEGACART_32K) emulate_megacart(32);
-	else if (cartType == CART_TYPE_MEGACART_64K) emulate_megacart(64);
-	else if (cartType == CART_TYPE_MEGACART_128K) emulate_megacart(128);
-	else if (cartType == CART_TYPE_SIC_128K) emulate_SIC();
-	else if (cartType == CART_TYPE_SDX_64K) emulate_SDX(64);
-	else if (cartType == CART_TYPE_SDX_128K) emulate_SDX(128);
-	else if (cartType == CART_TYPE_DIAMOND_64K) emulate_diamond_express(0xD0);
-	else if (cartType == CART_TYPE_EXPRESS_64K) emulate_diamond_express(0x70);
-	else if (cartType == CART_TYPE_BLIZZARD_16K) emulate_blizzard();
-	else if (cartType == CART_TYPE_4K) emulate_standard_8k();	// patch in load_file()
-	else if (cartType == CART_TYPE_TURBOSOFT_64K) emulate_turbosoft(64);
-	else if (cartType == CART_TYPE_TURBOSOFT_128K) emulate_turbosoft(128);
-	else if (cartType == CART_TYPE_ATRAX_128K) emulate_atrax();
-	else if (cartType == CART_TYPE_MICROCALC) emulate_microcalc();
-	else if (cartType == CART_TYPE_2K) emulate_standard_8k();
-	else if (cartType == CART_TYPE_PHOENIX_8K) emulate_phoenix_8k();
-	else if (cartType == CART_TYPE_BLIZZARD_4K) emulate_phoenix_8k();
-	else if (cartType == CART_TYPE_XEX) feed_XEX_loader();
-	else
-	{	// no cartridge (cartType = 0)
-		RD4_LOW;
-		RD5_LOW;
-		while (1) ;
+void __scratch_x("atari_bus") atari_bus_main()
+{
+	while (1) {
+		uint32_t msg = bus_fifo_pop();
+		if (msg & BUS_MSG_CART)
+			emulate_cartridge(msg & 0xFF);
+		bus_fifo_push(emulate_boot_rom(msg & BUS_MSG_ATR_MODE));
 	}
 }
 
@@ -1531,36 +1751,55 @@ void __not_in_flash_func(atari_cart_main)()
     gpio_set_dir(RD5_PIN, GPIO_OUT);
 
 	// overclocking isn't necessary for most functions - but XEGS carts weren't working without it
-	// I guess we might as well have it on all the time.
+	// I guess we might as well have it on all the time. (standard 8k/16k carts run on PIO and don't need it)
 	set_sys_clock_khz(250000, true);
 
 	int cartType = 0, atrMode = 0;
 	char curPath[256] = "";
 	char path[256];
 
+	multicore_launch_core1(atari_bus_main);
+
     while (1) {
-        int cmd = emulate_boot_rom(atrMode);
+		multicore_fifo_push_blocking(atrMode ? BUS_MSG_ATR_MODE : BUS_MSG_MENU);
+		while (!multicore_fifo_rvalid()) {
+			sync_atr_if_idle();
+			read_ahead_step();
+		}
+        int cmd = multicore_fifo_pop_blocking();
+		if (cmd != CART_CMD_READ_ATR_SECTOR && cmd != CART_CMD_WRITE_ATR_SECTOR && cmd != CART_CMD_ATR_HEADER)
+			sync_all_atrs();
 
         // OPEN ITEM n
-        if (cmd == CART_CMD_OPEN_ITEM) 
+        if (cmd == CART_CMD_OPEN_ITEM || cmd == CART_CMD_OPEN_ITEM_EX)
         {
-			int n = cart_d5xx[0x00];
-			DIR_ENTRY *entry = (DIR_ENTRY *)&cart_ram[0];
-			if (entry[n].isDir)
+			int n = (cmd == CART_CMD_OPEN_ITEM) ? dir_page_entry(cart_d5xx[0x00]) : (cart_d5xx[0x01] << 8) | cart_d5xx[0x00];
+			if (n == DIR_PREV_PAGE || n == DIR_NEXT_PAGE)
+			{	// page of a big directory
+				dir_page += (n == DIR_NEXT_PAGE) ? 1 : -1;
+				cart_d5xx[0x01] = 0; // path changed
+			}
+			else if (n < 0 || n >= num_dir_entries)
+			{
+				cart_d5xx[0x01] = 4;	// error
+				strcpy((char*)&cart_d5xx[0x02], "Bad directory entry");
+			}
+			else if (dir_entries[n].isDir)
 			{	// directory
 				strcat(curPath, "/");
-				strcat(curPath, entry[n].filename);
+				strcat(curPath, DIR_POOL_STR(dir_entries[n].filename));
+				dir_page = 0;
 				cart_d5xx[0x01] = 0; // path changed
 			}
 			else
 			{	// file/search result
-				if (entry[n].full_path[0])
-					strcpy(path, entry[n].full_path);	// search result
+				if (dir_entries[n].path)
+					strcpy(path, DIR_POOL_STR(dir_entries[n].path));	// search result
 				else
 					strcpy(path, curPath); // file in current directory
 				strcat(path, "/");
-				strcat(path, entry[n].filename);
-				if (strcasecmp(get_filename_ext(entry[n].filename), "ATR")==0)
+				strcat(path, DIR_POOL_STR(dir_entries[n].filename));
+				if (strcasecmp(get_filename_ext(DIR_POOL_STR(dir_entries[n].filename)), "ATR")==0)
 				{	// ATR
 					cart_d5xx[0x01] = 3;	// ATR
 					cartType = CART_TYPE_ATR;
@@ -1584,7 +1823,9 @@ void __not_in_flash_func(atari_cart_main)()
  			int ret = read_directory(curPath);
 			if (ret) {
 				cart_d5xx[0x01] = 0;	// ok
-				cart_d5xx[0x02] = num_dir_entries;
+				cart_d5xx[0x02] = dir_page_count();
+				cart_d5xx[0x03] = num_dir_entries & 0xFF;
+				cart_d5xx[0x04] = num_dir_entries >> 8;
 			}
 			else
 			{
@@ -1593,12 +1834,17 @@ void __not_in_flash_func(atari_cart_main)()
 			}           
         }
 		// GET DIR ENTRY n
-		else if (cmd == CART_CMD_GET_DIR_ENTRY)
+		else if (cmd == CART_CMD_GET_DIR_ENTRY || cmd == CART_CMD_GET_DIR_ENTRY_EX)
 		{
-			int n = cart_d5xx[0x00];
-			DIR_ENTRY *entry = (DIR_ENTRY *)&cart_ram[0];
-			cart_d5xx[0x01] = entry[n].isDir;
-			strcpy((char*)&cart_d5xx[0x02], entry[n].long_filename);
+			int n = (cmd == CART_CMD_GET_DIR_ENTRY) ? dir_page_entry(cart_d5xx[0x00]) : (cart_d5xx[0x01] << 8) | cart_d5xx[0x00];
+			if (n == DIR_PREV_PAGE || n == DIR_NEXT_PAGE) {
+				cart_d5xx[0x01] = 1;
+				strcpy((char*)&cart_d5xx[0x02], n == DIR_NEXT_PAGE ? "[Next page]" : "[Previous page]");
+			}
+			else if (n < num_dir_entries) {
+				cart_d5xx[0x01] = dir_entries[n].isDir;
+				strcpy((char*)&cart_d5xx[0x02], DIR_POOL_STR(dir_entries[n].name));
+			}
 		}
 		// UP A DIRECTORY LEVEL
 		else if (cmd == CART_CMD_UP_DIR)
@@ -1606,10 +1852,13 @@ void __not_in_flash_func(atari_cart_main)()
 			int len = strlen(curPath);
 			while (len && curPath[--len] != '/');
 			curPath[len] = 0;
+			dir_page = 0;
 		}
 		// ROOT DIR (when atari reset pressed)
-		else if (cmd == CART_CMD_ROOT_DIR)
+		else if (cmd == CART_CMD_ROOT_DIR) {
 			curPath[0] = 0;
+			dir_page = 0;
+		}
 		// SEARCH str
 		else if (cmd == CART_CMD_SEARCH)
 		{
@@ -1618,7 +1867,9 @@ void __not_in_flash_func(atari_cart_main)()
 			int	ret = search_directory(curPath, searchStr);
 			if (ret) {
 				cart_d5xx[0x01] = 0;	// ok
-				cart_d5xx[0x02] = num_dir_entries;
+				cart_d5xx[0x02] = num_dir_entries;	// at most MAX_SEARCH_RESULTS, one page
+				cart_d5xx[0x03] = num_dir_entries;
+				cart_d5xx[0x04] = 0;
 			}
 			else
 			{
@@ -1646,36 +1897,56 @@ void __not_in_flash_func(atari_cart_main)()
 		// READ ATR SECTOR
 		else if (cmd == CART_CMD_READ_ATR_SECTOR)
 		{
-			//uint8_t device = cart_d5xx[0x00];
+			MountedATR *drive = atr_drive(cart_d5xx[0x00]);
 			uint16_t sector = (cart_d5xx[0x02] << 8) | cart_d5xx[0x01];
 			uint8_t offset = cart_d5xx[0x03];	// 0 = first 128 byte "page", 1 = second, etc
-			int ret = read_atr_sector(sector, offset, &cart_d5xx[0x02]);
+			int ret = read_atr_sector(drive, sector, offset, &cart_d5xx[0x02]);
 			cart_d5xx[0x01] = ret;
 		}
 		// WRITE ATR SECTOR
 		else if (cmd == CART_CMD_WRITE_ATR_SECTOR)
 		{
-			//uint8_t device = cart_d5xx[0x00];
+			MountedATR *drive = atr_drive(cart_d5xx[0x00]);
 			uint16_t sector = (cart_d5xx[0x02] << 8) | cart_d5xx[0x01];
 			uint8_t offset = cart_d5xx[0x03];	// 0 = first 128 byte "page", 1 = second, etc
-			int ret = write_atr_sector(sector, offset, &cart_d5xx[0x04]);
+			int ret = write_atr_sector(drive, sector, offset, &cart_d5xx[0x04]);
 			cart_d5xx[0x01] = ret;
 		}
 		// GET ATR HEADER
 		else if (cmd == CART_CMD_ATR_HEADER)
 		{
-			//uint8_t device = cart_d5xx[0x00];
-			if (!&mountedATRs[0].path[0])
+			MountedATR *drive = atr_drive(cart_d5xx[0x00]);
+			if (!drive || !drive->mounted)
 				cart_d5xx[0x01] = 1;
 			else
 			{
-				memcpy(&cart_d5xx[0x02], &mountedATRs[0].atrHeader, 16);
+				memcpy(&cart_d5xx[0x02], &drive->atrHeader, 16);
 				cart_d5xx[0x01] = 0;
 			}
 		}
+		// MOUNT ATR in drive n (d5xx[0x01] = 0) or empty the drive (d5xx[0x01] = 1)
+		else if (cmd == CART_CMD_MOUNT_ATR)
+		{
+			MountedATR *drive = atr_drive(cart_d5xx[0x00]);
+			int ret = 1;
+			if (drive && cart_d5xx[0x01] == 1) {
+				unmount_atr(drive);
+				ret = 0;
+			}
+			else if (drive && cartType == CART_TYPE_ATR) {
+				ret = mount_atr(drive, path);
+				if (ret == 0)
+					memcpy(&cart_d5xx[0x02], &drive->atrHeader, 16);
+			}
+			cart_d5xx[0x01] = ret;
+		}
 		// RESET FLASH FS (when boot with joystick 0 fire pressed)
 		else if (cmd == CART_CMD_RESET_FLASH)
+		{
 			create_fatfs_disk();
+			fatFsMounted = 0;	// new volume (and create_fatfs_disk unmounted the old one)
+			listing_valid = 0;
+		}
 		// NO CART
 		else if (cmd == CART_CMD_NO_CART)
 			cartType = 0;
@@ -1684,13 +1955,21 @@ void __not_in_flash_func(atari_cart_main)()
 		{
 			if (cartType == CART_TYPE_ATR) {
 				atrMode = 1;
-				int ret = mount_atr(path);
+				int ret = mount_atr(&mountedATRs[0], path);	// D1:
 				if (ret == 0)
 					memcpy(&cart_d5xx[0x02], &mountedATRs[0].atrHeader, 16);
 				cart_d5xx[0x01] = ret;
 			}
 			else
-				emulate_cartridge(cartType);
+			{	// core 1 serves the cart from now on, core 0 is free for background work
+				if (flash_cart && start_flash_cart(cartType)) {
+					multicore_fifo_push_blocking(BUS_MSG_CART | cartType);
+					bank_cache_main();
+				}
+				multicore_fifo_push_blocking(BUS_MSG_CART | cartType);
+				while (1)
+					__wfe();
+			}
 		}
     }
 }
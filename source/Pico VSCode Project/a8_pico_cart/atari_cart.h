@@ -18,5 +18,9 @@
 #define ATARI_PHI2_PIN        22    // used on boot to check if we are plugged into an atari or usb
 
 void atari_cart_main();
+void mark_search_index_stale();
+void update_search_index(int size);
+
+extern unsigned char cart_ram[128*1024];   // free for other use in USB mode
 
 #endif
\ No newline at end of file
@@ -0,0 +1,486 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Needs to be a release NOT debug build for the cartridge emulation to work
+ */
+
+
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "dir_index.h"
+#include "flash_fs.h"
+
+/*
+ Directory index
+ ---------------
+ The menu keeps a presorted copy of each directory listing in a hidden file (A8INDEX.IDX) in
+ that directory, so opening a directory it has seen before is one file read instead of a
+ f_readdir() walk and a qsort().
+
+ An index is only trusted if its signature matches the directory as it is now. The signature
+ is a CRC of the raw directory entries (names, attributes, start cluster, size, modified
+ time), read straight from the directory's sectors. So any change made over USB, or by the
+ Atari, invalidates it without the host having to know about the index. The index files'
+ own entries are left out of the signature.
+
+ File layout: DIR_INDEX_HEADER, then num_recs records of rec_size bytes, then the string pool.
+*/
+
+#define DIR_INDEX_MAGIC		0x58493841	// "A8IX"
+#define DIR_INDEX_VERSION	2
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t num_recs;
+	uint32_t pool_size;
+	uint32_t dir_sig;	// signature of the directory the index was built from
+	uint32_t crc;		// of the records
+} DIR_INDEX_HEADER;
+
+// our own index files (A8INDEX.IDX, A8SEARCH.IDX) are left out of directory signatures
+#define IS_INDEX_SFN(e)	(memcmp(e, "A8INDEX IDX", 11) == 0 || memcmp(e, "A8SEARCHIDX", 11) == 0)
+
+static DWORD fat_next(FATFS *fs, DWORD cl, BYTE *buf, LBA_t *buf_sect) {
+	// next cluster in the chain (FAT12/16/32), 0 on error
+	DWORD ofs, val;
+	LBA_t sect;
+	switch (fs->fs_type) {
+	case FS_FAT12:
+		ofs = cl + cl / 2;
+		val = 0;
+		for (int i=0; i<2; i++, ofs++) {	// an entry can straddle two sectors
+			sect = fs->fatbase + ofs / 512;
+			if (sect != *buf_sect) {
+				if (disk_read(fs->pdrv, buf, sect, 1) != RES_OK) return 0;
+				*buf_sect = sect;
+			}
+			val |= buf[ofs % 512] << (i * 8);
+		}
+		return (cl & 1) ? val >> 4 : val & 0xFFF;
+	case FS_FAT16:
+	case FS_FAT32:
+		ofs = cl * (fs->fs_type == FS_FAT16 ? 2 : 4);
+		sect = fs->fatbase + ofs / 512;
+		if (sect != *buf_sect) {
+			if (disk_read(fs->pdrv, buf, sect, 1) != RES_OK) return 0;
+			*buf_sect = sect;
+		}
+		if (fs->fs_type == FS_FAT16)
+			return buf[ofs % 512] | (buf[ofs % 512 + 1] << 8);
+		return (buf[ofs % 512] | (buf[ofs % 512 + 1] << 8) | (buf[ofs % 512 + 2] << 16) | (buf[ofs % 512 + 3] << 24)) & 0x0FFFFFFF;
+	}
+	return 0;
+}
+
+static int sig_sector(FATFS *fs, LBA_t sect, BYTE *buf, uint32_t *sig) {
+	// returns 0 = more entries, 1 = end of directory, -1 = error
+	if (disk_read(fs->pdrv, buf, sect, 1) != RES_OK)
+		return -1;
+	for (int i=0; i<512; i+=32) {
+		BYTE *e = &buf[i];
+		if (e[0] == 0)
+			return 1;
+		if (e[0] == 0xE5 || IS_INDEX_SFN(e))
+			continue;
+		if ((e[11] & 0x3F) == 0x0F)		// LFN entry
+			*sig = crc32(*sig, e, 32);
+		else {	// skip the create/access times, hosts may touch those on read
+			*sig = crc32(*sig, e, 12);
+			*sig = crc32(*sig, e + 20, 12);
+		}
+	}
+	return 0;
+}
+
+int dir_signature(DIR *dir, uint32_t *sig) {
+	// returns 1 if sig was set
+	FATFS *fs = dir->obj.fs;
+	BYTE buf[512];
+	DWORD cl = dir->obj.sclust;
+	int ret = 0;
+
+	*sig = 0;
+	if (cl == 0 && fs->fs_type != FS_FAT32) {
+		// FAT12/16 root directory is a fixed area
+		for (LBA_t s = 0; s < fs->n_rootdir / 16 && ret == 0; s++)
+			ret = sig_sector(fs, fs->dirbase + s, buf, sig);
+		return ret >= 0;
+	}
+	if (cl == 0)
+		cl = fs->dirbase;
+	BYTE fat_buf[512];
+	LBA_t fat_sect = 0;
+	for (DWORD n = 0; ret == 0; n++) {
+		if (cl < 2 || cl >= fs->n_fatent || n >= fs->n_fatent)
+			return 0;	// broken chain
+		for (WORD s = 0; s < fs->csize && ret == 0; s++)
+			ret = sig_sector(fs, fs->database + (LBA_t)fs->csize * (cl - 2) + s, buf, sig);
+		if (ret == 0) {
+			cl = fat_next(fs, cl, fat_buf, &fat_sect);
+			if (cl >= fs->n_fatent)
+				break;		// end of chain
+		}
+	}
+	return ret >= 0;
+}
+
+static void index_path(char *dst, const char *path) {
+	strcpy(dst, path);
+	strcat(dst, "/" DIR_INDEX_FILENAME);
+}
+
+int dir_index_read(const char *path, uint32_t sig, void *area, int size, int rec_size, int *pool_size) {
+	// loads the records to the start of area and the pool to the end of it
+	// returns the number of records, or -1 if there's no valid index
+	char filename[256+16];
+	DIR_INDEX_HEADER hdr;
+	FIL fil;
+	UINT br;
+	int ret = -1;
+
+	index_path(filename, path);
+	if (f_open(&fil, filename, FA_READ) != FR_OK)
+		return -1;
+	if (f_read(&fil, &hdr, sizeof(hdr), &br) == FR_OK && br == sizeof(hdr) &&
+		hdr.magic == DIR_INDEX_MAGIC && hdr.version == DIR_INDEX_VERSION && hdr.rec_size == rec_size &&
+		hdr.dir_sig == sig && hdr.num_recs * rec_size + hdr.pool_size <= size)
+	{
+		UINT recs_size = hdr.num_recs * rec_size;
+		uint8_t *pool = (uint8_t *)area + size - hdr.pool_size;
+		if (f_read(&fil, area, recs_size, &br) == FR_OK && br == recs_size &&
+			f_read(&fil, pool, hdr.pool_size, &br) == FR_OK && br == hdr.pool_size &&
+			crc32(crc32(0, area, recs_size), pool, hdr.pool_size) == hdr.crc)
+		{
+			*pool_size = hdr.pool_size;
+			ret = hdr.num_recs;
+		}
+	}
+	f_close(&fil);
+	return ret;
+}
+
+void dir_index_write(const char *path, uint32_t sig, const void *recs, int rec_size, int num_recs, const void *pool, int pool_size) {
+	char filename[256+16];
+	UINT recs_size = num_recs * rec_size;
+	DIR_INDEX_HEADER hdr = { DIR_INDEX_MAGIC, DIR_INDEX_VERSION, rec_size, num_recs, pool_size, sig,
+		crc32(crc32(0, recs, recs_size), pool, pool_size) };
+	FIL fil;
+	UINT bw;
+	int ok;
+
+	index_path(filename, path);
+	if (f_open(&fil, filename, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+		return;
+	ok = f_write(&fil, &hdr, sizeof(hdr), &bw) == FR_OK && bw == sizeof(hdr) &&
+		f_write(&fil, recs, recs_size, &bw) == FR_OK && bw == recs_size &&
+		f_write(&fil, pool, pool_size, &bw) == FR_OK && bw == pool_size;
+	if (f_close(&fil) != FR_OK || !ok) {
+		f_unlink(filename);		// e.g. disk full, the live scan will be used next time
+		return;
+	}
+	f_chmod(filename, AM_HID | AM_SYS, AM_HID | AM_SYS);
+}
+
+/*
+ Search index
+ ------------
+ CART_CMD_SEARCH used to walk the whole tree with f_readdir(). Instead, one index of every
+ cart file on the volume is kept in A8SEARCH.IDX in the root. In memory (and in the file)
+ it is an array of SEARCH_RECs followed by a string pool. Directory records carry the
+ directory's signature and full path, file records the index of their directory, their
+ names and a trigram mask of the name.
+
+ The volume only changes in USB mode. When the host mounts it, the index is marked stale
+ before the host has read anything, and once the host ejects it the index is brought up to
+ date (msc_disk.c): every directory's signature is checked against the old index, and only
+ directories that have changed are read again. A search uses the index as it is, unless it
+ is still marked stale (the host was unplugged without ejecting) or missing, in which case
+ it is brought up to date first. Searching is then a pass over the records, skipping any
+ name whose 128 bit trigram mask doesn't contain all the trigrams of the search string,
+ before checking the few that are left.
+
+ Pool offsets count back from the end of the area, so the records can grow up from the
+ start and the pool down from the end of the same buffer.
+*/
+
+#define SEARCH_INDEX_FILENAME	"/A8SEARCH.IDX"
+#define SEARCH_INDEX_MAGIC		0x53493841	// "A8IS"
+#define SEARCH_INDEX_VERSION	2
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t stale;		// the host may have changed the volume since it was built
+	uint32_t num_recs;
+	uint32_t pool_size;
+	uint32_t crc;		// of the records & pool
+} SEARCH_INDEX_HEADER;
+
+#define POOL_STR(ix, off)	((char *)(ix)->end - (off))
+
+FILINFO search_fno;
+
+static inline char lower(char c) { return (c >= 'A' && c <= 'Z') ? c + 32 : c; }
+
+const char *stristr(const char *str, const char *search) {
+	// case insensitive strstr, no copies
+	if (!*search) return str;
+	for (; *str; str++) {
+		const char *s = str, *t = search;
+		while (*s && lower(*s) == lower(*t)) { s++; t++; }
+		if (!*t) return str;
+	}
+	return NULL;
+}
+
+static void trigram_mask(const char *str, uint32_t mask[4]) {
+	// one bit of 128 per trigram, from the top bits of a multiplicative hash
+	memset(mask, 0, 4 * sizeof(uint32_t));
+	for (; str[0] && str[1] && str[2]; str++) {
+		uint32_t h = ((lower(str[0]) << 16) | (lower(str[1]) << 8) | lower(str[2])) * 0x9E3779B1u;
+		mask[h >> 30] |= 1u << ((h >> 25) & 31);
+	}
+}
+
+static int add_string(SEARCH_INDEX *ix, const char *str) {
+	// returns the pool offset, or 0 if there's no room
+	int len = strlen(str) + 1;
+	if ((uint8_t *)&ix->recs[ix->num_recs + 1] + len > ix->end - ix->pool_size)
+		return 0;
+	ix->pool_size += len;
+	memcpy(POOL_STR(ix, ix->pool_size), str, len);
+	return ix->pool_size;
+}
+
+static SEARCH_REC *add_rec(SEARCH_INDEX *ix) {
+	if ((uint8_t *)&ix->recs[ix->num_recs + 1] > ix->end - ix->pool_size)
+		return NULL;
+	SEARCH_REC *r = &ix->recs[ix->num_recs++];
+	memset(r, 0, sizeof(SEARCH_REC));
+	return r;
+}
+
+static int add_file(SEARCH_INDEX *ix, int dir, const char *name, const char *sfn) {
+	SEARCH_REC *r = add_rec(ix);
+	if (!r) return 0;
+	r->dir = dir;
+	trigram_mask(name, r->tri);
+	r->name = add_string(ix, name);
+	r->sfn = (strcmp(name, sfn) == 0) ? r->name : add_string(ix, sfn);
+	return r->name && r->sfn;
+}
+
+static int find_dir(SEARCH_INDEX *ix, const char *path) {
+	for (int i=0; i<ix->num_recs; i++)
+		if ((ix->recs[i].flags & SEARCH_REC_DIR) && strcmp(POOL_STR(ix, ix->recs[i].name), path) == 0)
+			return i;
+	return -1;
+}
+
+static int index_dir(SEARCH_INDEX *ix, SEARCH_INDEX *old, char *path, int parent, int (*is_valid)(char *)) {
+	// add the directory at path and everything below it, returns 0 if out of room/error
+	DIR dir;
+	uint32_t sig;
+	int ok = 1;
+
+	if (f_opendir(&dir, path) != FR_OK)
+		return 0;
+	if (!dir_signature(&dir, &sig)) {
+		f_closedir(&dir);
+		return 0;
+	}
+	int me = ix->num_recs;
+	SEARCH_REC *r = add_rec(ix);
+	if (!r || !(r->name = add_string(ix, path))) {
+		f_closedir(&dir);
+		return 0;
+	}
+	r->flags = SEARCH_REC_DIR;
+	r->dir = parent;
+	r->tri[0] = sig;
+
+	int o = old ? find_dir(old, path) : -1;
+	if (o >= 0 && old->recs[o].tri[0] == sig)
+	{	// unchanged, take its files from the old index
+		f_closedir(&dir);
+		for (int i=o+1; ok && i<old->num_recs; i++) {
+			SEARCH_REC *old_rec = &old->recs[i];
+			if (old_rec->dir != o) continue;
+			if (old_rec->flags & SEARCH_REC_DIR) {
+				int len = strlen(path);
+				strcpy(path, POOL_STR(old, old_rec->name));
+				ok = index_dir(ix, old, path, me, is_valid);
+				path[len] = 0;
+			}
+			else
+				ok = add_file(ix, me, POOL_STR(old, old_rec->name), POOL_STR(old, old_rec->sfn));
+		}
+		return ok;
+	}
+
+	ix->changed = 1;
+	while (ok) {
+		if (f_readdir(&dir, &search_fno) != FR_OK || search_fno.fname[0] == 0)
+			break;
+		if (search_fno.fattrib & (AM_HID | AM_SYS))
+			continue;
+		const char *sfn = search_fno.altname[0] ? search_fno.altname : search_fno.fname;	// no altname when lfn is 8.3
+		if (search_fno.fattrib & AM_DIR) {
+			int len = strlen(path);
+			if (len + 1 + strlen(sfn) >= 210) continue;		// no more room for path in DIR_ENTRY
+			strcat(path, "/");
+			strcat(path, sfn);
+			ok = index_dir(ix, old, path, me, is_valid);
+			path[len] = 0;
+		}
+		else if (is_valid(search_fno.fname))
+			ok = add_file(ix, me, search_fno.fname, sfn);
+	}
+	f_closedir(&dir);
+	return ok;
+}
+
+static int load_search_index(SEARCH_INDEX *ix, int *stale) {
+	SEARCH_INDEX_HEADER hdr;
+	FIL fil;
+	UINT br;
+	int ok = 0;
+
+	ix->num_recs = ix->pool_size = 0;
+	if (f_open(&fil, SEARCH_INDEX_FILENAME, FA_READ) != FR_OK)
+		return 0;
+	if (f_read(&fil, &hdr, sizeof(hdr), &br) == FR_OK && br == sizeof(hdr) &&
+		hdr.magic == SEARCH_INDEX_MAGIC && hdr.version == SEARCH_INDEX_VERSION &&
+		(uint8_t *)&ix->recs[hdr.num_recs] <= ix->end - hdr.pool_size)
+	{
+		UINT recs_size = hdr.num_recs * sizeof(SEARCH_REC);
+		char *pool = POOL_STR(ix, hdr.pool_size);
+		if (f_read(&fil, ix->recs, recs_size, &br) == FR_OK && br == recs_size &&
+			f_read(&fil, pool, hdr.pool_size, &br) == FR_OK && br == hdr.pool_size &&
+			crc32(crc32(0, ix->recs, recs_size), pool, hdr.pool_size) == hdr.crc)
+		{
+			ix->num_recs = hdr.num_recs;
+			ix->pool_size = hdr.pool_size;
+			*stale = hdr.stale;
+			ok = 1;
+		}
+	}
+	f_close(&fil);
+	return ok;
+}
+
+static void save_search_index(SEARCH_INDEX *ix) {
+	UINT recs_size = ix->num_recs * sizeof(SEARCH_REC);
+	char *pool = POOL_STR(ix, ix->pool_size);
+	SEARCH_INDEX_HEADER hdr = { SEARCH_INDEX_MAGIC, SEARCH_INDEX_VERSION, 0, ix->num_recs, ix->pool_size,
+		crc32(crc32(0, ix->recs, recs_size), pool, ix->pool_size) };
+	FIL fil;
+	UINT bw;
+	int ok;
+
+	if (f_open(&fil, SEARCH_INDEX_FILENAME, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+		return;
+	ok = f_write(&fil, &hdr, sizeof(hdr), &bw) == FR_OK && bw == sizeof(hdr) &&
+		f_write(&fil, ix->recs, recs_size, &bw) == FR_OK && bw == recs_size &&
+		f_write(&fil, pool, ix->pool_size, &bw) == FR_OK && bw == ix->pool_size;
+	if (f_close(&fil) != FR_OK || !ok) {
+		f_unlink(SEARCH_INDEX_FILENAME);
+		return;
+	}
+	f_chmod(SEARCH_INDEX_FILENAME, AM_HID | AM_SYS, AM_HID | AM_SYS);
+}
+
+static void init_search_index(SEARCH_INDEX *ix, uint8_t *area, int size) {
+	ix->recs = (SEARCH_REC *)area;
+	ix->end = area + size;
+	ix->num_recs = ix->pool_size = 0;
+	ix->changed = 0;
+}
+
+static SEARCH_INDEX search_ix;
+
+SEARCH_INDEX *search_index_load(uint8_t *area, int size) {
+	// the index as it is, NULL if there's none or it may be out of date
+	int stale;
+	init_search_index(&search_ix, area, size);
+	if (!load_search_index(&search_ix, &stale) || stale)
+		return NULL;
+	return &search_ix;
+}
+
+SEARCH_INDEX *search_index_update(uint8_t *area, uint8_t *work, int size, int (*is_valid)(char *)) {
+	// brings the index in area up to date, using work as scratch. returns NULL on failure
+	static SEARCH_INDEX new_ix;
+	char path[256] = "";
+	int stale = 0;
+
+	init_search_index(&search_ix, area, size);
+	init_search_index(&new_ix, work, size);
+	int have_old = load_search_index(&search_ix, &stale);
+	if (!index_dir(&new_ix, have_old ? &search_ix : NULL, path, 0xFFFF, is_valid))
+		return NULL;	// too many files, or a read error
+	if (!new_ix.changed && have_old && !stale && new_ix.num_recs == search_ix.num_recs)
+		return &search_ix;
+	save_search_index(&new_ix);
+	memcpy(area, work, size);
+	search_ix.num_recs = new_ix.num_recs;
+	search_ix.pool_size = new_ix.pool_size;
+	return &search_ix;
+}
+
+void search_index_mark_stale() {
+	// before the host gets the volume. Only the header changes, so the old records are
+	// still there for the next update to start from
+	SEARCH_INDEX_HEADER hdr;
+	FIL fil;
+	UINT br;
+
+	if (f_open(&fil, SEARCH_INDEX_FILENAME, FA_READ | FA_WRITE) != FR_OK)
+		return;
+	if (f_read(&fil, &hdr, sizeof(hdr), &br) == FR_OK && br == sizeof(hdr) &&
+		hdr.magic == SEARCH_INDEX_MAGIC && hdr.version == SEARCH_INDEX_VERSION && !hdr.stale)
+	{
+		hdr.stale = 1;
+		if (f_lseek(&fil, 0) != FR_OK || f_write(&fil, &hdr, sizeof(hdr), &br) != FR_OK || br != sizeof(hdr)) {
+			f_close(&fil);
+			f_unlink(SEARCH_INDEX_FILENAME);	// can't trust it either way
+			return;
+		}
+	}
+	f_close(&fil);
+}
+
+int search_index_find(SEARCH_INDEX *ix, const char *scope, const char *search,
+	int (*match)(void *ctx, const char *dir, const char *name, const char *sfn, int score), void *ctx)
+{
+	// calls match() for each file under scope whose name contains search, until it returns 0
+	uint32_t mask[4];
+	trigram_mask(search, mask);
+	int scope_len = strlen(scope);
+	for (int i=0; i<ix->num_recs; i++) {
+		SEARCH_REC *r = &ix->recs[i];
+		if ((r->flags & SEARCH_REC_DIR) || (r->tri[0] & mask[0]) != mask[0] || (r->tri[1] & mask[1]) != mask[1] ||
+			(r->tri[2] & mask[2]) != mask[2] || (r->tri[3] & mask[3]) != mask[3])
+			continue;
+		const char *dir = POOL_STR(ix, ix->recs[r->dir].name);
+		if (strncmp(dir, scope, scope_len) != 0 || (dir[scope_len] && dir[scope_len] != '/'))
+			continue;
+		const char *name = POOL_STR(ix, r->name);
+		const char *found = stristr(name, search);
+		if (found && !match(ctx, dir, name, POOL_STR(ix, r->sfn), found == name))
+			break;
+	}
+	return 1;
+}
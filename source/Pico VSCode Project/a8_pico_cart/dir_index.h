@@ -0,0 +1,53 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Needs to be a release NOT debug build for the cartridge emulation to work
+ */
+
+
+#ifndef __DIR_INDEX_H__
+#define __DIR_INDEX_H__
+
+#include <stdint.h>
+#include "ff.h"
+
+#define DIR_INDEX_FILENAME	"A8INDEX.IDX"
+
+#define SEARCH_REC_DIR		0x01
+
+typedef struct {
+	uint32_t tri[4];	// 128 bit trigram mask of the name, or signature for a directory in tri[0]
+	uint16_t dir;		// record of the containing directory
+	uint16_t name;		// pool offset of the long name (full path for a directory)
+	uint16_t sfn;		// pool offset of the 8.3 name
+	uint8_t flags;
+	uint8_t unused;
+} SEARCH_REC;
+
+typedef struct {
+	SEARCH_REC *recs;
+	uint8_t *end;		// end of the area, the pool grows down from here
+	int num_recs;
+	int pool_size;
+	int changed;
+} SEARCH_INDEX;
+
+int dir_signature(DIR *dir, uint32_t *sig);
+int dir_index_read(const char *path, uint32_t sig, void *area, int size, int rec_size, int *pool_size);
+void dir_index_write(const char *path, uint32_t sig, const void *recs, int rec_size, int num_recs, const void *pool, int pool_size);
+const char *stristr(const char *str, const char *search);
+SEARCH_INDEX *search_index_load(uint8_t *area, int size);
+SEARCH_INDEX *search_index_update(uint8_t *area, uint8_t *work, int size, int (*is_valid)(char *));
+void search_index_mark_stale();
+int search_index_find(SEARCH_INDEX *ix, const char *scope, const char *search,
+	int (*match)(void *ctx, const char *dir, const char *name, const char *sfn, int score), void *ctx);
+
+#endif
@@ -126,8 +126,7 @@ DRESULT disk_ioctl (
 	{
 		switch(cmd) {
 			case CTRL_SYNC:
-				fatfs_disk_sync();
-				return RES_OK;
+				return fatfs_disk_sync() ? RES_OK : RES_ERROR;
 			case GET_SECTOR_COUNT:
 				*(LBA_t*) buff = SECTOR_NUM;
 				return RES_OK;
@@ -137,8 +136,9 @@ DRESULT disk_ioctl (
 			case GET_BLOCK_SIZE:
 				*(DWORD*) buff = 1;
 				return RES_OK;
-			case CTRL_TRIM:
-				return RES_OK;
+			case CTRL_TRIM:	/* start and end sector, inclusive */
+				res = fatfs_disk_trim(((LBA_t*)buff)[0], ((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1);
+				return res;
 			default:
 				return RES_PARERR;
 		}
@@ -61,12 +61,12 @@ uint32_t fatfs_disk_read(uint8_t* buff, uint32_t sector, uint32_t count)
 {	
 //	printf("fatfs_disk_read sector=%d, count=%d\n", sector, count);
     if (!flashfs_is_mounted) return RES_ERROR;
-    if (sector < 0 || sector >= SECTOR_NUM)
+    if (sector >= SECTOR_NUM || count > SECTOR_NUM - sector)
 			return RES_PARERR;
 
     /* copy data to buffer */
-    for (int i=0; i<count; i++)
-        flash_fs_read_FAT_sector(sector + i, buff + (i*SECTOR_SIZE));
+    if (!flash_fs_read_FAT_sectors(sector, count, buff))
+        return RES_ERROR;
     return RES_OK;
 }
 
@@ -74,22 +74,35 @@ uint32_t fatfs_disk_write(const uint8_t* buff, uint32_t sector, uint32_t count)
 {
 // 	printf("fatfs_disk_write sector=%d, count=%d\n", sector, count);
     if (!flashfs_is_mounted) return RES_ERROR;
-    if (sector < 0 || sector >= SECTOR_NUM)
+    if (sector >= SECTOR_NUM || count > SECTOR_NUM - sector)
         return RES_PARERR;
 
-    /* copy data to buffer */
-    for (int i=0; i<count; i++) {
-        flash_fs_write_FAT_sector(sector + i, buff + (i*SECTOR_SIZE));
-        // verify
-        if (!flash_fs_verify_FAT_sector(sector + i, buff + (i*SECTOR_SIZE))) {
-            printf("VERIFY ERROR!");
-            return RES_ERROR;
-        }
-    }
+    /* copy data to buffer (flash_fs checks what reaches the flash) */
+    uint32_t res = RES_OK;
+    for (int i=0; i<count; i++)
+        if (!flash_fs_write_FAT_sector(sector + i, buff + (i*SECTOR_SIZE)))
+            res = RES_ERROR;    // out of flash
+    return res;
+}
+
+uint32_t fatfs_disk_trim(uint32_t sector, uint32_t count)
+{
+    if (!flashfs_is_mounted) return RES_ERROR;
+    if (sector >= SECTOR_NUM || count > SECTOR_NUM - sector)
+        return RES_PARERR;
+
+    for (int i=0; i<count; i++)
+        flash_fs_trim_FAT_sector(sector + i);
     return RES_OK;
 }
 
-void fatfs_disk_sync()
+bool fatfs_disk_sync()
+{
+    return flash_fs_sync();
+}
+
+bool fatfs_disk_background()
 {
-    flash_fs_sync();
+    if (!flashfs_is_mounted) return false;
+    return flash_fs_background();
 }
\ No newline at end of file
@@ -25,6 +25,8 @@ bool mount_fatfs_disk();
 bool fatfs_is_mounted();
 uint32_t fatfs_disk_read(uint8_t* buff, uint32_t sector, uint32_t count);
 uint32_t fatfs_disk_write(const uint8_t* buff, uint32_t sector, uint32_t count);
-void fatfs_disk_sync();
+uint32_t fatfs_disk_trim(uint32_t sector, uint32_t count);
+bool fatfs_disk_sync();
+bool fatfs_disk_background();
 
 #endif
\ No newline at end of file
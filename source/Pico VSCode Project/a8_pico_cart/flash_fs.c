@@ -15,6 +15,8 @@
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
 #include "hardware/sync.h"
+#include "hardware/dma.h"
+#include "pico/multicore.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -22,28 +24,182 @@
 #include "flash_fs.h"
 
 // Implements 512 byte FAT sectors on 4096 byte flash sectors.
-// Doesn't really implement wear levelling (e.g. the fs_map) so not for heavy use but should be
-// fine for the intended use case.
+// Writes are buffered until there are 8 of them, which then go to a free flash sector with a
+// single erase and program (and are checked against flash). Anything left over is written
+// a slot at a time by flash_fs_sync().
+//
+// Wear levelling: every flash sector has an erase count, and new data goes to the least worn
+// of the next few free sectors. The map (and the erase counts) is stored as 18 chunks, each
+// in its own flash sector with a sequence number, and a changed chunk is written to whichever
+// free sector of the 40 sector map area is least worn, so no part of the map lives in a fixed
+// place. Mount takes the newest copy of each chunk.
+//
+// Writes aren't read back straight away. The DMA sniffer takes a CRC of each one from RAM,
+// and a background scrub later checks the flash against it (as does any read of the data
+// before then), so a bad write is still reported without doubling the flash traffic of
+// every write. By then the data is gone from RAM, so a slot that fails its check can't be
+// rewritten: the next sync fails, and reads of the slot fail until it is erased.
+//
+// Reads of more than one sector are done by DMA from the uncached XIP alias, so streaming a
+// file through doesn't push the code and the hot FAT and directory sectors out of the XIP
+// cache. Given some RAM by flash_fs_set_read_buffers(), single sector reads (FatFs and the
+// host re-reading FAT and directory sectors) also go through a small CLOCK cache, and each
+// multi-sector read starts a DMA of the slots after it, ready for the next one.
+//
+// While the volume is idle, flash_fs_background() does housekeeping a step at a time: when
+// free sectors run short, the live slots of the sparsest sectors are gathered into a fresh
+// one; a few free sectors are kept erased, so writes don't have to wait for an erase; and
+// data that never changes is moved off sectors that have fallen well behind the rest.
 
-#define HW_FLASH_STORAGE_BASE  (1024 * 1024)
-#define MAGIC_8_BYTES "RHE!FS30"
+/* Map journal
+   -----------
+   Rewriting map chunks on every sync costs an erase per chunk, and a power cut before the
+   sync leaves the map on flash pointing at slots that may already have been reused. So a sync
+   normally just appends the map entries that changed to a journal, 256 byte flash pages
+   (60 entries each) in a journal sector of the map area. When a journal sector fills up,
+   another one is started. When both are full, or when more has changed than one journal
+   sector holds, the changed chunks are written out (a checkpoint) and the journal starts
+   again. Each checkpoint erases a map area sector for every chunk it writes, so the map area
+   wears far faster the more often they happen.
+
+   Each journal page has a sequence number from the same counter as the chunks. On mount, an
+   entry is only applied if its page is newer than the chunk it belongs to, so a checkpoint
+   that was cut short is harmless. A sync that needs several pages is only applied if all of
+   them made it to flash.
+
+   The data itself is always written before the map entries that point at it. A slot that is
+   replaced stays marked as used until the map change has been committed, because until then
+   the map on flash still points at it. For the same reason a partly used sector is never
+   erased in place: its live slots are copied to a sector kept free for the purpose, and it
+   becomes the new spare once that move has been committed.
+*/
+
+#define MAGIC_8_BYTES "RHE!FS30"    // old format, with the map fixed in flash sectors 0-14
+#define MAP_CHUNK_MAGIC 0x434D3841  // "A8MC"
+#define MAP_JOURNAL_MAGIC 0x4A4D3841    // "A8MJ"
 
 #define NUM_FAT_SECTORS 30716   // 15megs / 512bytes = 30720, but we used 4 records for the header (8 bytes)
 #define NUM_FLASH_SECTORS 3840  // 15megs / 4096bytes = 3840
- 
+#define OLD_MAP_SECTORS 15
+
+#define MAP_AREA_SECTORS 40     // flash sectors 0-39 hold copies of the map chunks
+#define MAP_CHUNK_ENTRIES 2040
+#define MAP_FAT_CHUNKS 16       // 30716 map entries
+#define MAP_WEAR_CHUNKS 2       // 3840 erase counts
+#define NUM_MAP_CHUNKS (MAP_FAT_CHUNKS + MAP_WEAR_CHUNKS)
+#define NUM_MAP_WORDS (NUM_MAP_CHUNKS * MAP_CHUNK_ENTRIES)
+
+#define MAP_AREA_FREE -1
+#define MAP_AREA_JOURNAL -2
+#define JOURNAL_SECTORS 2       // 18 chunks + 2 journal + 18 checkpoint targets fit in the map area
+#define JOURNAL_PAGE_ENTRIES 60
+#define PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define JOURNAL_MAX_PENDING (PAGES_PER_SECTOR * JOURNAL_PAGE_ENTRIES)  // a sync fits one journal sector
+
+#define WEAR_CANDIDATES 8       // free sectors looked at for the least worn
+#define WEAR_LEVEL_SPREAD 256   // erase count gap at which static data is moved
+#define WEAR_LEVEL_MOVES 4      // sectors of it moved at a time
+#define RESERVE_SECTORS 1       // kept free for moving a partly used sector
+#define VERIFY_QUEUE_SIZE 128   // slots waiting for the scrub
+#define BAD_SLOTS_MAX 16        // slots remembered as failing their check
+#define READ_CACHE_MAX 64       // sectors in the read cache, at most
+#define READ_AHEAD_SECTORS 8
+#define NO_SECTOR 0xFFFF
+#define PRE_ERASE_SECTORS 16    // free sectors kept erased ahead of time
+#define COMPACT_FREE_SECTORS (NUM_FLASH_SECTORS / 8)  // compact when fewer are free than this
+
 typedef struct {
-    uint8_t header[8];
-    uint16_t sectors[NUM_FAT_SECTORS];  // map FAT sectors -> flash sectors
+    uint16_t sectors[MAP_FAT_CHUNKS * MAP_CHUNK_ENTRIES];       // map FAT sectors -> flash sectors
+    uint16_t erase_count[MAP_WEAR_CHUNKS * MAP_CHUNK_ENTRIES];  // per flash sector
 } sector_map;
 
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;       // the copy of a chunk with the highest seq is current
+    uint16_t chunk;
+    uint16_t unused;
+    uint32_t crc;       // of the data
+} chunk_header;     // followed by the chunk's MAP_CHUNK_ENTRIES entries, filling a flash sector
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t count;
+    uint16_t more;      // pages still to come in the same sync
+    uint32_t crc;       // of the whole page, with crc = 0
+    struct {
+        uint16_t index; // into fs_map, as uint16_t's
+        uint16_t value;
+    } entries[JOURNAL_PAGE_ENTRIES];
+} journal_page;     // one flash page
+
 sector_map fs_map;
-bool fs_map_needs_written[15];
+bool fs_map_needs_written[NUM_MAP_CHUNKS];  // changed since the last checkpoint
+uint16_t *map_words = (uint16_t *)&fs_map;
+
+int8_t map_area_chunk[MAP_AREA_SECTORS];    // chunk whose current copy is in each map area sector, or MAP_AREA_
+uint32_t chunk_seq[NUM_MAP_CHUNKS];
+uint32_t map_seq = 0;
+
+int8_t journal_sector[JOURNAL_SECTORS];     // oldest first
+int journal_sectors = 0;
+int journal_next_page = PAGES_PER_SECTOR;   // in the newest journal sector
+uint16_t journal_pending[JOURNAL_MAX_PENDING];  // map words changed since the last commit
+int journal_pending_count = 0;
+bool journal_overflow = false;
+
+uint8_t pending_free[NUM_FLASH_SECTORS];    // slots replaced since the last commit
+int pending_free_count = 0;
 
 uint8_t used_bitmap[NUM_FLASH_SECTORS];    // we will use 256 flash sectors for 2048 fat sectors
 
+// sets of flash sectors, kept up to date with used_bitmap so the allocator never has to scan it.
+// one bit per sector, plus a summary bit per non-zero word, so finding one is a couple of ctz's
+#define SET_WORDS ((NUM_FLASH_SECTORS + 31) / 32)
+typedef struct {
+    uint32_t words[SET_WORDS];
+    uint32_t summary[(SET_WORDS + 31) / 32];
+} sector_set;
+
+sector_set free_sectors;    // completely free
+sector_set space_sectors;   // at least one free slot
+sector_set erased_sectors;  // free and already erased
+int free_sector_count = 0;
+int erased_sector_count = 0;
+
 uint16_t write_sector = 0;   // which flash sector we are writing to
 uint8_t write_sector_bitmap = 0;   // 1 for each free 512 byte page on the sector
 
+// slots written but not checked yet
+typedef struct {
+    uint16_t mapEntry;
+    uint32_t crc;
+} unverified_write;
+
+unverified_write verify_queue[VERIFY_QUEUE_SIZE];
+int verify_count = 0;
+int crc_dma = -1;
+uint16_t bad_slots[BAD_SLOTS_MAX];  // map entries whose check failed, until their sector is erased
+int bad_slot_count = 0;
+bool verify_failed = false;         // a check failed since the last sync
+
+// FAT sector writes are gathered here and programmed a whole flash sector at a time
+uint8_t write_buf[FLASH_SECTOR_SIZE];
+uint16_t write_buf_fat_sector[8];
+int write_buf_count = 0;
+
+// read cache and read-ahead, only when there is RAM for them
+uint8_t *read_cache = NULL;
+int read_cache_size = 0;
+uint16_t read_cache_sector[READ_CACHE_MAX];     // FAT sector in each slot, or NO_SECTOR
+bool read_cache_ref[READ_CACHE_MAX];
+int read_cache_hand = 0;
+uint8_t *read_ahead = NULL;
+uint16_t read_ahead_first = 0;
+uint16_t read_ahead_count = 0;
+int read_dma = -1;
+flash_fs_stats read_stats;
+
 // each sector entry in the sector map is:
 //  13 bits of sector (indexing 8192 4k flash sectors)
 //   3 bits of offset (0->7 512 byte FAT sectors in each 4k flash sector)
@@ -55,7 +211,15 @@ uint16_t makeMapEntry(uint16_t sector, uint8_t offset) { return (sector << 3) |
 void flash_read_sector(uint16_t sector, uint8_t offset, void *buffer, uint16_t size);
 void flash_erase_sector(uint16_t sector);
 void flash_write_sector(uint16_t sector, uint8_t offset, const void *buffer, uint16_t size);
-void flash_erase_with_copy_sector(uint16_t sector, uint8_t preserve_bitmap);
+void flash_program_page(uint16_t sector, uint8_t page, const void *buffer);
+void setUsedBitmap(uint16_t sector, uint8_t bits);
+void setMapEntry(uint16_t fat_sector, uint16_t mapEntry);
+bool verifyPending(uint16_t sector, uint8_t slots);
+bool slotBad(uint16_t mapEntry);
+void setSlotBad(uint16_t mapEntry);
+void readDmaWait();
+void resetReadCache();
+void resetChecks();
 
 void debug_print_in_use() {
     return;
@@ -71,46 +235,430 @@ void debug_print_in_use() {
     printf("END--------------------------------------\n");
 }
 
+bool flush_write_buf();
+
+uint32_t crc32(uint32_t crc, const void *data, int len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i=0; i<8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+uint16_t *chunkData(int chunk) { return map_words + (chunk * MAP_CHUNK_ENTRIES); }
+
+void mapChanged(uint16_t index)
+{
+    fs_map_needs_written[index / MAP_CHUNK_ENTRIES] = true;
+    if (journal_overflow)
+        return;
+    for (int i=0; i<journal_pending_count; i++)
+        if (journal_pending[i] == index)
+            return;
+    if (journal_pending_count == JOURNAL_MAX_PENDING)
+        journal_overflow = true;
+    else
+        journal_pending[journal_pending_count++] = index;
+}
+
+void releasePendingFrees()
+{
+    // the map on flash no longer points at these slots, so they can be reused
+    for (int i=0; pending_free_count && i<NUM_FLASH_SECTORS; i++) {
+        if (pending_free[i]) {
+            setUsedBitmap(i, used_bitmap[i] & ~pending_free[i]);
+            pending_free[i] = 0;
+            pending_free_count--;
+        }
+    }
+}
+
+void resetJournal()
+{
+    journal_sectors = 0;
+    journal_next_page = PAGES_PER_SECTOR;
+    journal_pending_count = 0;
+    journal_overflow = false;
+    memset(pending_free, 0, sizeof(pending_free));
+    pending_free_count = 0;
+}
+
+int pickMapAreaSector(const bool *taken)
+{
+    // least worn map area sector not holding a current chunk or journal
+    int best = -1;
+    for (int i=0; i<MAP_AREA_SECTORS; i++) {
+        if (map_area_chunk[i] != MAP_AREA_FREE || taken[i]) continue;
+        if (best < 0 || fs_map.erase_count[i] < fs_map.erase_count[best])
+            best = i;
+    }
+    return best;
+}
+
+void writeChunk(uint16_t sector, int chunk)
+{
+    chunk_header hdr = { MAP_CHUNK_MAGIC, ++map_seq, chunk, 0, crc32(0, chunkData(chunk), MAP_CHUNK_ENTRIES * 2) };
+    const uint8_t *data = (const uint8_t *)chunkData(chunk);
+    uint8_t page[FLASH_PAGE_SIZE];
+
+    memcpy(page, &hdr, sizeof(hdr));
+    memcpy(page + sizeof(hdr), data, FLASH_PAGE_SIZE - sizeof(hdr));
+    flash_program_page(sector, 0, page);
+    for (int i=1; i<PAGES_PER_SECTOR; i++)
+        flash_program_page(sector, i, data + (i * FLASH_PAGE_SIZE) - sizeof(hdr));
+    chunk_seq[chunk] = hdr.seq;
+}
+
 void write_fs_map()
 {   
+    // checkpoint: write every chunk changed since the last one, after which the journal is empty
+    int8_t target[NUM_MAP_CHUNKS];
+    bool taken[MAP_AREA_SECTORS] = { false };
+    bool more = true;
+
     debug_print_in_use();
-    for (int i=0; i<15; i++) {
-        if (fs_map_needs_written[i]) {
-//          printf("Writing FS Map %d\n", i);
-            flash_erase_sector(i);
-            flash_write_sector(i, 0, (uint8_t*)&fs_map+(4096*i), 4096);
-            fs_map_needs_written[i] = false;
+    memset(target, -1, sizeof(target));
+    // erase a sector for each changed chunk first, as erasing changes the erase count chunks
+    while (more) {
+        more = false;
+        for (int c=0; c<NUM_MAP_CHUNKS; c++) {
+            if (fs_map_needs_written[c] && target[c] < 0) {
+                target[c] = pickMapAreaSector(taken);
+                taken[target[c]] = true;
+                flash_erase_sector(target[c]);
+                more = true;
+            }
         }
     }
+    for (int c=0; c<NUM_MAP_CHUNKS; c++) {
+        if (target[c] < 0) continue;
+//      printf("Writing FS Map %d to %d\n", c, target[c]);
+        writeChunk(target[c], c);
+        for (int i=0; i<MAP_AREA_SECTORS; i++)
+            if (map_area_chunk[i] == c)
+                map_area_chunk[i] = MAP_AREA_FREE;  // old copy
+        map_area_chunk[target[c]] = c;
+        fs_map_needs_written[c] = false;
+    }
+    for (int i=0; i<MAP_AREA_SECTORS; i++)
+        if (map_area_chunk[i] == MAP_AREA_JOURNAL)
+            map_area_chunk[i] = MAP_AREA_FREE;
+    journal_sectors = 0;
+    journal_next_page = PAGES_PER_SECTOR;
+    journal_pending_count = 0;
+    journal_overflow = false;
+    releasePendingFrees();
+}
+
+bool journalAppend()
+{
+    // write the pending map changes to the journal, false if it needs a checkpoint instead
+    int pages = (journal_pending_count + JOURNAL_PAGE_ENTRIES - 1) / JOURNAL_PAGE_ENTRIES;
+    if (journal_overflow)
+        return false;
+    if (journal_next_page + pages > PAGES_PER_SECTOR) {
+        bool taken[MAP_AREA_SECTORS] = { false };
+        if (journal_sectors == JOURNAL_SECTORS)
+            return false;
+        int sector = pickMapAreaSector(taken);
+        flash_erase_sector(sector);     // (adds its erase count to the pending changes)
+        pages = (journal_pending_count + JOURNAL_PAGE_ENTRIES - 1) / JOURNAL_PAGE_ENTRIES;
+        if (journal_overflow)
+            return false;
+        map_area_chunk[sector] = MAP_AREA_JOURNAL;
+        journal_sector[journal_sectors++] = sector;
+        journal_next_page = 0;
+    }
+    journal_page jp;
+    for (int n=0; n<journal_pending_count; n+=JOURNAL_PAGE_ENTRIES) {
+        memset(&jp, 0, sizeof(jp));
+        jp.magic = MAP_JOURNAL_MAGIC;
+        jp.seq = ++map_seq;
+        jp.count = journal_pending_count - n;
+        if (jp.count > JOURNAL_PAGE_ENTRIES)
+            jp.count = JOURNAL_PAGE_ENTRIES;
+        jp.more = --pages;
+        for (int i=0; i<jp.count; i++) {
+            jp.entries[i].index = journal_pending[n + i];
+            jp.entries[i].value = map_words[journal_pending[n + i]];
+        }
+        jp.crc = crc32(0, &jp, sizeof(jp));
+        flash_program_page(journal_sector[journal_sectors - 1], journal_next_page++, &jp);
+    }
+    journal_pending_count = 0;
+    return true;
+}
+
+void commitMap()
+{
+    // bring the map on flash up to date, normally with a single journal page
+    if ((journal_pending_count || journal_overflow) && !journalAppend())
+        write_fs_map();
+    releasePendingFrees();
+}
+
+const journal_page *journalPage(int sector, int page)
+{
+    return (const journal_page *)(XIP_BASE + HW_FLASH_STORAGE_BASE + (sector * FLASH_SECTOR_SIZE) + (page * FLASH_PAGE_SIZE));
+}
+
+bool journalPageValid(const journal_page *jp)
+{
+    journal_page copy;
+    if (jp->magic != MAP_JOURNAL_MAGIC || jp->count > JOURNAL_PAGE_ENTRIES)
+        return false;
+    memcpy(&copy, jp, sizeof(copy));
+    copy.crc = 0;
+    return crc32(0, &copy, sizeof(copy)) == jp->crc;
+}
+
+bool pageErased(int sector, int page)
+{
+    const uint32_t *p = (const uint32_t *)journalPage(sector, page);
+    for (int i=0; i<FLASH_PAGE_SIZE/4; i++)
+        if (p[i] != 0xFFFFFFFF)
+            return false;
+    return true;
+}
+
+void replayJournal()
+{
+    // apply the journal on top of the chunks, oldest page first. journal sectors with nothing
+    // newer than the chunks are left over from before a checkpoint, and are free
+    int8_t order[MAP_AREA_SECTORS];
+    int n = 0;
+
+    for (int i=0; i<MAP_AREA_SECTORS; i++) {
+        if (map_area_chunk[i] != MAP_AREA_FREE || !journalPageValid(journalPage(i, 0)))
+            continue;
+        int j = n++;
+        for (; j > 0 && journalPage(order[j-1], 0)->seq > journalPage(i, 0)->seq; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+    for (int k=0; k<n; k++) {
+        int sector = order[k], page = 0;
+        bool applied = false;
+        while (page < PAGES_PER_SECTOR) {
+            const journal_page *jp = journalPage(sector, page);
+            if (!journalPageValid(jp))
+                break;
+            int group = jp->more + 1;
+            bool whole = page + group <= PAGES_PER_SECTOR;
+            for (int g=1; whole && g<group; g++)
+                whole = journalPageValid(journalPage(sector, page + g));
+            if (!whole)
+                break;  // sync was cut short
+            for (int g=0; g<group; g++, jp++) {
+                if (jp->seq > map_seq)
+                    map_seq = jp->seq;
+                for (int i=0; i<jp->count; i++) {
+                    uint16_t index = jp->entries[i].index;
+                    if (index >= NUM_MAP_WORDS || jp->seq <= chunk_seq[index / MAP_CHUNK_ENTRIES])
+                        continue;
+                    map_words[index] = jp->entries[i].value;
+                    fs_map_needs_written[index / MAP_CHUNK_ENTRIES] = true;
+                    applied = true;
+                }
+            }
+            page += group;
+        }
+        if (!applied)
+            continue;
+        map_area_chunk[sector] = MAP_AREA_JOURNAL;
+        if (journal_sectors == JOURNAL_SECTORS) {
+            journal_overflow = true;    // shouldn't happen, checkpoint at the next sync
+            continue;
+        }
+        journal_sector[journal_sectors++] = sector;
+        journal_next_page = (page < PAGES_PER_SECTOR && pageErased(sector, page)) ? page : PAGES_PER_SECTOR;
+    }
+}
+
+int loadMapArea()
+{
+    // find the newest copy of each chunk, returns 0 if any are missing
+    int best[NUM_MAP_CHUNKS];
+
+    memset(best, -1, sizeof(best));
+    memset(map_area_chunk, MAP_AREA_FREE, sizeof(map_area_chunk));
+    map_seq = 0;
+    for (int i=0; i<MAP_AREA_SECTORS; i++) {
+        const chunk_header *hdr = (const chunk_header *)(XIP_BASE + HW_FLASH_STORAGE_BASE + (i * FLASH_SECTOR_SIZE));
+        if (hdr->magic != MAP_CHUNK_MAGIC || hdr->chunk >= NUM_MAP_CHUNKS)
+            continue;
+        if (best[hdr->chunk] >= 0 && hdr->seq <= chunk_seq[hdr->chunk])
+            continue;
+        if (crc32(0, hdr + 1, MAP_CHUNK_ENTRIES * 2) != hdr->crc)
+            continue;   // torn write
+        best[hdr->chunk] = i;
+        chunk_seq[hdr->chunk] = hdr->seq;
+        if (hdr->seq > map_seq)
+            map_seq = hdr->seq;
+    }
+    for (int c=0; c<NUM_MAP_CHUNKS; c++)
+        if (best[c] < 0)
+            return 0;
+    for (int c=0; c<NUM_MAP_CHUNKS; c++) {
+        const chunk_header *hdr = (const chunk_header *)(XIP_BASE + HW_FLASH_STORAGE_BASE + (best[c] * FLASH_SECTOR_SIZE));
+        memcpy(chunkData(c), hdr + 1, MAP_CHUNK_ENTRIES * 2);
+        map_area_chunk[best[c]] = c;
+    }
+    return 1;
+}
+
+void setInSet(sector_set *set, uint16_t sector, bool in)
+{
+    int w = sector >> 5;
+    if (in) {
+        set->words[w] |= 1u << (sector & 31);
+        set->summary[w >> 5] |= 1u << (w & 31);
+    }
+    else {
+        set->words[w] &= ~(1u << (sector & 31));
+        if (!set->words[w])
+            set->summary[w >> 5] &= ~(1u << (w & 31));
+    }
+}
+
+int firstWord(const sector_set *set, int w)
+{
+    // first non-zero word >= w, or -1
+    for (int i = w >> 5; i < count_of(set->summary); i++) {
+        uint32_t m = set->summary[i];
+        if (i == (w >> 5))
+            m &= ~0u << (w & 31);
+        if (m)
+            return i * 32 + __builtin_ctz(m);
+    }
+    return -1;
+}
+
+int findInSet(const sector_set *set, uint16_t start)
+{
+    // first sector in the set from start on, wrapping round, or -1 if empty
+    int w = start >> 5;
+    uint32_t m = set->words[w] & (~0u << (start & 31));
+    if (m)
+        return w * 32 + __builtin_ctz(m);
+    if ((w = firstWord(set, w + 1)) < 0 && (w = firstWord(set, 0)) < 0)
+        return -1;
+    return w * 32 + __builtin_ctz(set->words[w]);
+}
+
+bool inSet(const sector_set *set, uint16_t sector) { return (set->words[sector >> 5] >> (sector & 31)) & 1; }
+
+void setErased(uint16_t sector, bool erased)
+{
+    if (inSet(&erased_sectors, sector) == erased)
+        return;
+    erased_sector_count += erased ? 1 : -1;
+    setInSet(&erased_sectors, sector, erased);
+}
+
+void prepareSector(uint16_t sector)
+{
+    // erase a free sector that's about to be written, unless that was done in advance
+    if (inSet(&erased_sectors, sector))
+        setErased(sector, false);
+    else
+        flash_erase_sector(sector);
+}
+
+void setUsedBitmap(uint16_t sector, uint8_t bits)
+{
+    used_bitmap[sector] = bits;
+    if (sector < MAP_AREA_SECTORS)
+        return;     // never handed out for data
+    if (bits)
+        setErased(sector, false);
+    free_sector_count += (bits == 0) - inSet(&free_sectors, sector);
+    setInSet(&free_sectors, sector, bits == 0);
+    setInSet(&space_sectors, sector, bits != 0xFF);
+}
+
+int leastWornInSet(const sector_set *set, uint16_t *search_pos, int exclude)
+{
+    // of the next few sectors in the set, the one erased the fewest times
+    int best = -1, sector = *search_pos;
+    for (int i=0; i<WEAR_CANDIDATES; i++) {
+        sector = findInSet(set, sector);
+        if (sector < 0) break;
+        if (sector != exclude && (best < 0 || fs_map.erase_count[sector] < fs_map.erase_count[best]))
+            best = sector;
+        sector = (sector + 1) % NUM_FLASH_SECTORS;
+    }
+    if (best >= 0)
+        *search_pos = (best + 1) % NUM_FLASH_SECTORS;
+    return best;
+}
+
+bool moveToReserve()
+{
+    // no free sectors left, so copy the live slots of a partly used sector into the reserve
+    // and carry on writing there. returns false if the flash is full
+    static uint16_t search_start_pos = 0;
+    uint16_t fat_sectors[8];
+    uint8_t live = 0;
+    int reserve = findInSet(&free_sectors, 0);
+    if (reserve < 0)
+        return false;
+    int sector = leastWornInSet(&space_sectors, &search_start_pos, reserve);
+
+    write_sector = reserve;
+    write_sector_bitmap = 0xFF;
+    prepareSector(reserve);
+    if (sector < 0)
+        return true;    // nowhere else has room, use the reserve itself
+
+    uint8_t buf[FLASH_SECTOR_SIZE];
+    memset(buf, 0xFF, FLASH_SECTOR_SIZE);
+    verifyPending(sector, 0xFF);
+    for (int i=0; i<NUM_FAT_SECTORS; i++) {
+        uint16_t mapEntry = fs_map.sectors[i];
+        if (mapEntry && getMapSector(mapEntry) == sector) {
+            uint8_t offset = getMapOffset(mapEntry);
+            flash_read_sector(sector, offset, buf + (offset * 512), 512);
+            fat_sectors[offset] = i;
+            live |= (1 << offset);
+        }
+    }
+    flash_write_sector(reserve, 0, buf, FLASH_SECTOR_SIZE);
+    for (int i=0; i<8; i++) {
+        if (!(live & (1 << i)))
+            continue;
+        if (slotBad(makeMapEntry(sector, i)))
+            setSlotBad(makeMapEntry(reserve, i));   // still not what was written
+        setMapEntry(fat_sectors[i], makeMapEntry(reserve, i));
+    }
+    write_sector_bitmap = ~live;
+    return true;
 }
 
 uint16_t getNextWriteSector()
 {
+    // returns 0 if the flash is full
     static uint16_t search_start_pos = 0;
-    int i;
     if (write_sector == 0 || write_sector_bitmap == 0)
-    {   // first try to find a completely free sector
-        for (i=0; i<NUM_FLASH_SECTORS; i++) {
-            if (used_bitmap[(i + search_start_pos) % NUM_FLASH_SECTORS] == 0)
-                break;
+    {
+        if (free_sector_count <= RESERVE_SECTORS && pending_free_count)
+            commitMap();    // slots replaced since the last sync may free up whole sectors
+        if (free_sector_count > RESERVE_SECTORS)
+        {   // a completely free sector, preferably one erased in advance
+            int sector = leastWornInSet(&erased_sectors, &search_start_pos, -1);
+            write_sector = (sector >= 0) ? sector : leastWornInSet(&free_sectors, &search_start_pos, -1);
+            write_sector_bitmap = 0xFF;
+            prepareSector(write_sector);
         }
-        if (i < NUM_FLASH_SECTORS) {
-           write_sector = (i + search_start_pos) % NUM_FLASH_SECTORS;
-           write_sector_bitmap = 0xFF;
-           flash_erase_sector(write_sector);
+        else if (!moveToReserve()) {
+            write_sector = 0;
+            return 0;
         }
-        else
-        {   // no completely free sector, just return the first sector with space
-            for (i=0; i<NUM_FLASH_SECTORS; i++) {
-                if (used_bitmap[(i + search_start_pos) % NUM_FLASH_SECTORS] != 0xFF)
-                    break;
-            }
-            write_sector = (i + search_start_pos) % NUM_FLASH_SECTORS;
-            write_sector_bitmap = ~used_bitmap[write_sector];
-            flash_erase_with_copy_sector(write_sector, used_bitmap[write_sector]);
-        }
-        search_start_pos = (i + search_start_pos) % NUM_FLASH_SECTORS;
     }
+    int i;
     // if we get here, then at least one 512 byte page is free on the write_sector
     for (i=0; i<8; i++) {
         if (write_sector_bitmap & (1 << i))
@@ -121,34 +669,82 @@ uint16_t getNextWriteSector()
     return makeMapEntry(write_sector, i);
 }
 
+int findFreeSector()
+{
+    // a completely free flash sector for a full write_buf, or -1
+    static uint16_t search_start_pos = 0;
+    // (write_sector may have erased slots handed out above)
+    if (free_sector_count <= RESERVE_SECTORS + 1)
+        return -1;
+    int sector = leastWornInSet(&erased_sectors, &search_start_pos, write_sector);
+    if (sector < 0)
+        sector = leastWornInSet(&free_sectors, &search_start_pos, write_sector);
+    return sector;
+}
+
 void init_used_bitmap() {
     memset(used_bitmap, 0, NUM_FLASH_SECTORS);
-    for (int i=0; i<15; i++)
-        used_bitmap[i] = 0xFF;    // first 15 flash sectors used by fs map
+    for (int i=0; i<MAP_AREA_SECTORS; i++)
+        used_bitmap[i] = 0xFF;    // map area
 
     for (int i=0; i<NUM_FAT_SECTORS; i++) {
         uint16_t mapEntry = fs_map.sectors[i];
         if (mapEntry)
             used_bitmap[getMapSector(mapEntry)] |= (1 << getMapOffset(mapEntry));
     }
+    memset(&free_sectors, 0, sizeof(free_sectors));
+    memset(&space_sectors, 0, sizeof(space_sectors));
+    memset(&erased_sectors, 0, sizeof(erased_sectors));
+    free_sector_count = 0;
+    erased_sector_count = 0;
+    for (int i=0; i<NUM_FLASH_SECTORS; i++)
+        setUsedBitmap(i, used_bitmap[i]);
     write_sector = 0;
+    write_buf_count = 0;
+}
+
+int migrateOldMap()
+{
+    // the old format had the map fixed in flash sectors 0-14, after an 8 byte header.
+    // data in the rest of what is now the map area has to be moved out first
+    char header[8];
+    flash_read_sector(0, 0, header, 8);
+    if (memcmp(header, MAGIC_8_BYTES, 8) != 0)
+        return 0;
+    printf("migrating flash fs map\n");
+    memset(&fs_map, 0, sizeof(fs_map));
+    memcpy(fs_map.sectors, (const uint8_t *)(XIP_BASE + HW_FLASH_STORAGE_BASE + 8), NUM_FAT_SECTORS * 2);
+    init_used_bitmap();
+    for (int i=0; i<NUM_FAT_SECTORS; i++) {
+        uint16_t mapEntry = fs_map.sectors[i];
+        if (mapEntry && getMapSector(mapEntry) < MAP_AREA_SECTORS) {
+            uint8_t buf[512];
+            flash_read_sector(getMapSector(mapEntry), getMapOffset(mapEntry), buf, 512);
+            flash_fs_write_FAT_sector(i, buf);
+        }
+    }
+    flush_write_buf();
+    for (int c=0; c<NUM_MAP_CHUNKS; c++)
+        fs_map_needs_written[c] = true;
+    write_fs_map();
+    return 1;
 }
 
 int flash_fs_mount()
 {
-    for (int i=0; i<15; i++)
+    resetReadCache();
+    for (int i=0; i<NUM_MAP_CHUNKS; i++)
         fs_map_needs_written[i] = false;
+    resetJournal();
+    resetChecks();
 
-    // read the first sector, with header
-    flash_read_sector(0, 0, &fs_map, 4096);
-    if (memcmp(fs_map.header, MAGIC_8_BYTES, 8) != 0) {
+    if (!loadMapArea()) {
+        if (migrateOldMap())
+            return 0;
         printf("mountFlashFS() - magic bytes not found\n");
         return 1;
     }
-    // read the remaining 14 sectors without headers
-    for (int i=1; i<15; i++)
-        flash_read_sector(i, 0, (uint8_t*)&fs_map+(4096*i), 4096);
-
+    replayJournal();
     init_used_bitmap();
     debug_print_in_use();
     return 0;
@@ -157,56 +753,552 @@ int flash_fs_mount()
 void flash_fs_create()
 {
     printf("flash_fs_create()\n");
-    memset(&fs_map, 0, sizeof(fs_map));
-    strcpy(fs_map.header, MAGIC_8_BYTES);
-    for (int i=0; i<15; i++)
+    resetReadCache();
+    resetJournal();
+    resetChecks();
+    // keep the erase counts, if there are any
+    if (loadMapArea())
+        replayJournal();
+    else
+        memset(&fs_map, 0, sizeof(fs_map));
+    memset(fs_map.sectors, 0, sizeof(fs_map.sectors));
+    for (int i=0; i<NUM_MAP_CHUNKS; i++)
         fs_map_needs_written[i] = true;
-    write_fs_map();
     init_used_bitmap();
+    write_fs_map();
 }
 
-void flash_fs_sync()
+bool flash_fs_sync()
 {
-    write_fs_map();
+    // false if a buffered sector couldn't be written (see writeSlot()), or a write has
+    // failed its check since the last sync
+    bool ok = flush_write_buf() && !verify_failed;
+    verify_failed = false;
+    commitMap();
+    return ok;
 }
 
-void flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer)
+int findWriteBuf(uint16_t fat_sector)
 {
-    int mapEntry = fs_map.sectors[fat_sector];
-    if (mapEntry)
-        flash_read_sector(getMapSector(mapEntry), getMapOffset(mapEntry), buffer, 512);
-    else
+    for (int i=0; i<write_buf_count; i++)
+        if (write_buf_fat_sector[i] == fat_sector)
+            return i;
+    return -1;
+}
+
+void dmaRead(void *buffer, uint16_t mapEntry, int slots, bool wait)
+{
+    // copy slots from the uncached XIP alias
+    if (read_dma < 0)
+        read_dma = dma_claim_unused_channel(true);
+    dma_channel_wait_for_finish_blocking(read_dma);
+    bool aligned = ((uint32_t)buffer & 3) == 0;
+    dma_channel_config c = dma_channel_get_default_config(read_dma);
+    channel_config_set_transfer_data_size(&c, aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    dma_channel_configure(read_dma, &c, buffer, (const void *)(XIP_NOCACHE_NOALLOC_BASE + FLASH_FS_ENTRY_OFFSET(mapEntry)),
+        slots * (aligned ? 128 : 512), true);
+    if (wait)
+        dma_channel_wait_for_finish_blocking(read_dma);
+}
+
+void readDmaWait()
+{
+    // the flash can't be read while it is being erased or programmed
+    if (read_dma >= 0)
+        dma_channel_wait_for_finish_blocking(read_dma);
+}
+
+void resetReadCache()
+{
+    readDmaWait();
+    for (int i=0; i<READ_CACHE_MAX; i++) {
+        read_cache_sector[i] = NO_SECTOR;
+        read_cache_ref[i] = false;
+    }
+    read_ahead_count = 0;
+}
+
+void flash_fs_set_read_buffers(void *mem, uint32_t size)
+{
+    // mem must stay ours until the next reset
+    resetReadCache();
+    read_ahead = NULL;
+    read_cache_size = 0;
+    if (size < READ_AHEAD_SECTORS * 512)
+        return;
+    read_ahead = (uint8_t *)mem;
+    read_cache = read_ahead + (READ_AHEAD_SECTORS * 512);
+    read_cache_size = (size / 512) - READ_AHEAD_SECTORS;
+    if (read_cache_size > READ_CACHE_MAX)
+        read_cache_size = READ_CACHE_MAX;
+}
+
+int findReadCache(uint16_t fat_sector)
+{
+    for (int i=0; i<read_cache_size; i++)
+        if (read_cache_sector[i] == fat_sector)
+            return i;
+    return -1;
+}
+
+void addReadCache(uint16_t fat_sector, const void *buffer)
+{
+    // CLOCK, replace the first sector not used since the hand last passed it
+    if (!read_cache_size)
+        return;
+    while (read_cache_ref[read_cache_hand]) {
+        read_cache_ref[read_cache_hand] = false;
+        read_cache_hand = (read_cache_hand + 1) % read_cache_size;
+    }
+    read_cache_sector[read_cache_hand] = fat_sector;
+    memcpy(read_cache + (read_cache_hand * 512), buffer, 512);
+    read_cache_hand = (read_cache_hand + 1) % read_cache_size;
+}
+
+bool inReadAhead(uint16_t fat_sector)
+{
+    return (uint16_t)(fat_sector - read_ahead_first) < read_ahead_count;
+}
+
+void dropCachedSector(uint16_t fat_sector)
+{
+    // the sector is changing
+    int i = findReadCache(fat_sector);
+    if (i >= 0) {
+        read_cache_sector[i] = NO_SECTOR;
+        read_cache_ref[i] = false;
+    }
+    if (inReadAhead(fat_sector))
+        read_ahead_count = 0;
+}
+
+void startReadAhead(uint16_t fat_sector)
+{
+    // fetch the sectors after a multi-sector read while the caller deals with it,
+    // as far as their slots follow on in flash
+    if (!read_ahead || inReadAhead(fat_sector) || fat_sector >= NUM_FAT_SECTORS)
+        return;
+    read_ahead_count = 0;
+    uint16_t mapEntry = fs_map.sectors[fat_sector];
+    if (!mapEntry)
+        return;
+    int n = 1;
+    while (n < READ_AHEAD_SECTORS && fat_sector + n < NUM_FAT_SECTORS && fs_map.sectors[fat_sector + n] == mapEntry + n)
+        n++;
+    dmaRead(read_ahead, mapEntry, n, false);
+    read_ahead_first = fat_sector;
+    read_ahead_count = n;
+}
+
+bool readCached(uint16_t fat_sector, void *buffer, bool *ok)
+{
+    // sectors that don't need reading from flash
+    int i = findWriteBuf(fat_sector);
+    if (i >= 0) {   // not written to flash yet
+        memcpy(buffer, write_buf + (i * 512), 512);
+        return true;
+    }
+    uint16_t mapEntry = fs_map.sectors[fat_sector];
+    if (!mapEntry) {
         memset(buffer, 0, 512);
-    return;
+        return true;
+    }
+    i = findReadCache(fat_sector);
+    if (i >= 0) {
+        memcpy(buffer, read_cache + (i * 512), 512);
+        read_cache_ref[i] = true;
+        read_stats.cache_hits++;
+        return true;
+    }
+    if (inReadAhead(fat_sector)) {
+        readDmaWait();
+        memcpy(buffer, read_ahead + ((uint16_t)(fat_sector - read_ahead_first) * 512), 512);
+        *ok &= verifyPending(getMapSector(mapEntry), 1 << getMapOffset(mapEntry));
+        read_stats.read_ahead_hits++;
+        if (fat_sector == read_ahead_first + read_ahead_count - 1) {
+            read_ahead_count = 0;   // used it all, fetch the next lot
+            startReadAhead(fat_sector + 1);
+        }
+        return true;
+    }
+    return false;
 }
 
-void flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer)
+bool flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer)
 {
+    // returns false if the slot turns out not to hold what was written to it
+    bool ok = true;
+    if (readCached(fat_sector, buffer, &ok))
+        return ok;
     uint16_t mapEntry = fs_map.sectors[fat_sector];
-    if (mapEntry)
-    {   // mark any previous flash allocated as unused
-        used_bitmap[getMapSector(mapEntry)] &= ~(1 << getMapOffset(mapEntry));
+    flash_read_sector(getMapSector(mapEntry), getMapOffset(mapEntry), buffer, 512);
+    if (!verifyPending(getMapSector(mapEntry), 1 << getMapOffset(mapEntry)))
+        return false;
+    if (read_cache_size)
+        read_stats.cache_misses++;
+    addReadCache(fat_sector, buffer);
+    return true;
+}
+
+bool flash_fs_read_FAT_sectors(uint16_t fat_sector, int count, uint8_t *buffer)
+{
+    // single sectors go through the cache, longer reads by DMA a run of slots at a time
+    if (count == 1)
+        return flash_fs_read_FAT_sector(fat_sector, buffer);
+    bool ok = true;
+    int i = 0;
+    while (i < count) {
+        uint16_t s = fat_sector + i;
+        if (readCached(s, buffer + (i * 512), &ok)) {
+            i++;
+            continue;
+        }
+        uint16_t mapEntry = fs_map.sectors[s];
+        int n = 1;
+        while (i + n < count && fs_map.sectors[s + n] == mapEntry + n && findWriteBuf(s + n) < 0)
+            n++;
+        dmaRead(buffer + (i * 512), mapEntry, n, true);
+        for (int j=0; j<n; j++)
+            ok &= verifyPending(getMapSector(mapEntry + j), 1 << getMapOffset(mapEntry + j));
+        if (read_ahead)
+            read_stats.read_ahead_misses += n;
+        i += n;
+    }
+    startReadAhead(fat_sector + count);
+    return ok;
+}
+
+uint16_t flash_fs_map_entry(uint16_t fat_sector)
+{
+    if (findWriteBuf(fat_sector) >= 0)
+        return 0;   // only in write_buf
+    return fs_map.sectors[fat_sector];
+}
+
+bool flash_fs_entry_ok(uint16_t mapEntry)
+{
+    // for reads that bypass flash_fs (mapped carts): checks any queued write to the slot now,
+    // false if it turns out bad or is already known to be
+    return verifyPending(getMapSector(mapEntry), 1 << getMapOffset(mapEntry));
+}
+
+void setMapEntry(uint16_t fat_sector, uint16_t mapEntry)
+{
+    uint16_t oldEntry = fs_map.sectors[fat_sector];
+    if (oldEntry)
+    {   // previous flash allocated becomes unused once the map change is committed
+        if (!pending_free[getMapSector(oldEntry)])
+            pending_free_count++;
+        pending_free[getMapSector(oldEntry)] |= (1 << getMapOffset(oldEntry));
     }
-    mapEntry = getNextWriteSector();
     fs_map.sectors[fat_sector] = mapEntry;
-    if (fat_sector < 2044)
-        fs_map_needs_written[0] = true;
-    else
-        fs_map_needs_written[1+((fat_sector-2044)/2048)] = true;
+    mapChanged(fat_sector);
 
-    used_bitmap[getMapSector(mapEntry)] |= (1 << getMapOffset(mapEntry));
+    setUsedBitmap(getMapSector(mapEntry), used_bitmap[getMapSector(mapEntry)] | (1 << getMapOffset(mapEntry)));
+}
 
-    flash_write_sector(getMapSector(mapEntry), getMapOffset(mapEntry), buffer, 512);
+uint32_t dmaCRC(const void *data, uint32_t size)
+{
+    // CRC32 by the DMA sniffer, so the CPU never touches the data (nor, for flash, the XIP cache)
+    static uint32_t sink;
+    if (crc_dma < 0)
+        crc_dma = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(crc_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+    dma_sniffer_enable(crc_dma, 0x0, true);     // CRC-32
+    dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+    dma_channel_configure(crc_dma, &c, &sink, data, size / 4, true);
+    dma_channel_wait_for_finish_blocking(crc_dma);
+    return dma_sniffer_get_data_accumulator();
+}
+
+bool slotBad(uint16_t mapEntry)
+{
+    for (int i=0; i<bad_slot_count; i++)
+        if (bad_slots[i] == mapEntry)
+            return true;
+    return false;
+}
+
+void setSlotBad(uint16_t mapEntry)
+{
+    // when the list is full the oldest goes, its failure has been reported by a sync already
+    if (slotBad(mapEntry))
+        return;
+    if (bad_slot_count == BAD_SLOTS_MAX)
+        memmove(&bad_slots[0], &bad_slots[1], --bad_slot_count * sizeof(uint16_t));
+    bad_slots[bad_slot_count++] = mapEntry;
 }
 
-bool flash_fs_verify_FAT_sector(uint16_t fat_sector, const void *buffer)
+bool verifyWrite(int i)
 {
-    uint8_t read_buf[512];
-    flash_fs_read_FAT_sector(fat_sector, read_buf);
-    if (memcmp(buffer, read_buf, 512) == 0) return true;
+    // check a queued slot against the flash, and take it off the queue
+    unverified_write w = verify_queue[i];
+    verify_queue[i] = verify_queue[--verify_count];
+    const void *flash = (const void *)(XIP_NOCACHE_NOALLOC_BASE + FLASH_FS_ENTRY_OFFSET(w.mapEntry));
+    if (dmaCRC(flash, 512) == w.crc)
+        return true;
+    setSlotBad(w.mapEntry);
+    verify_failed = true;
     return false;
 }
 
+bool verifyPending(uint16_t sector, uint8_t slots)
+{
+    // check any of these slots still queued before their data is used, false if any of
+    // them is bad
+    bool ok = true;
+    for (int i=verify_count-1; i>=0; i--) {
+        uint16_t e = verify_queue[i].mapEntry;
+        if (getMapSector(e) == sector && (slots & (1 << getMapOffset(e))))
+            ok &= verifyWrite(i);
+    }
+    for (int i=0; i<bad_slot_count; i++)
+        if (getMapSector(bad_slots[i]) == sector && (slots & (1 << getMapOffset(bad_slots[i]))))
+            ok = false;
+    return ok;
+}
+
+void resetChecks()
+{
+    // queued checks and bad slots belong to the volume that was there before
+    verify_count = 0;
+    bad_slot_count = 0;
+    verify_failed = false;
+}
+
+void dropPending(uint16_t sector)
+{
+    // the sector is being erased, its queued writes and bad slots are no longer of interest
+    for (int i=verify_count-1; i>=0; i--)
+        if (getMapSector(verify_queue[i].mapEntry) == sector)
+            verify_queue[i] = verify_queue[--verify_count];
+    for (int i=bad_slot_count-1; i>=0; i--)
+        if (getMapSector(bad_slots[i]) == sector)
+            bad_slots[i] = bad_slots[--bad_slot_count];
+}
+
+void queueCheck(uint16_t mapEntry, const uint8_t *buffer, int slots)
+{
+    // CRC each slot from RAM now, check the flash against it later
+    for (int i=0; i<slots; i++) {
+        if (verify_count == VERIFY_QUEUE_SIZE)
+            verifyWrite(0);
+        verify_queue[verify_count].mapEntry = mapEntry + i;
+        verify_queue[verify_count].crc = dmaCRC(buffer + i * 512, 512);
+        verify_count++;
+    }
+}
+
+bool writeSlot(uint16_t fat_sector, const void *buffer)
+{
+    // one 512 byte slot at a time, for when there's no free flash sector (or a partial write_buf).
+    // false if there's no free slot left, the sector keeps its old contents
+    uint16_t mapEntry = getNextWriteSector();
+    if (!mapEntry)
+        return false;
+    flash_write_sector(getMapSector(mapEntry), getMapOffset(mapEntry), buffer, 512);
+    queueCheck(mapEntry, buffer, 1);
+    setMapEntry(fat_sector, mapEntry);
+    return true;
+}
+
+bool flush_write_buf()
+{
+    bool ok = true;
+    if (!write_buf_count)
+        return true;
+    int sector = (write_buf_count == 8) ? findFreeSector() : -1;
+    if (sector >= 0)
+    {   // one erase and one program for all 8
+        prepareSector(sector);
+        flash_write_sector(sector, 0, write_buf, FLASH_SECTOR_SIZE);
+        queueCheck(makeMapEntry(sector, 0), write_buf, 8);
+        for (int i=0; i<8; i++)
+            setMapEntry(write_buf_fat_sector[i], makeMapEntry(sector, i));
+        write_buf_count = 0;
+        return true;
+    }
+    for (int i=0; i<write_buf_count; i++)
+        ok &= writeSlot(write_buf_fat_sector[i], write_buf + (i * 512));
+    write_buf_count = 0;
+    return ok;
+}
+
+bool flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer)
+{
+    // false if this or an earlier buffered write couldn't be placed (flash full)
+    bool ok = true;
+    dropCachedSector(fat_sector);
+    int i = findWriteBuf(fat_sector);
+    if (i < 0)
+    {   // FatFs and USB hosts write runs of consecutive sectors, keep them together
+        if (write_buf_count == 8)
+            ok = flush_write_buf();
+        i = write_buf_count++;
+        write_buf_fat_sector[i] = fat_sector;
+    }
+    memcpy(write_buf + (i * 512), buffer, 512);
+    if (write_buf_count == 8)
+        ok &= flush_write_buf();
+    return ok;
+}
+
+void flash_fs_trim_FAT_sector(uint16_t fat_sector)
+{
+    // the host or FatFs has finished with the sector, so its slot can be reused.
+    // reads return zeros until it is written again
+    dropCachedSector(fat_sector);
+    int i = findWriteBuf(fat_sector);
+    if (i >= 0)
+    {   // drop it from write_buf
+        write_buf_count--;
+        if (i != write_buf_count) {
+            write_buf_fat_sector[i] = write_buf_fat_sector[write_buf_count];
+            memcpy(write_buf + (i * 512), write_buf + (write_buf_count * 512), 512);
+        }
+    }
+    uint16_t oldEntry = fs_map.sectors[fat_sector];
+    if (oldEntry)
+    {   // free once the map change is committed, as with setMapEntry()
+        if (!pending_free[getMapSector(oldEntry)])
+            pending_free_count++;
+        pending_free[getMapSector(oldEntry)] |= (1 << getMapOffset(oldEntry));
+        fs_map.sectors[fat_sector] = 0;
+        mapChanged(fat_sector);
+    }
+}
+
+void relocateSectors(const uint16_t *sectors, int n)
+{
+    // rewrite the live slots of some flash sectors somewhere else, leaving them free
+    uint8_t buf[512];
+    for (int j=0; j<n; j++)
+        verifyPending(sectors[j], 0xFF);
+    for (int i=0; i<NUM_FAT_SECTORS; i++) {
+        uint16_t mapEntry = fs_map.sectors[i];
+        if (!mapEntry || findWriteBuf(i) >= 0)
+            continue;
+        for (int j=0; j<n; j++) {
+            if (getMapSector(mapEntry) == sectors[j]) {
+                flash_read_sector(sectors[j], getMapOffset(mapEntry), buf, 512);
+                if (!slotBad(mapEntry))
+                    flash_fs_write_FAT_sector(i, buf);
+                else if (writeSlot(i, buf))
+                    setSlotBad(fs_map.sectors[i]);  // the copy would pass its check, the mark goes with it
+                break;
+            }
+        }
+    }
+    flush_write_buf();
+}
+
+bool compactStep()
+{
+    // when free sectors are running short, gather the live slots of the sparsest sectors
+    // (up to a sector's worth) into a fresh one
+    uint16_t victims[8];
+    int n = 0, live = 0;
+
+    if (free_sector_count >= COMPACT_FREE_SECTORS)
+        return false;
+    for (int want=1; want<8 && live+want<=8; want++) {
+        for (int i=MAP_AREA_SECTORS; i<NUM_FLASH_SECTORS && live+want<=8; i++) {
+            if (i != write_sector && __builtin_popcount(used_bitmap[i] & ~pending_free[i]) == want) {
+                victims[n++] = i;
+                live += want;
+            }
+        }
+    }
+    if (n < 2)
+        return false;
+    relocateSectors(victims, n);
+    flash_fs_sync();
+    return true;
+}
+
+bool sectorErased(uint16_t sector)
+{
+    for (int i=0; i<PAGES_PER_SECTOR; i++)
+        if (!pageErased(sector, i))
+            return false;
+    return true;
+}
+
+bool preEraseStep()
+{
+    // keep a few free sectors erased, so writes don't have to wait for the erase
+    static uint16_t search_start_pos = 0;
+    int best = -1, sector = search_start_pos;
+
+    if (erased_sector_count >= PRE_ERASE_SECTORS || free_sector_count <= erased_sector_count + RESERVE_SECTORS + 1)
+        return false;
+    for (int i=0; i<WEAR_CANDIDATES+PRE_ERASE_SECTORS; i++) {
+        sector = findInSet(&free_sectors, sector);
+        if (sector < 0) break;
+        if (sector != write_sector && !inSet(&erased_sectors, sector) &&
+            (best < 0 || fs_map.erase_count[sector] < fs_map.erase_count[best]))
+            best = sector;
+        sector = (sector + 1) % NUM_FLASH_SECTORS;
+    }
+    if (best < 0)
+        return false;
+    search_start_pos = (best + 1) % NUM_FLASH_SECTORS;
+    if (!sectorErased(best))
+        flash_erase_sector(best);
+    setErased(best, true);
+    return true;
+}
+
+bool wearLevelStep()
+{
+    // static wear levelling, moves the data off the least worn sectors once they fall too far
+    // behind, a few at a time so the map is written once for all of them
+    uint16_t coldest[WEAR_LEVEL_MOVES];
+    int n = 0;
+    uint16_t most_worn = 0;
+    for (int i=MAP_AREA_SECTORS; i<NUM_FLASH_SECTORS; i++)
+        if (fs_map.erase_count[i] > most_worn)
+            most_worn = fs_map.erase_count[i];
+    for (int i=MAP_AREA_SECTORS; i<NUM_FLASH_SECTORS; i++) {
+        uint16_t count = fs_map.erase_count[i];
+        if (!used_bitmap[i] || i == write_sector || most_worn - count < WEAR_LEVEL_SPREAD)
+            continue;
+        // keep the coldest few, in order
+        int j = (n < WEAR_LEVEL_MOVES) ? n++ : WEAR_LEVEL_MOVES;
+        for (; j > 0 && fs_map.erase_count[coldest[j-1]] > count; j--)
+            if (j < WEAR_LEVEL_MOVES)
+                coldest[j] = coldest[j-1];
+        if (j < WEAR_LEVEL_MOVES)
+            coldest[j] = i;
+    }
+    if (!n)
+        return false;
+    relocateSectors(coldest, n);
+    flash_fs_sync();
+    return true;
+}
+
+bool scrubStep()
+{
+    // check the oldest write still waiting
+    if (!verify_count)
+        return false;
+    verifyWrite(0);
+    return true;
+}
+
+bool flash_fs_background()
+{
+    // one step of housekeeping while the volume is idle, returns true if there was anything to do
+    return scrubStep() || compactStep() || preEraseStep() || wearLevelStep();
+}
+
 /* Low level flash functions */
 
 void flash_read_sector(uint16_t sector, uint8_t offset, void *buffer, uint16_t size)
@@ -217,14 +1309,37 @@ void flash_read_sector(uint16_t sector, uint8_t offset, void *buffer, uint16_t s
     memcpy(buffer, (unsigned char *)addr, size);
 }
 
+uint32_t flashLock()
+{
+    // In USB mode only core 1 writes the flash (see msc_disk.c), and core 0 has to be parked
+    // in RAM while the flash is out of XIP mode. In cart mode core 0 writes, and core 1 is
+    // serving the bus from RAM
+    if (get_core_num() == 1)
+        multicore_lockout_start_blocking();
+    readDmaWait();
+    return save_and_disable_interrupts();
+}
+
+void flashUnlock(uint32_t ints)
+{
+    restore_interrupts(ints);
+    if (get_core_num() == 1)
+        multicore_lockout_end_blocking();
+}
+
 void flash_erase_sector(uint16_t sector)
 {
 //  printf("[FS] ERASE: %d\n", sector);
     uint32_t fs_start = HW_FLASH_STORAGE_BASE;
     uint32_t offset = fs_start + (sector * FLASH_SECTOR_SIZE);
-    uint32_t ints = save_and_disable_interrupts();   
+    uint32_t ints = flashLock();
     flash_range_erase(offset, FLASH_SECTOR_SIZE);  
-    restore_interrupts(ints);
+    flashUnlock(ints);
+    dropPending(sector);
+    if (fs_map.erase_count[sector] < 0xFFFF) {
+        fs_map.erase_count[sector]++;
+        mapChanged((fs_map.erase_count - map_words) + sector);
+    }
 }
 
 void flash_write_sector(uint16_t sector, uint8_t offset, const void *buffer, uint16_t size)
@@ -232,19 +1347,15 @@ void flash_write_sector(uint16_t sector, uint8_t offset, const void *buffer, uin
 //  printf("[FS] WRITE: %d, %d (%d)\n", sector, offset, size);
     uint32_t fs_start = HW_FLASH_STORAGE_BASE;
     uint32_t addr = fs_start + (sector * FLASH_SECTOR_SIZE) + (offset * 512);
-    uint32_t ints = save_and_disable_interrupts();
+    uint32_t ints = flashLock();
     flash_range_program(addr, (const uint8_t *)buffer, size);
-    restore_interrupts(ints);
+    flashUnlock(ints);
 }
 
-void flash_erase_with_copy_sector(uint16_t sector, uint8_t preserve_bitmap)
+void flash_program_page(uint16_t sector, uint8_t page, const void *buffer)
 {
-//  printf("[FS] ERASE with COPY: %d\n", sector);
-    uint8_t buf[FLASH_SECTOR_SIZE];
-    flash_read_sector(sector, 0, buf, FLASH_SECTOR_SIZE);
-    flash_erase_sector(sector);
-    for (int i=0; i<8; i++) {
-        if (preserve_bitmap & (1 << i))
-           flash_write_sector(sector, i, buf + (i * 512), 512);
-    }
-}
\ No newline at end of file
+    uint32_t addr = HW_FLASH_STORAGE_BASE + (sector * FLASH_SECTOR_SIZE) + (page * FLASH_PAGE_SIZE);
+    uint32_t ints = flashLock();
+    flash_range_program(addr, (const uint8_t *)buffer, FLASH_PAGE_SIZE);
+    flashUnlock(ints);
+}
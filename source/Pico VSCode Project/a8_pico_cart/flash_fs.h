@@ -16,12 +16,34 @@
 #define __FLASH_FS_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#define HW_FLASH_STORAGE_BASE  (1024 * 1024)
+
+// flash offset of a fs_map entry (flash sector << 3 | 512 byte slot), 0 = not written
+#define FLASH_FS_ENTRY_OFFSET(e)  (HW_FLASH_STORAGE_BASE + ((uint32_t)(e) << 9))
+
+// read cache counters, for tuning
+typedef struct {
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+    uint32_t read_ahead_hits;
+    uint32_t read_ahead_misses;
+} flash_fs_stats;
+
+extern flash_fs_stats read_stats;
 
 int flash_fs_mount();
 void flash_fs_create();
-void flash_fs_sync();
-void flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer);
-void flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer);
-bool flash_fs_verify_FAT_sector(uint16_t fat_sector, const void *buffer);
+bool flash_fs_sync();
+bool flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer);
+bool flash_fs_read_FAT_sectors(uint16_t fat_sector, int count, uint8_t *buffer);
+void flash_fs_set_read_buffers(void *mem, uint32_t size);
+bool flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer);
+void flash_fs_trim_FAT_sector(uint16_t fat_sector);
+uint16_t flash_fs_map_entry(uint16_t fat_sector);
+bool flash_fs_entry_ok(uint16_t mapEntry);
+bool flash_fs_background();
+uint32_t crc32(uint32_t crc, const void *data, int len);
 
 #endif
\ No newline at end of file
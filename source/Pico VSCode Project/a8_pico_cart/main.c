@@ -26,6 +26,8 @@
 #include "fatfs_disk.h"
 
 void cdc_task(void);
+void msc_disk_init(void);
+void msc_disk_mount(void);
 
 int main(void)
 {
@@ -45,6 +47,9 @@ int main(void)
   stdio_init_all();   // for serial output, via printf()
   printf("Start up\n");  
 
+  // the disk is written from core 1
+  msc_disk_init();
+
   // init device stack on configured roothub port
   tud_init(BOARD_TUD_RHPORT);
 
@@ -66,8 +71,7 @@ int main(void)
 void tud_mount_cb(void)
 {
   printf("Device mounted\n"); 
-  if (!mount_fatfs_disk())
-    create_fatfs_disk();
+  msc_disk_mount();
 }
 
 // Invoked when device is unmounted
@@ -13,11 +13,41 @@
  */
 
 #include "tusb.h"
+#include "pico/multicore.h"
+#include "pico/mutex.h"
 #include "fatfs_disk.h"
+#include "flash_fs.h"
+#include "atari_cart.h"
 
 // whether host does safe-eject
-static bool ejected = false;
-
+static volatile bool ejected = false;
+static bool index_updated = false;
+
+// Write-behind. WRITE10 just copies the blocks into a ring and returns, and core 1 writes
+// them to flash, so the USB stack doesn't wait for erases. cart_ram isn't used in USB mode,
+// so the first half holds the ring, the end is core 1's stack and the rest goes to flash_fs's
+// read cache. Anything else that touches the disk holds disk_mutex, which core 1 holds while
+// it writes.
+//
+// Core 1 does all the flash writing in USB mode: it runs from flash itself, and flash_fs only
+// parks the other core when it is core 1 that writes. So mounting and syncing are requests
+// core 0 leaves for it, taken once the blocks queued ahead of them are in flash, and the USB
+// callbacks never wait for it: READ10 and WRITE10 return 0 (TinyUSB calls again) while the
+// disk is busy or not mounted yet.
+#define WB_BLOCKS   (sizeof(cart_ram) / 2 / SECTOR_SIZE)
+#define wb_block(n) (&cart_ram[((n) % WB_BLOCKS) * SECTOR_SIZE])
+
+// FatFs (formatting, the search index) and flash_fs need more than the default 2k stack
+#define CORE1_STACK_SIZE    8192
+#define core1_stack         ((uint32_t *) &cart_ram[sizeof(cart_ram) - CORE1_STACK_SIZE])
+
+static uint32_t wb_lba[WB_BLOCKS];
+static volatile uint32_t wb_head = 0;   // next block to fill, only changed by core 0
+static volatile uint32_t wb_tail = 0;   // next block to write, only changed by core 1
+static volatile bool wb_error = false;  // a block (or a sync) failed on its way to flash
+static volatile bool mount_due = false; // the host has (re)connected, core 1 mounts the disk
+static volatile bool disk_ready = false;  // mounted by core 1, the host can have it
+auto_init_mutex(disk_mutex);
 
 // Invoked when received SCSI_CMD_INQUIRY
 // Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
@@ -46,6 +76,11 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
     tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
     return false;
   }
+  if (!disk_ready) {
+    // Additional Sense 04-01 is BECOMING READY, core 1 is still mounting it
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+    return false;
+  }
 
   return true;
 }
@@ -89,12 +124,23 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buff
 {
   (void) lun;
 
-  if(offset != 0) return -1;	
-  if(bufsize != SECTOR_SIZE) return -1;	
+  // bufsize is up to CFG_TUD_MSC_EP_BUFSIZE, i.e. several blocks starting at lba
+  uint32_t count = bufsize / SECTOR_SIZE;
+  if(offset != 0 || count == 0) return -1;
 
-  uint32_t status = fatfs_disk_read(buffer, lba, 1);
+  // busy, TinyUSB calls again
+  if (!disk_ready || !mutex_try_enter(&disk_mutex, NULL)) return 0;
+  uint32_t status = fatfs_disk_read(buffer, lba, count);
+  // blocks still in the ring are newer than what is in flash
+  for (uint32_t n = wb_tail; n != wb_head; n++)
+  {
+    uint32_t i = wb_lba[n % WB_BLOCKS] - lba;
+    if (i < count)
+      memcpy((uint8_t*) buffer + i * SECTOR_SIZE, wb_block(n), SECTOR_SIZE);
+  }
+  mutex_exit(&disk_mutex);
   if(status != 0) return -1;
-  return (int32_t) bufsize;
+  return (int32_t) (count * SECTOR_SIZE);
 }
 
 bool tud_msc_is_writable_cb (uint8_t lun)
@@ -105,30 +151,152 @@ bool tud_msc_is_writable_cb (uint8_t lun)
 
 // Callback invoked when received WRITE10 command.
 // Process data in buffer to disk's storage and return number of written bytes
+// The blocks are written, and later synced, by disk_core1().
 alarm_id_t alarm_id = -1;
+volatile bool sync_due = false;
+volatile uint32_t last_write_time;   // time_us_32(), read by core 1 without the mutex
+
 int64_t sync_callback(alarm_id_t id, void *user_data)
 {
-   	fatfs_disk_sync();
+  sync_due = true;
+  return 0;
 }
 
-int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+static void disk_changed(void)
 {
-  (void) lun;
-
-  if(offset != 0) return -1;	
-  if(bufsize != SECTOR_SIZE) return -1;	
-
-  uint32_t status = fatfs_disk_write(buffer, lba, 1);
+  last_write_time = time_us_32();
 
   // we need to sync the flash but only do it when activity dies down :-)
   if(alarm_id >= 0)
       cancel_alarm(alarm_id);
   alarm_id = add_alarm_in_ms(250, sync_callback, NULL, false);
+}
 
-  if(status != 0) return -1;
-  return (int32_t) bufsize;
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+{
+  (void) lun;
+
+  // whole blocks only, TinyUSB keeps any remainder for the next call
+  uint32_t count = bufsize / SECTOR_SIZE;
+  if(offset != 0 || count == 0) return -1;
+
+  if(lba >= SECTOR_NUM || count > SECTOR_NUM - lba) return -1;
+  if(!disk_ready) return 0;
+  if(wb_error)
+  {
+    // report an earlier failure on the next write, that's the best we can do
+    wb_error = false;
+    tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // write error
+    return -1;
+  }
+
+  // take what fits in the ring. TinyUSB calls again with the rest, and returning 0 while
+  // it is full tells it to retry later rather than holding up the USB task here
+  uint32_t i;
+  for (i = 0; i < count && wb_head - wb_tail != WB_BLOCKS; i++)
+  {
+    memcpy(wb_block(wb_head), buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+    wb_lba[wb_head % WB_BLOCKS] = lba + i;
+    __dmb();
+    wb_head++;
+  }
+  if (i > 0)
+    disk_changed();
+  return (int32_t) (i * SECTOR_SIZE);
 }
 
+// Core 1 in USB mode: writes the ring to flash, syncs once the host goes quiet and does the
+// flash housekeeping while idle. flash_fs parks core 0 around each erase and program.
+static void disk_core1(void)
+{
+  absolute_time_t next_background = get_absolute_time();
+
+  while (true)
+  {
+    uint32_t tail = wb_tail;
+    uint32_t head = wb_head;
+    __dmb();
+    if (tail != head)
+    {
+      // a run of consecutive blocks, up to a flash sector and not past the end of the ring
+      uint32_t lba = wb_lba[tail % WB_BLOCKS];
+      uint32_t n = 1;
+      while (n < 8 && tail + n != head && (tail + n) % WB_BLOCKS != 0 &&
+             wb_lba[(tail + n) % WB_BLOCKS] == lba + n)
+        n++;
+      mutex_enter_blocking(&disk_mutex);
+      if (fatfs_disk_write(wb_block(tail), lba, n) != 0)
+        wb_error = true;
+      wb_tail = tail + n;
+      mutex_exit(&disk_mutex);
+      continue;
+    }
+    if (sync_due)
+    {
+      sync_due = false;
+      mutex_enter_blocking(&disk_mutex);
+      if (!fatfs_disk_sync())
+        wb_error = true;
+      mutex_exit(&disk_mutex);
+      continue;
+    }
+    if (mount_due)
+    {
+      mount_due = false;
+      mutex_enter_blocking(&disk_mutex);
+      if (!mount_fatfs_disk())
+        create_fatfs_disk();
+      // before the host has read anything, see dir_index.c
+      mark_search_index_stale();
+      mutex_exit(&disk_mutex);
+      disk_ready = true;
+      continue;
+    }
+    if (ejected && !index_updated)
+    {
+      // the host has let go of the volume, so FatFs can safely write to it. Bring the search
+      // index up to date now rather than at the first search in cart mode. It uses all of
+      // cart_ram, and the ring is empty and stays that way.
+      index_updated = true;
+      mutex_enter_blocking(&disk_mutex);
+      fatfs_disk_sync();
+      flash_fs_set_read_buffers(NULL, 0);
+      update_search_index((sizeof(cart_ram) - CORE1_STACK_SIZE) / 2);
+      fatfs_disk_sync();
+      mutex_exit(&disk_mutex);
+      continue;
+    }
+    // flash housekeeping once the host has stopped writing for a while
+    if (time_us_32() - last_write_time < 2000000 ||
+        absolute_time_diff_us(get_absolute_time(), next_background) > 0)
+      continue;
+    mutex_enter_blocking(&disk_mutex);
+    bool more = fatfs_disk_background();
+    mutex_exit(&disk_mutex);
+    if (!more)
+      next_background = make_timeout_time_ms(1000);
+  }
+}
+
+// Called once before tud_init()
+void msc_disk_init(void)
+{
+  flash_fs_set_read_buffers(&cart_ram[WB_BLOCKS * SECTOR_SIZE], sizeof(cart_ram) - WB_BLOCKS * SECTOR_SIZE - CORE1_STACK_SIZE);
+  multicore_lockout_victim_init();
+  multicore_launch_core1_with_stack(disk_core1, core1_stack, CORE1_STACK_SIZE);
+}
+
+// Called from tud_mount_cb()
+void msc_disk_mount(void)
+{
+  // core 1 mounts it once the ring is written, the host is told it's becoming ready till then
+  disk_ready = false;
+  __dmb();
+  mount_due = true;
+}
+
+#define SCSI_CMD_SYNC_CACHE_10      0x35
+
 // Callback invoked when received an SCSI command not in built-in list below
 // - READ_CAPACITY10, READ_FORMAT_CAPACITY, INQUIRY, MODE_SENSE6, REQUEST_SENSE
 // - READ10 and WRITE10 has their own callbacks
@@ -144,6 +312,19 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 
   switch (scsi_cmd[0])
   {
+    case SCSI_CMD_SYNC_CACHE_10:
+      // core 1 syncs once the blocks ahead of it are in flash. TinyUSB has no way to finish
+      // this command later, so like WRITE10 it reports a failure that has already happened
+      // and leaves one still to come to the next WRITE10 or SYNC CACHE
+      sync_due = true;
+      if (wb_error)
+      {
+        wb_error = false;
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // write error
+        resplen = -1;
+      }
+    break;
+
     default:
       // Set Sense = Invalid Command Operation
       tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
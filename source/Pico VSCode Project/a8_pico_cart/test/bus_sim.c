@@ -0,0 +1,568 @@
+/**
+ *    _   ___ ___ _       ___          _
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *
+ *
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host test: banked cartridge bus engine
+ */
+
+/*
+ Runs emulate_cartridge() for every entry of CART_EMULATORS against a bus trace and checks
+ what it puts on the bus. atari_cart.c is compiled into this file, so the test sees the
+ descriptors and the same bus_engine() the firmware runs; only the pin accesses (READ_PINS,
+ PUT_DATA, SET_DATA_MODE_xxx and RD4/RD5) go to the mock GPIO below.
+
+ The traces are in traces/carts/<type>.txt, one bus cycle per line:
+   R <addr> @<offset>    read, the cart must drive the byte at <offset> in the image
+   R <addr> =<byte>      read, the cart must drive <byte>
+   R <addr> **           read, the cart must drive something
+   R <addr> --           read, the cart must leave the bus alone
+   W <addr> <byte>       write
+   idle <n>              n cycles with no select (time for core 0 to cache a bank)
+   rd4 <0|1>, rd5 <0|1>  RD4/RD5 level once the previous cycle is over
+   cached                the bank core 1 is on is in SRAM once the previous cycle is over
+ The image is filled with a hash of the offset, so a read from the wrong bank shows up.
+
+ Each cycle is turned into pin levels with PAL timing: PHI2 1.77MHz, address 100ns after
+ PHI2 falls, S4/S5/CCTL 35ns later. Every fifth cycle the select settles 40ns after PHI2
+ rises instead, as a slow MMU can. S4/S5 are asserted for $8000-$BFFF whatever RD4/RD5
+ say, as on the 400/800, so the engine's own RD4/RD5 checks are tested too. Data on write
+ cycles is valid from 100ns after the rise to 20ns after the fall.
+
+ Time only passes in the mock pin functions, PIN_OP_NS per access. That stands in for the
+ code between accesses; it is a budget, not a measurement, so the timing reported here
+ shows the shape of the loop (how many pin accesses deep a response is), not RP2040 cycles.
+
+ The code between the accesses is counted instead. On x86-64 Linux the bus loop runs under
+ the trap flag from the pin read that shows PHI2 high with the select of a read cycle to the
+ PUT_DATA that answers it, and each instruction executed in the time_critical section (where
+ the mock SDK puts the __no_inline_not_in_flash_func bus loops) is counted. The worst count
+ of a type over its trace fails the test above HOT_PATH_BUDGET, or FLASH_HOT_PATH_BUDGET for
+ the types that may read a bank straight from flash. These are host instructions from an -O2
+ build (see CMakeLists.txt), not RP2040 cycles, but they follow the loads and branches the
+ compiler leaves in the loop, so a loop that does more per access shows up.
+
+ Bank switches core 1 reports are handled as bank_cache_main() would, one at a time through
+ an 8 deep FIFO, taking BANK_COPY_NS whenever a bank has to be copied.
+
+ usage: bus_sim <trace dir> [type]
+*/
+
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <ctype.h>
+#include <signal.h>
+#include "../atari_cart.c"
+#include "sdk_mock.h"
+
+#define PIN_OP_NS       24          // 6 cycles at 250MHz
+#define BANK_COPY_NS    300000      // 8-16k from flash by DMA
+#define PHI2_PERIOD     564
+#define PHI2_LOW        282         // phi2 rises this long after it falls
+#define ADDR_NS         100         // after phi2 falls
+#define SELECT_NS       35          // after the address
+#define LATE_SELECT_NS  40          // after phi2 rises, every fifth cycle
+#define WRITE_DATA_NS   100         // after phi2 rises
+#define HOLD_NS         20          // after phi2 falls
+#define DATA_SETUP_NS   20          // before phi2 falls, when the 6502 latches a read
+#define HOT_PATH_BUDGET 24          // instructions from the select being seen to PUT_DATA
+#define FLASH_HOT_PATH_BUDGET 45    // the same with the bank cache lookup (flash carts)
+
+#if defined(__x86_64__) && defined(__linux__)
+#define COUNT_INSNS     1
+#endif
+
+enum { EXPECT_NONE, EXPECT_OFFSET, EXPECT_BYTE, EXPECT_ANY, EXPECT_RELEASED };
+
+typedef struct {
+	uint16_t addr;
+	bool write;
+	uint8_t data;
+	uint8_t expect;
+	uint32_t value;		// offset or byte
+	int8_t rd4, rd5;	// check after the cycle, -1 = don't
+	bool cached;		// check bank_cache[bank_cache_active] after the cycle
+	int line;
+} CYCLE;
+
+static CYCLE *cycles;
+static int num_cycles;
+
+static uint64_t now;	// ns
+static uint64_t end_time;
+static jmp_buf trace_done;
+
+static uint32_t image_size;
+
+// pin output history
+typedef struct { uint64_t t; bool out; uint8_t data; } DRIVE;
+static DRIVE *drives;
+static int num_drives, max_drives;
+static bool data_out;
+static uint8_t data_val;
+typedef struct { uint64_t t; uint8_t pin; bool level; } RDLEVEL;
+static RDLEVEL *rds;
+static int num_rds, max_rds;
+
+// core 0
+static uint32_t fifo[8];
+static int fifo_len;
+static uint32_t copy_bank = SIO_FIFO_EMPTY;
+static uint64_t copy_done;
+static int next_cached_check, cached_errors;
+static const char *trace_name;
+
+static uint8_t image_byte(uint32_t offset) {
+	uint32_t h = offset * 0x9E3779B1;
+	h ^= h >> 15;
+	h *= 0x85EBCA77;
+	h ^= h >> 13;
+	return h >> 24;
+}
+
+static int load_trace(const char *filename) {
+	char line[256];
+	FILE *f = fopen(filename, "r");
+	int size = 0, n = 0;
+	num_cycles = 0;
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		char op[16], a[16], b[16];
+		int args;
+		n++;
+		char *c = strchr(line, '#');
+		if (c) *c = 0;
+		if ((args = sscanf(line, "%15s %15s %15s", op, a, b)) <= 0)
+			continue;
+		if (!strcmp(op, "rd4") || !strcmp(op, "rd5")) {
+			if (!num_cycles) {
+				fprintf(stderr, "%s:%d: rd check before any cycle\n", filename, n);
+				exit(2);
+			}
+			if (op[2] == '4') cycles[num_cycles-1].rd4 = atoi(a);
+			else cycles[num_cycles-1].rd5 = atoi(a);
+			continue;
+		}
+		if (!strcmp(op, "cached")) {
+			if (!num_cycles) {
+				fprintf(stderr, "%s:%d: cached check before any cycle\n", filename, n);
+				exit(2);
+			}
+			cycles[num_cycles-1].cached = true;
+			continue;
+		}
+		int repeat = !strcmp(op, "idle") ? atoi(a) : 1;
+		for (int i=0; i<repeat; i++) {
+			if (num_cycles == size)
+				cycles = realloc(cycles, (size = size ? size * 2 : 256) * sizeof(CYCLE));
+			CYCLE *cy = &cycles[num_cycles++];
+			memset(cy, 0, sizeof(*cy));
+			cy->rd4 = cy->rd5 = -1;
+			cy->line = n;
+			cy->addr = 0x0600;
+			if (!strcmp(op, "idle"))
+				continue;
+			if (args != 3 || (strcmp(op, "R") && strcmp(op, "W"))) {
+				fprintf(stderr, "%s:%d: bad line\n", filename, n);
+				exit(2);
+			}
+			cy->addr = strtoul(a, NULL, 16);
+			cy->write = op[0] == 'W';
+			if (cy->write) {
+				cy->data = strtoul(b, NULL, 16);
+				cy->expect = EXPECT_RELEASED;
+			}
+			else if (b[0] == '@') {
+				cy->expect = EXPECT_OFFSET;
+				cy->value = strtoul(b + 1, NULL, 16);
+			}
+			else if (b[0] == '=') {
+				cy->expect = EXPECT_BYTE;
+				cy->value = strtoul(b + 1, NULL, 16);
+			}
+			else if (!strcmp(b, "**"))
+				cy->expect = EXPECT_ANY;
+			else
+				cy->expect = EXPECT_RELEASED;
+		}
+	}
+	fclose(f);
+	// a couple of quiet cycles at the end so the last one can be checked
+	for (int i=0; i<2; i++) {
+		if (num_cycles == size)
+			cycles = realloc(cycles, (size += 2) * sizeof(CYCLE));
+		CYCLE *cy = &cycles[num_cycles++];
+		memset(cy, 0, sizeof(*cy));
+		cy->addr = 0x0600;
+		cy->rd4 = cy->rd5 = -1;
+	}
+	return 1;
+}
+
+static uint64_t cycle_start(int i) { return (uint64_t)i * PHI2_PERIOD; }	// phi2 falls
+static uint64_t cycle_rise(int i) { return cycle_start(i) + PHI2_LOW; }
+static uint64_t cycle_fall(int i) { return cycle_start(i + 1); }
+
+static uint64_t select_time(int i) {
+	return (i % 5 == 3) ? cycle_rise(i) + LATE_SELECT_NS : cycle_start(i) + ADDR_NS + SELECT_NS;
+}
+
+static uint32_t selects(uint16_t addr) {
+	if (addr >= 0x8000 && addr < 0xA000) return S4_GPIO_MASK;
+	if (addr >= 0xA000 && addr < 0xC000) return S5_GPIO_MASK;
+	if ((addr & 0xFF00) == 0xD500) return CCTL_GPIO_MASK;
+	return 0;
+}
+
+static uint32_t bus_pins(uint64_t t) {
+	int i = t / PHI2_PERIOD;
+	uint64_t phase = t - cycle_start(i);
+	uint32_t pins = S4_GPIO_MASK | S5_GPIO_MASK | CCTL_GPIO_MASK | RW_GPIO_MASK;
+	const CYCLE *cy = &cycles[i], *prev = i ? &cycles[i-1] : NULL;
+
+	if (phase < ADDR_NS && prev) {
+		// previous cycle's address until the new one, its selects and data until the hold time
+		pins = (pins & ~ADDR_GPIO_MASK) | (prev->addr & ADDR_GPIO_MASK);
+		if (!prev->write) pins |= RW_GPIO_MASK; else pins &= ~RW_GPIO_MASK;
+		if (phase < HOLD_NS) {
+			pins &= ~selects(prev->addr);
+			if (prev->write)
+				pins |= (uint32_t)prev->data << DATA_PIN_BASE;
+		}
+		return pins;
+	}
+	pins = (pins & ~ADDR_GPIO_MASK) | (cy->addr & ADDR_GPIO_MASK);
+	if (cy->write)
+		pins &= ~RW_GPIO_MASK;
+	if (t >= select_time(i))
+		pins &= ~selects(cy->addr);
+	if (phase >= PHI2_LOW) {
+		pins |= PHI2_GPIO_MASK;
+		if (cy->write && t >= cycle_rise(i) + WRITE_DATA_NS)
+			pins |= (uint32_t)cy->data << DATA_PIN_BASE;
+	}
+	return pins;
+}
+
+/* Instruction count of the hot path */
+
+static bool counting;
+static volatile int insns;
+static int worst_insns;
+
+#ifdef COUNT_INSNS
+extern const char __start_time_critical[], __stop_time_critical[];
+
+static void on_step(int sig, siginfo_t *info, void *context) {
+	uintptr_t rip = ((ucontext_t *)context)->uc_mcontext.gregs[REG_RIP];
+	if (rip >= (uintptr_t)__start_time_critical && rip < (uintptr_t)__stop_time_critical)
+		insns++;
+}
+
+// the trap flag, below the red zone of whatever function this is inlined into
+static __force_inline void step(bool on) {
+	if (on)
+		asm volatile("sub $128, %%rsp\n\tpushfq\n\torq $0x100, (%%rsp)\n\tpopfq\n\tadd $128, %%rsp" ::: "memory", "cc");
+	else
+		asm volatile("sub $128, %%rsp\n\tpushfq\n\tandq $~0x100, (%%rsp)\n\tpopfq\n\tadd $128, %%rsp" ::: "memory", "cc");
+}
+
+static void count_init(void) {
+	struct sigaction sa = { .sa_sigaction = on_step, .sa_flags = SA_SIGINFO };
+	sigaction(SIGTRAP, &sa, NULL);
+}
+#else
+static __force_inline void step(bool on) {}
+static void count_init(void) {}
+#endif
+
+/* Mock GPIO, as seen by the bus engine on core 1. Not inlined into it, so they aren't counted */
+
+static void core0(void) {
+	// what bank_cache_main() does with each switch core 1 reports
+	uint32_t msg = sim_fifo_take();
+	if (msg != SIO_FIFO_EMPTY && fifo_len < count_of(fifo))
+		fifo[fifo_len++] = msg;
+	if (copy_bank != SIO_FIFO_EMPTY) {
+		if (now < copy_done)
+			return;
+		cache_bank(copy_bank);
+		copy_bank = SIO_FIFO_EMPTY;
+	}
+	while (fifo_len) {
+		bank_cache_touch(fifo[0]);
+		memmove(&fifo[0], &fifo[1], --fifo_len * sizeof(fifo[0]));
+		if (!bank_cache[bank_cache_active]) {
+			copy_bank = bank_cache_active;
+			copy_done = now + BANK_COPY_NS;
+			return;
+		}
+	}
+}
+
+static void check_cached(void) {
+	// 'cached' checks of the cycles that are over
+	int i = now / PHI2_PERIOD;
+	for (; next_cached_check < i && next_cached_check < num_cycles; next_cached_check++) {
+		const CYCLE *cy = &cycles[next_cached_check];
+		if (cy->cached && !bank_cache[bank_cache_active]) {
+			printf("%s:%d: bank %u is not in SRAM\n", trace_name, cy->line, (unsigned)bank_cache_active);
+			cached_errors++;
+		}
+	}
+}
+
+static void record_drive(void) {
+	if (num_drives == max_drives)
+		drives = realloc(drives, (max_drives = max_drives ? max_drives * 2 : 4096) * sizeof(DRIVE));
+	drives[num_drives++] = (DRIVE){ now, data_out, data_val };
+}
+
+uint32_t __attribute__((noinline)) gpio_get_all(void) {
+	step(false);
+	now += PIN_OP_NS;
+	if (now >= end_time)
+		longjmp(trace_done, 1);
+	core0();
+	check_cached();
+	uint32_t pins = bus_pins(now);
+	if (data_out)
+		pins = (pins & ~DATA_GPIO_MASK) | ((uint32_t)data_val << DATA_PIN_BASE);
+	// count from the last sample before the answer, the one that sees the select
+	const CYCLE *cy = &cycles[now / PHI2_PERIOD];
+	counting = (pins & PHI2_GPIO_MASK) && !cy->write && !(pins & selects(cy->addr)) &&
+		cy->expect != EXPECT_NONE && cy->expect != EXPECT_RELEASED;
+	insns = 0;
+	step(counting);
+	return pins;
+}
+
+void __attribute__((noinline)) gpio_put(uint gpio, bool value) {
+	now += PIN_OP_NS;
+	if (gpio == RD4_PIN || gpio == RD5_PIN) {
+		if (num_rds == max_rds)
+			rds = realloc(rds, (max_rds = max_rds ? max_rds * 2 : 256) * sizeof(RDLEVEL));
+		rds[num_rds++] = (RDLEVEL){ now, gpio, value };
+	}
+}
+
+void __attribute__((noinline)) gpio_put_masked(uint32_t mask, uint32_t value) {
+	step(false);
+	if (counting && mask == DATA_GPIO_MASK) {
+		if (insns > worst_insns)
+			worst_insns = insns;
+		counting = false;
+	}
+	now += PIN_OP_NS;
+	if (mask == DATA_GPIO_MASK) {
+		data_val = value >> DATA_PIN_BASE;
+		record_drive();
+	}
+	step(counting);
+}
+
+void __attribute__((noinline)) gpio_set_dir_out_masked(uint32_t mask) {
+	now += PIN_OP_NS;
+	if (mask & DATA_GPIO_MASK) {
+		data_out = true;
+		record_drive();
+	}
+}
+
+void __attribute__((noinline)) gpio_set_dir_in_masked(uint32_t mask) {
+	now += PIN_OP_NS;
+	if (mask & DATA_GPIO_MASK) {
+		data_out = false;
+		record_drive();
+	}
+}
+
+/* Checks */
+
+static int drive_at(uint64_t t) {
+	// last change to the data pins at or before t, -1 if none
+	int lo = 0, hi = num_drives;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (drives[mid].t <= t) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+static bool driven_at(int k) {
+	return k >= 0 && drives[k].out;
+}
+
+static int rd_level(uint pin, uint64_t t) {
+	int level = -1;
+	for (int i=0; i<num_rds && rds[i].t <= t; i++)
+		if (rds[i].pin == pin)
+			level = rds[i].level;
+	return level;
+}
+
+static int check(const char *name, const uint8_t *image, uint64_t *worst) {
+	int errors = 0;
+	for (int i=0; i<num_cycles-2; i++) {
+		const CYCLE *cy = &cycles[i];
+		uint64_t rise = cycle_rise(i), latch = cycle_fall(i) - DATA_SETUP_NS;
+		int at_rise = drive_at(rise), at_latch = drive_at(latch);
+		bool driven = false;
+		for (int k=at_rise; k<=at_latch; k++)
+			driven |= driven_at(k);
+		if (driven_at(drive_at(cycle_rise(i + 1)))) {
+			printf("%s:%d: data bus still driven when phi2 rises again\n", name, cy->line);
+			errors++;
+		}
+
+		switch (cy->expect) {
+		case EXPECT_RELEASED:
+			if (driven) {
+				printf("%s:%d: %s $%04X drove the data bus\n", name, cy->line, cy->write ? "write to" : "read of", cy->addr);
+				errors++;
+			}
+			break;
+		case EXPECT_OFFSET:
+		case EXPECT_BYTE:
+		case EXPECT_ANY: {
+			uint8_t want = cy->expect == EXPECT_OFFSET ? image[cy->value] : cy->value;
+			if (!driven_at(at_latch))
+				printf("%s:%d: read of $%04X not answered\n", name, cy->line, cy->addr);
+			else if (cy->expect != EXPECT_ANY && drives[at_latch].data != want)
+				printf("%s:%d: read of $%04X got %02X, wanted %02X\n", name, cy->line, cy->addr,
+					drives[at_latch].data, want);
+			else {
+				// when the byte that was latched appeared, after phi2 rose (or the select settled)
+				int k = at_latch;
+				while (k > 0 && k > at_rise && driven_at(k-1) && drives[k-1].data == drives[at_latch].data)
+					k--;
+				uint64_t from = select_time(i) > rise ? select_time(i) : rise;
+				if (drives[k].t > from && drives[k].t - from > *worst)
+					*worst = drives[k].t - from;
+				break;
+			}
+			errors++;
+			break;
+		}
+		}
+		uint64_t t = cycle_rise(i + 1);
+		if (cy->rd4 >= 0 && rd_level(RD4_PIN, t) != cy->rd4) {
+			printf("%s:%d: RD4 %d, wanted %d\n", name, cy->line, rd_level(RD4_PIN, t), cy->rd4);
+			errors++;
+		}
+		if (cy->rd5 >= 0 && rd_level(RD5_PIN, t) != cy->rd5) {
+			printf("%s:%d: RD5 %d, wanted %d\n", name, cy->line, rd_level(RD5_PIN, t), cy->rd5);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+static uint32_t image_size_of(int type) {
+	if (type == CART_TYPE_XEX)
+		return sizeof(cart_ram);
+	for (int i=0; i<count_of(car_types); i++)
+		if (car_types[i].cart_type == type)
+			return car_types[i].size;
+	return 0;
+}
+
+static int run(const char *dir, const char *type_name, int type, bool flash) {
+	char name[64], filename[512];
+	static uint8_t image[MAX_FLASH_CART_SIZE];
+
+	// CART_TYPE_XEGS_32K -> xegs_32k.txt
+	snprintf(name, sizeof(name), "%s", type_name + strlen("CART_TYPE_"));
+	for (char *c = name; *c; c++)
+		*c = tolower(*c);
+	snprintf(filename, sizeof(filename), "%s/%s.txt", dir, name);
+	if (!load_trace(filename)) {
+		printf("%s: no trace (%s)\n", name, filename);
+		return 1;
+	}
+
+	// lay the image out as load_file() would
+	image_size = image_size_of(type);
+	for (uint32_t i=0; i<image_size; i++)
+		image[i] = image_byte(i);
+	memset(cart_ram, 0, sizeof(cart_ram));
+	flash_cart = image_size > sizeof(cart_ram);
+	if (flash_cart) {
+		sim_flash_init();
+		cart_image_offset = 0;
+		for (uint32_t i=0; i<image_size/512; i++) {
+			cart_chunks[i] = i + 1;
+			memcpy(sim_flash() + FLASH_FS_ENTRY_OFFSET(i + 1), image + i * 512, 512);
+		}
+		start_flash_cart(type);
+	}
+	else {
+		memcpy(cart_ram, image, image_size);
+		if (type == CART_TYPE_BLIZZARD_4K) {
+			memcpy(&cart_ram[4096], &cart_ram[0], 4096);
+			memcpy(&image[4096], &image[0], 4096);
+		}
+	}
+
+	now = 0;
+	end_time = cycle_start(num_cycles - 1);
+	num_drives = num_rds = 0;
+	data_out = false;
+	fifo_len = 0;
+	copy_bank = SIO_FIFO_EMPTY;
+	next_cached_check = cached_errors = 0;
+	trace_name = name;
+	counting = false;
+	worst_insns = 0;
+	sim_fifo_take();
+	if (!setjmp(trace_done))
+		emulate_cartridge(type);
+
+	uint64_t worst = 0;
+	int reads = 0;
+	for (int i=0; i<num_cycles; i++)
+		if (!cycles[i].write && cycles[i].expect != EXPECT_NONE && cycles[i].expect != EXPECT_RELEASED)
+			reads++;
+	int errors = check(name, image, &worst) + cached_errors;
+#ifdef COUNT_INSNS
+	int budget = flash ? FLASH_HOT_PATH_BUDGET : HOT_PATH_BUDGET;
+	if (worst_insns > budget) {
+		printf("%s: %d instructions from the select to the data, the budget is %d\n", name, worst_insns, budget);
+		errors++;
+	}
+#endif
+	printf("%-20s %5d cycles %4d reads %s, data %3lluns after phi2/select (%d pin accesses, %d instructions)\n", name,
+		num_cycles, reads, errors ? "FAILED" : "ok    ", (unsigned long long)worst,
+		(int)((worst + PIN_OP_NS - 1) / PIN_OP_NS), worst_insns);
+	return errors ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	int failed = 0, ran = 0;
+	if (argc < 2) {
+		fprintf(stderr, "usage: bus_sim <trace dir> [type]\n");
+		return 2;
+	}
+	count_init();
+#define X(type, desc) \
+	if (argc < 3 || !strcasecmp(argv[2], #type + strlen("CART_TYPE_"))) { \
+		failed += run(argv[1], #type, type, desc.flash); \
+		ran++; \
+	}
+	CART_EMULATORS(X)
+#undef X
+	if (!ran) {
+		fprintf(stderr, "no cart type %s\n", argv[2]);
+		return 2;
+	}
+	printf("%d of %d cart types failed\n", failed, ran);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,611 @@
+/**
+ *    _   ___ ___ _       ___          _
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *
+ *
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host test: flash FS benchmarks
+ */
+
+/*
+ Runs flash_fs under FatFs on the simulated flash in mock/, the way files reach it from the
+ menu and over USB, and reports what it costs the flash. Each test prints its numbers and
+ fails if they are out of line.
+
+ Flash time is the simulated time spent erasing and programming (SIM_ERASE_US per 4k erase,
+ SIM_PROGRAM_US per 256 byte page), so MB/s is what the flash allows, not what USB or the
+ RP2040 would manage; the CPU time of flash_fs itself isn't in it.
+
+   copy         write a 1MB file to a fresh volume, and to one that has had two ROM sets
+                written and deleted: MB/s, erases and page programs
+   fill         fill a fresh volume to 99% with 64k files: CPU time and flash time for each
+                tenth. They should stay level until the flash itself runs out of free
+                sectors; the volume overcommits the flash a little, so in the last tenth
+                new data goes through the slower move of a partly used sector
+   wear         keep 12MB of ROMs on a volume and rewrite a 256k file over and over, idling
+                (running the background steps) in between: the spread of erase counts over
+                the data sectors, and how hard the map area is worn next to them
+   trim         write a 12MB ROM set and delete it, over and over: every write has to fit,
+                which it only does if deleted files give their flash back, and the flash
+                time per MB should stay where it started
+   powercut     write, rewrite and delete files with a sync every few steps, and cut the
+                power at a random erase or program: no write may fail before the cut, and
+                after each remount every file synced before it has to read back intact.
+                Also what a small sync costs
+   idle         powercut with the background steps (the scrub, compaction, pre-erase, wear
+                levelling) run to the end after every other sync, so the power also goes in
+                the middle of them. Then the erases a write costs right after a ROM set has been
+                deleted, and after the volume has been idle
+   verify       flip a bit in a slot after it was written, as a program that didn't take:
+                the next sync has to fail, and so do reads of that slot (but not of its
+                neighbours) until it is written again. Once caught by the scrub, once by a
+                read before the scrub got to it
+
+ usage: flash_bench <test> [rounds, for wear, powercut and idle]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ff.h"
+#include "diskio.h"
+#include "fatfs_disk.h"
+#include "sdk_mock.h"
+
+#define COPY_SIZE       (1024 * 1024)
+#define COPY_MAX_ERASES (COPY_SIZE / FLASH_SECTOR_SIZE + 8)     // the data, plus FAT and directory
+#define ROM_SET_SIZE    (12 * 1024 * 1024)
+#define FILL_FILE_SIZE  65536
+#define FILL_PERCENT    99
+#define FILL_MAX_SLOWDOWN 2     // CPU time of a tenth against the first
+#define FILL_MAX_SLOWDOWN_FULL 3    // and of the last
+#define WEAR_STATIC_SIZE (12 * 1024 * 1024)
+#define WEAR_FILE_SIZE  (256 * 1024)
+#define WEAR_ROUNDS     4000    // enough for the static data to fall behind and be moved
+#define WEAR_MAX_SPREAD 320     // flash_fs moves static data at a gap of 256
+#define WEAR_MAP_MAX    125     // % of the most worn data sector the map area may reach
+#define TRIM_SETS       6
+#define TRIM_MAX_SLOWDOWN 110   // % of the first set's flash time per MB
+#define CUT_FILES       12
+#define CUT_STEPS       60      // writes and deletes per round, a sync every third
+#define CUT_ROUNDS      200
+#define CUT_MAX_OPS     4000    // erases and page programs before the cut, at most
+#define SYNC_TESTS      100
+#define IDLE_WRITE_SIZE (48 * 1024)     // less than the 16 sectors kept erased
+#define IDLE_MAX_ERASES 1       // the journal may need a fresh sector
+#define VERIFY_SECTOR   20000   // FAT sectors written straight to the disk, as over USB
+#define MAP_AREA_SECTORS 40     // as flash_fs.c
+#define FS_FIRST_SECTOR (HW_FLASH_STORAGE_BASE / FLASH_SECTOR_SIZE)
+#define FS_SECTORS      3840
+
+
+static FATFS fs;
+static uint8_t data[COPY_SIZE], check[COPY_SIZE];
+
+static void fill(uint8_t *buf, int size, uint32_t seed)
+{
+    // xorshift, so every file has its own contents
+    uint32_t x = seed * 2654435761u + 1;
+    for (int i=0; i<size; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = x;
+    }
+}
+
+static void new_volume()
+{
+    sim_flash_init();
+    create_fatfs_disk();
+    f_mount(&fs, "", 1);
+    fatfs_disk_sync();
+    sim_time_us = 0;
+    sim_flash_erase_count = sim_flash_program_count = 0;
+}
+
+static bool write_file(const char *name, const uint8_t *buf, int size)
+{
+    FIL f;
+    UINT bw;
+    if (f_open(&f, name, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return false;
+    FRESULT res = f_write(&f, buf, size, &bw);
+    return (f_close(&f) == FR_OK) && res == FR_OK && bw == size;
+}
+
+static bool file_is(const char *name, const uint8_t *buf, int size)
+{
+    FIL f;
+    UINT br;
+    if (f_open(&f, name, FA_READ) != FR_OK)
+        return false;
+    FRESULT res = f_read(&f, check, sizeof(check), &br);
+    f_close(&f);
+    return res == FR_OK && br == size && memcmp(check, buf, size) == 0;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t us)
+{
+    return us ? (bytes / 1048576.0) / (us / 1e6) : 0;
+}
+
+static double cpu_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static void reset_counts()
+{
+    sim_time_us = 0;
+    sim_flash_erase_count = sim_flash_program_count = 0;
+}
+
+static bool rom_set(int seed, bool write)
+{
+    // ROMs of 8k to 1MB, ROM_SET_SIZE in all. write them, or check they read back
+    char name[16];
+    bool ok = true;
+    for (int n=0, total=0; total < ROM_SET_SIZE; n++) {
+        int size = 8192 << ((seed + n) % 8);
+        if (size > ROM_SET_SIZE - total)
+            size = ROM_SET_SIZE - total;
+        sprintf(name, "ROM%d.BIN", n);
+        fill(data, size, seed * 1000 + n);
+        ok &= write ? write_file(name, data, size) : file_is(name, data, size);
+        total += size;
+    }
+    return write ? (fatfs_disk_sync() && ok) : ok;
+}
+
+static bool write_rom_set(int seed)
+{
+    return rom_set(seed, true);
+}
+
+static bool delete_all()
+{
+    DIR dir;
+    FILINFO fno;
+    char name[16];
+    bool ok = true;
+    for (;;) {
+        if (f_opendir(&dir, "/") != FR_OK || f_readdir(&dir, &fno) != FR_OK)
+            return false;
+        f_closedir(&dir);
+        if (!fno.fname[0])
+            break;
+        strcpy(name, fno.fname);
+        ok &= f_unlink(name) == FR_OK;
+    }
+    return fatfs_disk_sync() && ok;
+}
+
+static bool copy(const char *volume)
+{
+    reset_counts();
+    fill(data, COPY_SIZE, 1);
+    bool ok = write_file("COPY.BIN", data, COPY_SIZE) && fatfs_disk_sync();
+    printf("copy to %s volume: %dk in %.2fs of flash time, %.2fMB/s, %llu erases, %llu page programs\n",
+        volume, COPY_SIZE / 1024, sim_time_us / 1e6, mb_per_s(COPY_SIZE, sim_time_us),
+        (unsigned long long)sim_flash_erase_count, (unsigned long long)sim_flash_program_count);
+    if (!ok || !file_is("COPY.BIN", data, COPY_SIZE)) {
+        printf("copy: FAILED, the file didn't read back\n");
+        return false;
+    }
+    if (sim_flash_erase_count > COPY_MAX_ERASES) {
+        printf("copy: FAILED, more than %d erases\n", COPY_MAX_ERASES);
+        return false;
+    }
+    return true;
+}
+
+static int test_copy()
+{
+    new_volume();
+    if (!copy("a fresh"))
+        return 1;
+    new_volume();
+    for (int set=1; set<=2; set++) {
+        if (!write_rom_set(set) || !delete_all()) {
+            printf("copy: FAILED, couldn't write and delete a ROM set\n");
+            return 1;
+        }
+    }
+    return copy("a used") ? 0 : 1;
+}
+
+static int test_fill()
+{
+    new_volume();
+    DWORD free_clusters;
+    FATFS *fsp;
+    f_getfree("", &free_clusters, &fsp);
+    int files = (uint64_t)free_clusters * fsp->csize * 512 * FILL_PERCENT / 100 / FILL_FILE_SIZE;
+    double cpu[10], flash[10], start_cpu = cpu_us();
+    uint64_t start_time = sim_time_us;
+    bool ok = true;
+    char name[16];
+    for (int i=0, tenth=0; i<files && ok; i++) {
+        sprintf(name, "F%d.BIN", i);
+        fill(data, FILL_FILE_SIZE, i);
+        ok = write_file(name, data, FILL_FILE_SIZE) && fatfs_disk_sync();
+        if ((i + 1) * 10 / files > tenth) {
+            cpu[tenth] = cpu_us() - start_cpu;
+            flash[tenth] = (sim_time_us - start_time) / 1e6;
+            start_cpu = cpu_us();
+            start_time = sim_time_us;
+            tenth++;
+        }
+    }
+    if (!ok) {
+        printf("fill: FAILED, a write failed short of %d%%\n", FILL_PERCENT);
+        return 1;
+    }
+    double mb = files / 10.0 * FILL_FILE_SIZE / 1048576;
+    for (int t=0; t<10; t++)
+        printf("fill %3d%%: %.1fms CPU, %.1fs flash time per MB\n", (t + 1) * FILL_PERCENT / 10,
+            cpu[t] / 1000 / mb, flash[t] / mb);
+    for (int i=0; i<files; i+=files/16) {
+        sprintf(name, "F%d.BIN", i);
+        fill(data, FILL_FILE_SIZE, i);
+        if (!file_is(name, data, FILL_FILE_SIZE)) {
+            printf("fill: FAILED, %s didn't read back\n", name);
+            return 1;
+        }
+    }
+    for (int t=1; t<10; t++) {
+        int limit = (t < 9) ? FILL_MAX_SLOWDOWN : FILL_MAX_SLOWDOWN_FULL;
+        if (cpu[t] > cpu[0] * limit) {
+            printf("fill: FAILED, tenth %d took more than %dx the CPU time of the first\n", t + 1, limit);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void idle()
+{
+    // as msc_disk_task() does once USB has gone quiet
+    while (fatfs_disk_background())
+        ;
+}
+
+static void erase_counts(int first, int last, uint32_t *min, uint32_t *max, double *mean)
+{
+    uint64_t total = 0;
+    *min = UINT32_MAX;
+    *max = 0;
+    for (int i=first; i<last; i++) {
+        uint32_t n = sim_flash_erases[FS_FIRST_SECTOR + i];
+        *min = (n < *min) ? n : *min;
+        *max = (n > *max) ? n : *max;
+        total += n;
+    }
+    *mean = (double)total / (last - first);
+}
+
+static int test_wear(int rounds)
+{
+    char name[16];
+    new_volume();
+    for (int n=0; n<WEAR_STATIC_SIZE / COPY_SIZE; n++) {
+        sprintf(name, "STATIC%d.ROM", n);
+        fill(data, COPY_SIZE, 100 + n);
+        if (!write_file(name, data, COPY_SIZE)) {
+            printf("wear: FAILED, couldn't write the static data\n");
+            return 1;
+        }
+    }
+    fatfs_disk_sync();
+    idle();
+    fill(data, WEAR_FILE_SIZE, 1);
+    for (int round=0; round<rounds; round++) {
+        data[0] = round;
+        if (!write_file("CHURN.BIN", data, WEAR_FILE_SIZE) || !fatfs_disk_sync()) {
+            printf("wear: FAILED, write %d failed\n", round);
+            return 1;
+        }
+        idle();
+    }
+    uint32_t min, max, map_min, map_max;
+    double mean, map_mean;
+    erase_counts(MAP_AREA_SECTORS, FS_SECTORS, &min, &max, &mean);
+    erase_counts(0, MAP_AREA_SECTORS, &map_min, &map_max, &map_mean);
+    printf("wear: %d rewrites of %dk next to %dMB of static data, %llu erases\n", rounds,
+        WEAR_FILE_SIZE / 1024, WEAR_STATIC_SIZE / COPY_SIZE, (unsigned long long)sim_flash_erase_count);
+    printf("wear: data sectors erased %u-%u times, mean %.1f\n", min, max, mean);
+    printf("wear: map area sectors erased %u-%u times, mean %.1f\n", map_min, map_max, map_mean);
+    for (int n=0; n<WEAR_STATIC_SIZE / COPY_SIZE; n++) {
+        sprintf(name, "STATIC%d.ROM", n);
+        fill(data, COPY_SIZE, 100 + n);
+        if (!file_is(name, data, COPY_SIZE)) {
+            printf("wear: FAILED, %s didn't read back\n", name);
+            return 1;
+        }
+    }
+    if (max - min > WEAR_MAX_SPREAD) {
+        printf("wear: FAILED, data sector erase counts spread more than %d\n", WEAR_MAX_SPREAD);
+        return 1;
+    }
+    if (map_max * 100 > max * WEAR_MAP_MAX) {
+        printf("wear: FAILED, the map area is worn more than %d%% of the data sectors\n", WEAR_MAP_MAX);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_trim()
+{
+    double first = 0;
+    new_volume();
+    for (int set=1; set<=TRIM_SETS; set++) {
+        reset_counts();
+        if (!write_rom_set(set)) {
+            printf("trim: FAILED, ROM set %d doesn't fit\n", set);
+            return 1;
+        }
+        double per_mb = sim_time_us / 1e6 / (ROM_SET_SIZE / 1048576);
+        printf("trim: ROM set %d, %.1fs flash time per MB, %llu erases\n", set, per_mb,
+            (unsigned long long)sim_flash_erase_count);
+        if (!delete_all()) {
+            printf("trim: FAILED, couldn't delete ROM set %d\n", set);
+            return 1;
+        }
+        if (set == 1)
+            first = per_mb;
+        else if (per_mb * 100 > first * TRIM_MAX_SLOWDOWN) {
+            printf("trim: FAILED, ROM set %d was written more than %d%% slower than the first\n",
+                set, TRIM_MAX_SLOWDOWN - 100);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t cut_synced[CUT_FILES];     // seed of each file's contents as of the last sync, 0 if none
+static uint32_t cut_written[CUT_FILES];
+static bool cut_dirty[CUT_FILES];
+
+static int cut_size(uint32_t seed)
+{
+    return 1000 + seed % 200000;
+}
+
+static bool cut_files_intact()
+{
+    char name[16];
+    for (int k=0; k<CUT_FILES; k++) {
+        if (cut_dirty[k] || !cut_synced[k])
+            continue;
+        sprintf(name, "W%d.BIN", k);
+        fill(data, cut_size(cut_synced[k]), cut_synced[k]);
+        if (!file_is(name, data, cut_size(cut_synced[k]))) {
+            printf("%s doesn't read back\n", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool cut_round(uint32_t r, uint32_t *seed, bool idle_too)
+{
+    // false if a write fails before the power does. idle_too runs the background steps after
+    // every other sync
+    char name[16];
+    for (int step=0; step<CUT_STEPS; step++) {
+        int k = (r + step * 7) % CUT_FILES;
+        sprintf(name, "W%d.BIN", k);
+        cut_dirty[k] = true;
+        if (step % 5 == 4) {
+            f_unlink(name);
+            cut_written[k] = 0;
+        }
+        else {
+            cut_written[k] = ++*seed * 7919;
+            fill(data, cut_size(cut_written[k]), cut_written[k]);
+            if (!write_file(name, data, cut_size(cut_written[k])))
+                return false;
+        }
+        if (step % 3 == 2) {
+            if (!fatfs_disk_sync())
+                return false;
+            if (idle_too && step % 6 == 5)
+                idle();
+            for (int j=0; j<CUT_FILES; j++) {
+                if (cut_dirty[j])
+                    cut_synced[j] = cut_written[j];
+                cut_dirty[j] = false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool power_cuts(const char *test, int rounds, bool idle_too)
+{
+    char name[16];
+    uint32_t seed = 1;
+    int cuts = 0;
+    new_volume();
+    if (idle_too && !write_rom_set(1)) {
+        // short of free sectors, so compaction has work to do
+        printf("%s: FAILED, couldn't write a ROM set\n", test);
+        return false;
+    }
+    memset(cut_synced, 0, sizeof(cut_synced));
+    memset(cut_dirty, 0, sizeof(cut_dirty));
+    for (int round=0; round<rounds; round++) {
+        uint32_t r = round * 2654435761u;
+        sim_power_cut_after = 1 + (r >> 8) % CUT_MAX_OPS;
+        if (setjmp(sim_power_cut) == 0) {
+            if (!cut_round(r, &seed, idle_too)) {
+                printf("%s: FAILED, a write failed in round %d\n", test, round);
+                return false;
+            }
+        }
+        else
+            cuts++;
+        sim_power_cut_after = -1;
+        // power back on
+        if (!mount_fatfs_disk() || f_mount(&fs, "", 1) != FR_OK) {
+            printf("%s: FAILED, no volume to mount after round %d\n", test, round);
+            return false;
+        }
+        if (!cut_files_intact()) {
+            printf("%s: FAILED after round %d\n", test, round);
+            return false;
+        }
+        // what was being written when the power went is either old or new, start again with it
+        for (int k=0; k<CUT_FILES; k++) {
+            if (cut_dirty[k]) {
+                sprintf(name, "W%d.BIN", k);
+                f_unlink(name);
+                cut_synced[k] = 0;
+                cut_dirty[k] = false;
+            }
+        }
+        fatfs_disk_sync();
+    }
+    if (idle_too && !rom_set(1, false)) {
+        printf("%s: FAILED, the ROM set doesn't read back\n", test);
+        return false;
+    }
+    printf("%s: %d rounds, %d power cuts, no synced data lost\n", test, rounds, cuts);
+    return true;
+}
+
+static int test_power_cut(int rounds)
+{
+    if (!power_cuts("powercut", rounds, false))
+        return 1;
+
+    // a small write and its sync, as an ATR sector write or a host touching one file
+    FIL f;
+    UINT bw;
+    new_volume();
+    fill(data, 512, 1);
+    for (int i=0; i<SYNC_TESTS; i++) {
+        f_open(&f, "LOG.TXT", FA_OPEN_APPEND | FA_WRITE);
+        f_write(&f, data, 512, &bw);
+        f_close(&f);
+    }
+    printf("powercut: appending 512 bytes and syncing costs %.2f erases and %.1f page programs\n",
+        (double)sim_flash_erase_count / SYNC_TESTS, (double)sim_flash_program_count / SYNC_TESTS);
+    if (sim_flash_erase_count >= SYNC_TESTS) {
+        printf("powercut: FAILED, a small sync costs an erase or more\n");
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t erases_writing(const char *name, int size)
+{
+    reset_counts();
+    fill(data, size, 2);
+    write_file(name, data, size);
+    fatfs_disk_sync();
+    return sim_flash_erase_count;
+}
+
+static int test_idle(int rounds)
+{
+    if (!power_cuts("idle", rounds, true))
+        return 1;
+
+    // a write straight after deleting a ROM set, and one after the volume has been idle
+    new_volume();
+    if (!write_rom_set(1) || !delete_all()) {
+        printf("idle: FAILED, couldn't write and delete a ROM set\n");
+        return 1;
+    }
+    uint64_t busy = erases_writing("BUSY.BIN", IDLE_WRITE_SIZE);
+    idle();
+    uint64_t after_idle = erases_writing("IDLE.BIN", IDLE_WRITE_SIZE);
+    printf("idle: writing %dk costs %llu erases at once, %llu after the background steps\n",
+        IDLE_WRITE_SIZE / 1024, (unsigned long long)busy, (unsigned long long)after_idle);
+    if (after_idle > IDLE_MAX_ERASES) {
+        printf("idle: FAILED, the write wasn't to pre-erased flash\n");
+        return 1;
+    }
+    return 0;
+}
+
+static bool verify_case(bool scrub)
+{
+    // true if the bad slot is reported as it should be
+    const char *how = scrub ? "scrub" : "read";
+    uint8_t sector[512];
+    bool ok = true;
+    new_volume();
+    fill(data, 8 * 512, 3);
+    fatfs_disk_write(data, VERIFY_SECTOR, 8);
+    uint16_t entry = flash_fs_map_entry(VERIFY_SECTOR + 3);
+    sim_flash()[FLASH_FS_ENTRY_OFFSET(entry) + 7] ^= 1;
+    if (scrub)
+        idle();
+    if (flash_fs_entry_ok(entry)) {
+        printf("verify (%s): the bad slot can still be mapped\n", how);
+        ok = false;
+    }
+    if (fatfs_disk_read(sector, VERIFY_SECTOR + 3, 1) == RES_OK) {
+        printf("verify (%s): the bad slot read back without an error\n", how);
+        ok = false;
+    }
+    if (fatfs_disk_sync()) {
+        printf("verify (%s): the sync after the bad write didn't fail\n", how);
+        ok = false;
+    }
+    if (!fatfs_disk_sync()) {
+        printf("verify (%s): the sync after that failed too\n", how);
+        ok = false;
+    }
+    if (fatfs_disk_read(sector, VERIFY_SECTOR + 2, 1) != RES_OK || memcmp(sector, data + 2 * 512, 512)) {
+        printf("verify (%s): the slot next to the bad one doesn't read back\n", how);
+        ok = false;
+    }
+    fatfs_disk_write(data + 3 * 512, VERIFY_SECTOR + 3, 1);
+    if (!fatfs_disk_sync() || fatfs_disk_read(sector, VERIFY_SECTOR + 3, 1) != RES_OK ||
+        memcmp(sector, data + 3 * 512, 512)) {
+        printf("verify (%s): the rewritten sector doesn't read back\n", how);
+        ok = false;
+    }
+    return ok;
+}
+
+static int test_verify()
+{
+    if (!verify_case(true) || !verify_case(false)) {
+        printf("verify: FAILED\n");
+        return 1;
+    }
+    printf("verify: a bad slot fails the next sync and its reads, found by the scrub or a read\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    if (argc >= 2 && strcmp(argv[1], "copy") == 0)
+        return test_copy();
+    if (argc >= 2 && strcmp(argv[1], "fill") == 0)
+        return test_fill();
+    if (argc >= 2 && strcmp(argv[1], "wear") == 0)
+        return test_wear(argc >= 3 ? atoi(argv[2]) : WEAR_ROUNDS);
+    if (argc >= 2 && strcmp(argv[1], "trim") == 0)
+        return test_trim();
+    if (argc >= 2 && strcmp(argv[1], "powercut") == 0)
+        return test_power_cut(argc >= 3 ? atoi(argv[2]) : CUT_ROUNDS);
+    if (argc >= 2 && strcmp(argv[1], "verify") == 0)
+        return test_verify();
+    if (argc >= 2 && strcmp(argv[1], "idle") == 0)
+        return test_idle(argc >= 3 ? atoi(argv[2]) : CUT_ROUNDS);
+    fprintf(stderr, "usage: flash_bench <copy|fill|wear|trim|powercut|idle|verify> [rounds]\n");
+    return 2;
+}
@@ -0,0 +1,16 @@
+// stands in for the header pioasm generates from atari_cart.pio
+
+#ifndef _MOCK_ATARI_CART_PIO_H
+#define _MOCK_ATARI_CART_PIO_H
+
+#include "hardware/pio.h"
+
+#define PHI2_PIN 22     // .define PUBLIC outside a program, no prefix
+
+extern const pio_program_t atari_cart_8k_program, atari_cart_16k_program, atari_cart_data_program;
+
+static inline pio_sm_config atari_cart_8k_program_get_default_config(uint offset) { return pio_get_default_sm_config(); }
+static inline pio_sm_config atari_cart_16k_program_get_default_config(uint offset) { return pio_get_default_sm_config(); }
+static inline pio_sm_config atari_cart_data_program_get_default_config(uint offset) { return pio_get_default_sm_config(); }
+
+#endif
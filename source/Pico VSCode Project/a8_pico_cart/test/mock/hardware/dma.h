@@ -0,0 +1,47 @@
+#ifndef _MOCK_HARDWARE_DMA_H
+#define _MOCK_HARDWARE_DMA_H
+
+#include "pico/stdlib.h"
+
+/*
+ Transfers happen as soon as they are triggered, by memcpy. Reads from the non-caching
+ XIP alias see the simulated flash. With the sniffer enabled (mode 0 only) the data goes
+ through the CRC-32 the RP2040 computes instead of being written.
+*/
+
+typedef struct { uint32_t ctrl; } dma_channel_config;
+
+typedef struct {
+    volatile uint32_t read_addr, write_addr, transfer_count, ctrl_trig;
+    volatile uint32_t al1_ctrl, al1_read_addr, al1_write_addr, al1_transfer_count_trig;
+    volatile uint32_t al2_ctrl, al2_transfer_count, al2_read_addr, al2_write_addr_trig;
+    volatile uint32_t al3_ctrl, al3_write_addr, al3_transfer_count, al3_read_addr_trig;
+} dma_channel_hw_t;
+
+typedef struct { dma_channel_hw_t ch[12]; volatile uint32_t sniff_ctrl, sniff_data; } dma_hw_t;
+extern dma_hw_t *dma_hw;
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint channel);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to);
+void channel_config_set_high_priority(dma_channel_config *c, bool high_priority);
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_channel_start(uint channel);
+void dma_channel_abort(uint channel);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_wait_for_finish_blocking(uint channel);
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+void dma_sniffer_disable(void);
+void dma_sniffer_set_data_accumulator(uint32_t seed_value);
+uint32_t dma_sniffer_get_data_accumulator(void);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _MOCK_HARDWARE_FLASH_H
+#define _MOCK_HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+// offsets from XIP_BASE, as the SDK
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
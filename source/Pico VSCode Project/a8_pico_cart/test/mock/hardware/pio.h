@@ -0,0 +1,34 @@
+#ifndef _MOCK_HARDWARE_PIO_H
+#define _MOCK_HARDWARE_PIO_H
+
+#include "pico/stdlib.h"
+
+// enough to configure the state machines, nothing runs (test/pio_sim.c runs the programs)
+typedef struct { volatile uint32_t txf[4], rxf[4]; } pio_hw_t;
+typedef pio_hw_t *PIO;
+extern pio_hw_t *pio0, *pio1;
+
+typedef struct { uint32_t clkdiv, execctrl, shiftctrl, pinctrl; } pio_sm_config;
+typedef struct pio_program { const uint16_t *instructions; uint8_t length; int8_t origin; } pio_program_t;
+
+enum pio_src_dest { pio_pins, pio_x, pio_y, pio_null, pio_pindirs, pio_exec_mov, pio_status, pio_pc, pio_isr, pio_osr };
+
+uint pio_add_program(PIO pio, const pio_program_t *program);
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_gpio_init(PIO pio, uint pin);
+void pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base, uint pin_count, bool is_out);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+void pio_sm_exec(PIO pio, uint sm, uint instr);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+uint pio_encode_pull(bool if_empty, bool block);
+uint pio_encode_mov(enum pio_src_dest dest, enum pio_src_dest src);
+
+static inline pio_sm_config pio_get_default_sm_config(void) { pio_sm_config c = {0}; return c; }
+static inline void sm_config_set_in_pins(pio_sm_config *c, uint in_base) {}
+static inline void sm_config_set_out_pins(pio_sm_config *c, uint out_base, uint out_count) {}
+static inline void sm_config_set_jmp_pin(pio_sm_config *c, uint pin) {}
+static inline void sm_config_set_in_shift(pio_sm_config *c, bool shift_right, bool autopush, uint push_threshold) {}
+static inline void sm_config_set_out_shift(pio_sm_config *c, bool shift_right, bool autopull, uint pull_threshold) {}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _MOCK_HARDWARE_STRUCTS_SIO_H
+#define _MOCK_HARDWARE_STRUCTS_SIO_H
+
+#include "pico/stdlib.h"
+
+typedef struct {
+    uint32_t cpuid;
+    volatile uint32_t fifo_st, fifo_wr, fifo_rd;
+} sio_hw_t;
+
+// fifo_wr reads back as SIO_FIFO_EMPTY until something is written, see sim_fifo_take()
+#define SIO_FIFO_EMPTY  0xFFFFFFFF
+
+extern sio_hw_t *sio_hw;
+
+#endif
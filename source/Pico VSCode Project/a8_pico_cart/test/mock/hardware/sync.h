@@ -0,0 +1,9 @@
+#ifndef _MOCK_HARDWARE_SYNC_H
+#define _MOCK_HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+#endif
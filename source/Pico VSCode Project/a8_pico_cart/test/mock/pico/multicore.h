@@ -0,0 +1,22 @@
+#ifndef _MOCK_PICO_MULTICORE_H
+#define _MOCK_PICO_MULTICORE_H
+
+#include "pico/stdlib.h"
+
+// the tests run everything on one thread, as core 0 unless sim_core says otherwise
+extern uint sim_core;
+
+void multicore_launch_core1(void (*entry)(void));
+void multicore_reset_core1(void);
+void multicore_fifo_push_blocking(uint32_t data);
+uint32_t multicore_fifo_pop_blocking(void);
+bool multicore_fifo_rvalid(void);
+bool multicore_fifo_wready(void);
+void multicore_fifo_drain(void);
+void multicore_lockout_victim_init(void);
+bool multicore_lockout_victim_is_initialized(uint core_num);
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+static inline uint get_core_num(void) { return sim_core; }
+
+#endif
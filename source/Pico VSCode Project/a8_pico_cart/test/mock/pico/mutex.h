@@ -0,0 +1,15 @@
+#ifndef _MOCK_PICO_MUTEX_H
+#define _MOCK_PICO_MUTEX_H
+
+#include "pico/stdlib.h"
+
+typedef struct { int owner; } mutex_t;
+
+#define auto_init_mutex(name) mutex_t name = { -1 }
+
+void mutex_init(mutex_t *mtx);
+void mutex_enter_blocking(mutex_t *mtx);
+bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out);
+void mutex_exit(mutex_t *mtx);
+
+#endif
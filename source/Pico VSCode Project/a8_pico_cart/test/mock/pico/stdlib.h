@@ -0,0 +1,76 @@
+/*
+ Host stand-in for the parts of the Pico SDK the firmware uses. The implementations are in
+ sdk_mock.c, GPIO ones are weak so a test can drive the pins itself.
+*/
+
+#ifndef _MOCK_PICO_STDLIB_H
+#define _MOCK_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+
+#define __not_in_flash_func(x)              x
+// the bus loops, in a section of their own so bus_sim can count the instructions they run
+#define __no_inline_not_in_flash_func(x)    __attribute__((noinline, section("time_critical"))) x
+#define __time_critical_func(x)             x
+#define __not_in_flash(group)
+#define __in_flash(group)
+#define __scratch_x(group)
+#define __scratch_y(group)
+#define __force_inline                      inline __attribute__((always_inline))
+
+#define XIP_BASE                    0x10000000
+#define XIP_NOCACHE_NOALLOC_BASE    0x13000000
+#define PICO_FLASH_SIZE_BYTES       (16 * 1024 * 1024)
+#define FLASH_SECTOR_SIZE           4096
+#define FLASH_PAGE_SIZE             256
+
+#define GPIO_IN     false
+#define GPIO_OUT    true
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+static inline void __wfe(void) {}
+static inline void __wfi(void) {}
+static inline void __sev(void) {}
+static inline void __dmb(void) { __sync_synchronize(); }
+static inline void tight_loop_contents(void) {}
+
+// gpio
+void gpio_init(uint gpio);
+void gpio_init_mask(uint32_t mask);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_dir_out_masked(uint32_t mask);
+void gpio_set_dir_in_masked(uint32_t mask);
+void gpio_set_dir_masked(uint32_t mask, uint32_t value);
+bool gpio_get(uint gpio);
+uint32_t gpio_get_all(void);
+void gpio_put(uint gpio, bool value);
+void gpio_put_masked(uint32_t mask, uint32_t value);
+void gpio_pull_up(uint gpio);
+
+// time, from the simulated clock in sdk_mock.c
+typedef struct { uint64_t _private_us_since_boot; } absolute_time_t;
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to);
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t._private_us_since_boot / 1000); }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t._private_us_since_boot; }
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past);
+bool cancel_alarm(alarm_id_t id);
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+void stdio_init_all(void);
+
+#endif
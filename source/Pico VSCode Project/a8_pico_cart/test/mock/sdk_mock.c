@@ -0,0 +1,250 @@
+/**
+ *    _   ___ ___ _       ___          _
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *
+ *
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host test: Pico SDK stand-ins
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/mutex.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/structs/sio.h"
+#include "sdk_mock.h"
+
+/* Time */
+
+uint64_t sim_time_us;
+
+uint64_t time_us_64(void) { return sim_time_us; }
+uint32_t time_us_32(void) { return (uint32_t)sim_time_us; }
+absolute_time_t get_absolute_time(void) { absolute_time_t t = { sim_time_us }; return t; }
+absolute_time_t make_timeout_time_ms(uint32_t ms) { absolute_time_t t = { sim_time_us + ms * 1000ull }; return t; }
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to._private_us_since_boot - from._private_us_since_boot);
+}
+void sleep_ms(uint32_t ms) { sim_time_us += ms * 1000ull; }
+void sleep_us(uint64_t us) { sim_time_us += us; }
+alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past) { return 1; }
+bool cancel_alarm(alarm_id_t id) { return true; }
+bool set_sys_clock_khz(uint32_t freq_khz, bool required) { return true; }
+void stdio_init_all(void) {}
+
+/* GPIO, replaced by tests that look at the pins */
+
+__attribute__((weak)) void gpio_init(uint gpio) {}
+__attribute__((weak)) void gpio_init_mask(uint32_t mask) {}
+__attribute__((weak)) void gpio_set_dir(uint gpio, bool out) {}
+__attribute__((weak)) void gpio_set_dir_out_masked(uint32_t mask) {}
+__attribute__((weak)) void gpio_set_dir_in_masked(uint32_t mask) {}
+__attribute__((weak)) void gpio_set_dir_masked(uint32_t mask, uint32_t value) {}
+__attribute__((weak)) bool gpio_get(uint gpio) { return false; }
+__attribute__((weak)) uint32_t gpio_get_all(void) { return 0; }
+__attribute__((weak)) void gpio_put(uint gpio, bool value) {}
+__attribute__((weak)) void gpio_put_masked(uint32_t mask, uint32_t value) {}
+__attribute__((weak)) void gpio_pull_up(uint gpio) {}
+
+/* Cores, FIFO & locks - everything runs on one thread */
+
+uint sim_core;
+static sio_hw_t sio = { .fifo_wr = SIO_FIFO_EMPTY };
+sio_hw_t *sio_hw = &sio;
+
+uint32_t sim_fifo_take(void) {
+    uint32_t v = sio.fifo_wr;
+    sio.fifo_wr = SIO_FIFO_EMPTY;
+    return v;
+}
+
+void multicore_launch_core1(void (*entry)(void)) {}
+void multicore_reset_core1(void) {}
+void multicore_fifo_push_blocking(uint32_t data) { sio.fifo_wr = data; }
+uint32_t multicore_fifo_pop_blocking(void) { return sim_fifo_take(); }
+bool multicore_fifo_rvalid(void) { return sio.fifo_wr != SIO_FIFO_EMPTY; }
+bool multicore_fifo_wready(void) { return true; }
+void multicore_fifo_drain(void) { sio.fifo_wr = SIO_FIFO_EMPTY; }
+void multicore_lockout_victim_init(void) {}
+bool multicore_lockout_victim_is_initialized(uint core_num) { return true; }
+void multicore_lockout_start_blocking(void) {}
+void multicore_lockout_end_blocking(void) {}
+
+void mutex_init(mutex_t *mtx) { mtx->owner = -1; }
+void mutex_enter_blocking(mutex_t *mtx) { mtx->owner = sim_core; }
+bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out) { mtx->owner = sim_core; return true; }
+void mutex_exit(mutex_t *mtx) { mtx->owner = -1; }
+
+uint32_t save_and_disable_interrupts(void) { return 0; }
+void restore_interrupts(uint32_t status) {}
+
+/* Flash */
+
+static uint8_t *flash;
+uint32_t sim_flash_erases[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE];
+uint64_t sim_flash_erase_count, sim_flash_program_count;
+long sim_power_cut_after = -1;
+jmp_buf sim_power_cut;
+
+void sim_flash_init(void) {
+    // the firmware reads flash through pointers to XIP_BASE and XIP_NOCACHE_NOALLOC_BASE,
+    // so map the same memory at both
+    if (!flash) {
+        int fd = memfd_create("sim_flash", 0);
+        if (fd < 0 || ftruncate(fd, PICO_FLASH_SIZE_BYTES) ||
+            mmap((void *)XIP_BASE, PICO_FLASH_SIZE_BYTES, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0) != (void *)XIP_BASE ||
+            mmap((void *)XIP_NOCACHE_NOALLOC_BASE, PICO_FLASH_SIZE_BYTES, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0) != (void *)XIP_NOCACHE_NOALLOC_BASE) {
+            perror("sim_flash_init");
+            exit(2);
+        }
+        flash = (uint8_t *)XIP_BASE;
+    }
+    memset(flash, 0xFF, PICO_FLASH_SIZE_BYTES);
+    memset(sim_flash_erases, 0, sizeof(sim_flash_erases));
+    sim_flash_erase_count = sim_flash_program_count = 0;
+}
+
+uint8_t *sim_flash(void) {
+    return flash;
+}
+
+static bool power_cut(void) {
+    return sim_power_cut_after >= 0 && sim_power_cut_after-- == 0;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    if (flash_offs % FLASH_SECTOR_SIZE || count % FLASH_SECTOR_SIZE || flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+        fprintf(stderr, "flash_range_erase: bad range %x+%zx\n", flash_offs, count);
+        abort();
+    }
+    if (power_cut()) {
+        memset(flash + flash_offs, 0xFF, count / 2);
+        longjmp(sim_power_cut, 1);
+    }
+    memset(flash + flash_offs, 0xFF, count);
+    for (size_t i=0; i<count; i+=FLASH_SECTOR_SIZE)
+        sim_flash_erases[(flash_offs + i) / FLASH_SECTOR_SIZE]++;
+    sim_flash_erase_count += count / FLASH_SECTOR_SIZE;
+    sim_time_us += SIM_ERASE_US * (count / FLASH_SECTOR_SIZE);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    if (flash_offs % FLASH_PAGE_SIZE || count % FLASH_PAGE_SIZE || flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+        fprintf(stderr, "flash_range_program: bad range %x+%zx\n", flash_offs, count);
+        abort();
+    }
+    if (power_cut()) {
+        for (size_t i=0; i<count/2; i++)
+            flash[flash_offs + i] &= data[i];
+        longjmp(sim_power_cut, 1);
+    }
+    for (size_t i=0; i<count; i++) {
+        if ((flash[flash_offs + i] & data[i]) != data[i]) {
+            // not an error on real flash, but flash_fs never means to
+            fprintf(stderr, "flash_range_program: %zx not erased\n", flash_offs + i);
+            abort();
+        }
+        flash[flash_offs + i] = data[i];
+    }
+    sim_flash_program_count += count / FLASH_PAGE_SIZE;
+    sim_time_us += SIM_PROGRAM_US * (count / FLASH_PAGE_SIZE);
+}
+
+/* DMA */
+
+#define CTRL_WRITE_INCR     1
+#define CTRL_SNIFF          8
+#define CTRL_SIZE(c)        (1u << (((c) >> 1) & 3))
+
+static uint32_t sniff_acc;
+static uint32_t sniff_table[256];
+static int next_channel;
+
+int dma_claim_unused_channel(bool required) { return next_channel++ % 12; }
+void dma_channel_unclaim(uint channel) {}
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channel_config c = { DMA_SIZE_32 << 1 };
+    return c;
+}
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) {
+    c->ctrl = (c->ctrl & ~6) | (size << 1);
+}
+void channel_config_set_read_increment(dma_channel_config *c, bool incr) {}
+void channel_config_set_write_increment(dma_channel_config *c, bool incr) {
+    c->ctrl = incr ? c->ctrl | CTRL_WRITE_INCR : c->ctrl & ~CTRL_WRITE_INCR;
+}
+void channel_config_set_dreq(dma_channel_config *c, uint dreq) {}
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to) {}
+void channel_config_set_high_priority(dma_channel_config *c, bool high_priority) {}
+void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable) {
+    c->ctrl = sniff_enable ? c->ctrl | CTRL_SNIFF : c->ctrl & ~CTRL_SNIFF;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger) {
+    const uint8_t *src = (const uint8_t *)read_addr;
+    size_t len = (size_t)transfer_count * CTRL_SIZE(config->ctrl);
+
+    if (!trigger || !read_addr)
+        return;     // only the PIO carts set up channels to trigger later, nothing runs them here
+    if (config->ctrl & CTRL_SNIFF) {
+        // CRC-32, poly 0x04C11DB7, not reflected, a byte at a time from each word (mode 0)
+        if (!sniff_table[1]) {
+            for (uint32_t b=0; b<256; b++) {
+                uint32_t c = b << 24;
+                for (int k=0; k<8; k++)
+                    c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : c << 1;
+                sniff_table[b] = c;
+            }
+        }
+        for (size_t i=0; i<len; i++)
+            sniff_acc = (sniff_acc << 8) ^ sniff_table[(sniff_acc >> 24) ^ src[i]];
+    }
+    if (config->ctrl & CTRL_WRITE_INCR)
+        memcpy((void *)write_addr, src, len);
+}
+
+void dma_channel_start(uint channel) {}
+void dma_channel_abort(uint channel) {}
+bool dma_channel_is_busy(uint channel) { return false; }
+void dma_channel_wait_for_finish_blocking(uint channel) {}
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {}
+void dma_sniffer_disable(void) {}
+void dma_sniffer_set_data_accumulator(uint32_t seed_value) { sniff_acc = seed_value; }
+uint32_t dma_sniffer_get_data_accumulator(void) { return sniff_acc; }
+
+static dma_hw_t dma;
+dma_hw_t *dma_hw = &dma;
+
+/* PIO - configured, never run */
+
+static pio_hw_t pio[2];
+pio_hw_t *pio0 = &pio[0], *pio1 = &pio[1];
+const pio_program_t atari_cart_8k_program, atari_cart_16k_program, atari_cart_data_program;
+
+uint pio_add_program(PIO pio, const pio_program_t *program) { return 0; }
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config) {}
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) {}
+void pio_gpio_init(PIO pio, uint pin) {}
+void pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin_base, uint pin_count, bool is_out) {}
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {}
+void pio_sm_exec(PIO pio, uint sm, uint instr) {}
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx) { return 0; }
+uint pio_encode_pull(bool if_empty, bool block) { return 0; }
+uint pio_encode_mov(enum pio_src_dest dest, enum pio_src_dest src) { return 0; }
@@ -0,0 +1,32 @@
+/*
+ What the host tests use to drive the mock SDK: the simulated clock, the flash chip and the
+ SIO FIFO between the cores.
+*/
+
+#ifndef _SDK_MOCK_H
+#define _SDK_MOCK_H
+
+#include <setjmp.h>
+#include "pico/stdlib.h"
+
+// simulated time, advanced by the tests and by flash erase/program
+extern uint64_t sim_time_us;
+
+// flash: 16MB, readable at XIP_BASE and at the non-caching alias
+#define SIM_ERASE_US    45000   // W25Q128JV typical 4k sector erase
+#define SIM_PROGRAM_US  400     // and 256 byte page program
+
+void sim_flash_init(void);
+uint8_t *sim_flash(void);
+extern uint32_t sim_flash_erases[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE];    // per sector
+extern uint64_t sim_flash_erase_count, sim_flash_program_count;
+
+// power cut: after this many more erase/program operations, the next one is half done and
+// flash_range_erase()/flash_range_program() longjmp to sim_power_cut
+extern long sim_power_cut_after;
+extern jmp_buf sim_power_cut;
+
+// the next value core 1 wrote to sio_hw->fifo_wr, or SIO_FIFO_EMPTY
+uint32_t sim_fifo_take(void);
+
+#endif
@@ -0,0 +1,571 @@
+/**
+ *    _   ___ ___ _       ___          _
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *
+ *
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host test: PIO bus engine simulator
+ */
+
+/*
+ Runs the programs in atari_cart.pio, set up the way start_pio_cart() sets them up, against
+ a bus trace (traces/phi2_pal.csv) one system clock at a time, and checks every PHI2 cycle:
+  - when the cart is selected for a read at the moment the 6502 latches the data bus (PHI2
+    falling less the data setup time), D0-D7 are driven with the right byte of cart_ram
+  - when it isn't, D0-D7 are never driven while PHI2 is high
+  - the bus is let go again before the next PHI2 rise
+ and reports the worst case time from PHI2 rising (or the select settling, if later) to the
+ data being valid.
+
+ The simulator handles the subset of PIO used by atari_cart.pio (wait gpio, jmp, in, out,
+ push, pull, mov, set) and fails on anything else. GPIO inputs go through the two cycle
+ input synchroniser. The chained DMA channels that turn an address into a byte are modelled
+ as a fixed latency, DMA_CYCLES, from the address entering the RX FIFO to the byte entering
+ the data state machine's TX FIFO.
+
+ usage: pio_sim <atari_cart.pio> <trace.csv> <program> <system clock kHz>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#define DMA_CYCLES      10      // address in the RX FIFO to byte in the TX FIFO
+#define DATA_SETUP_NS   20      // 6502C data setup time before PHI2 falls
+#define SYNC_CYCLES     2       // GPIO input synchroniser
+
+#define PHI2_PIN        22
+#define RW_PIN          23
+#define S4_PIN          24
+#define S5_PIN          25
+#define CCTL_PIN        21
+#define DATA_PIN_BASE   13
+
+#define RAM_BASE        0x20000000u     // where cart_ram is as far as the DMA is concerned
+#define RAM_SIZE        (128 * 1024)
+
+/* PIO programs */
+
+enum { OP_JMP, OP_WAIT, OP_IN, OP_OUT, OP_PUSH, OP_PULL, OP_MOV, OP_SET };
+enum { SRC_PINS, SRC_X, SRC_Y, SRC_NULL, SRC_ISR, SRC_OSR, SRC_STATUS, SRC_PINDIRS, SRC_PC };
+enum { COND_ALWAYS, COND_NOT_X, COND_X_DEC, COND_NOT_Y, COND_Y_DEC, COND_X_NE_Y, COND_PIN, COND_NOT_OSRE };
+
+typedef struct {
+    int op;
+    int cond;           // jmp
+    char label[32];     // jmp target, until resolved
+    int target;
+    int reg;            // in/mov/set source, out/mov/set destination
+    int src;            // mov source
+    int invert;         // mov ~
+    int bits;           // in/out bit count, set/wait value
+    int polarity;       // wait
+    bool block;         // push/pull
+} instr;
+
+typedef struct {
+    char name[32];
+    instr code[32];
+    int len;
+    int wrap_target, wrap;
+    char label[32][32];
+    int label_at[32];
+    int num_labels;
+} program;
+
+program programs[8];
+int num_programs = 0;
+
+char defines[16][32];
+int define_value[16];
+int num_defines = 0;
+
+static void fail(const char *msg, const char *detail)
+{
+    fprintf(stderr, "pio_sim: %s %s\n", msg, detail ? detail : "");
+    exit(2);
+}
+
+static int reg_name(const char *s, bool dst)
+{
+    if (!strcmp(s, "pins")) return SRC_PINS;
+    if (!strcmp(s, "x")) return SRC_X;
+    if (!strcmp(s, "y")) return SRC_Y;
+    if (!strcmp(s, "null")) return SRC_NULL;
+    if (!strcmp(s, "isr")) return SRC_ISR;
+    if (!strcmp(s, "osr")) return SRC_OSR;
+    if (!strcmp(s, "status") && !dst) return SRC_STATUS;
+    if (!strcmp(s, "pindirs") && dst) return SRC_PINDIRS;
+    if (!strcmp(s, "pc") && dst) return SRC_PC;
+    fail("unsupported register", s);
+    return 0;
+}
+
+static int value(const char *s)
+{
+    for (int i=0; i<num_defines; i++)
+        if (!strcmp(defines[i], s))
+            return define_value[i];
+    if (!isdigit((unsigned char)s[0]))
+        fail("unknown symbol", s);
+    return (int)strtol(s, NULL, 0);
+}
+
+static void parse_instr(program *p, char **tok, int n, const char *line)
+{
+    instr *in = &p->code[p->len];
+    memset(in, 0, sizeof(*in));
+    in->block = true;
+    if (!strcmp(tok[0], "jmp")) {
+        static const char *conds[] = { "", "!x", "x--", "!y", "y--", "x!=y", "pin", "!osre" };
+        in->op = OP_JMP;
+        if (n == 3) {
+            for (in->cond=1; in->cond<8 && strcmp(conds[in->cond], tok[1]); in->cond++) ;
+            if (in->cond == 8) fail("unsupported jmp condition", line);
+        }
+        strcpy(in->label, tok[n - 1]);
+    }
+    else if (!strcmp(tok[0], "wait")) {
+        in->op = OP_WAIT;
+        if (n != 4 || strcmp(tok[2], "gpio")) fail("unsupported wait", line);
+        in->polarity = value(tok[1]);
+        in->bits = value(tok[3]);
+    }
+    else if (!strcmp(tok[0], "in") || !strcmp(tok[0], "out")) {
+        in->op = tok[0][0] == 'i' ? OP_IN : OP_OUT;
+        if (n != 3) fail("bad in/out", line);
+        in->reg = reg_name(tok[1], in->op == OP_OUT);
+        in->bits = value(tok[2]);
+    }
+    else if (!strcmp(tok[0], "push") || !strcmp(tok[0], "pull")) {
+        in->op = tok[0][1] == 'u' && tok[0][2] == 's' ? OP_PUSH : OP_PULL;
+        for (int i=1; i<n; i++) {
+            if (!strcmp(tok[i], "noblock")) in->block = false;
+            else if (strcmp(tok[i], "block")) fail("unsupported push/pull option", line);
+        }
+    }
+    else if (!strcmp(tok[0], "mov")) {
+        in->op = OP_MOV;
+        if (n != 3) fail("bad mov", line);
+        in->reg = reg_name(tok[1], true);
+        const char *s = tok[2];
+        if (s[0] == '~' || s[0] == '!') { in->invert = 1; s++; }
+        in->src = reg_name(s, false);
+    }
+    else if (!strcmp(tok[0], "set")) {
+        in->op = OP_SET;
+        if (n != 3) fail("bad set", line);
+        in->reg = reg_name(tok[1], true);
+        in->bits = value(tok[2]);
+    }
+    else if (!strcmp(tok[0], "nop")) {
+        in->op = OP_MOV;
+        in->reg = in->src = SRC_Y;
+    }
+    else
+        fail("unsupported instruction", line);
+    if (++p->len > 32)
+        fail("program too long", p->name);
+}
+
+void load_pio(const char *filename)
+{
+    char line[256];
+    FILE *f = fopen(filename, "r");
+    program *p = NULL;
+    if (!f) fail("can't open", filename);
+    while (fgets(line, sizeof(line), f)) {
+        char *c = strchr(line, ';');
+        if (c) *c = 0;
+        if ((c = strstr(line, "//"))) *c = 0;
+        char *tok[8];
+        int n = 0;
+        for (char *t = strtok(line, " \t\r\n,"); t && n < 8; t = strtok(NULL, " \t\r\n,"))
+            tok[n++] = t;
+        if (!n)
+            continue;
+        if (!strcmp(tok[0], ".define")) {
+            int i = (n == 4) ? 2 : 1;   // .define [PUBLIC] name value
+            strcpy(defines[num_defines], tok[i]);
+            define_value[num_defines++] = value(tok[i + 1]);
+        }
+        else if (!strcmp(tok[0], ".program")) {
+            p = &programs[num_programs++];
+            memset(p, 0, sizeof(*p));
+            strcpy(p->name, tok[1]);
+            p->wrap = -1;
+        }
+        else if (!p)
+            fail("instruction outside a program", tok[0]);
+        else if (!strcmp(tok[0], ".wrap_target"))
+            p->wrap_target = p->len;
+        else if (!strcmp(tok[0], ".wrap"))
+            p->wrap = p->len - 1;
+        else if (tok[0][0] == '.')
+            fail("unsupported directive", tok[0]);
+        else if (tok[0][strlen(tok[0]) - 1] == ':') {
+            tok[0][strlen(tok[0]) - 1] = 0;
+            strcpy(p->label[p->num_labels], tok[0]);
+            p->label_at[p->num_labels++] = p->len;
+        }
+        else
+            parse_instr(p, tok, n, tok[0]);
+    }
+    fclose(f);
+    for (int i=0; i<num_programs; i++) {
+        p = &programs[i];
+        if (p->wrap < 0) p->wrap = p->len - 1;
+        for (int j=0; j<p->len; j++) {
+            if (p->code[j].op != OP_JMP) continue;
+            int k;
+            for (k=0; k<p->num_labels && strcmp(p->label[k], p->code[j].label); k++) ;
+            if (k == p->num_labels) fail("unknown label", p->code[j].label);
+            p->code[j].target = p->label_at[k];
+        }
+    }
+}
+
+program *find_program(const char *name)
+{
+    for (int i=0; i<num_programs; i++)
+        if (!strcmp(programs[i].name, name))
+            return &programs[i];
+    fail("no such program", name);
+    return NULL;
+}
+
+/* State machines */
+
+typedef struct {
+    const program *p;
+    int pc;
+    uint32_t x, y, isr, osr;
+    int isr_count, osr_count;
+    uint32_t rx[4], tx[4];
+    int rx_n, tx_n;
+    bool in_shift_right, out_shift_right;
+    int in_base, out_base, out_count, jmp_pin;
+} sm;
+
+uint32_t gpio_sync[SYNC_CYCLES + 1];    // [0] = pins as the state machines see them
+uint32_t out_pins, out_dirs;            // driven by the data state machine
+
+static uint32_t mask(int bits) { return bits >= 32 ? 0xFFFFFFFF : (1u << bits) - 1; }
+
+static uint32_t read_pins(const sm *s)
+{
+    uint32_t v = gpio_sync[0];
+    return s->in_base ? (v >> s->in_base) | (v << (32 - s->in_base)) : v;
+}
+
+static void write_out(const sm *s, uint32_t *pins, uint32_t data, int bits)
+{
+    int n = bits < s->out_count ? bits : s->out_count;
+    uint32_t m = mask(n) << s->out_base;
+    *pins = (*pins & ~m) | ((data << s->out_base) & m);
+}
+
+static uint32_t source(sm *s, int src)
+{
+    switch (src) {
+    case SRC_PINS: return read_pins(s);
+    case SRC_X: return s->x;
+    case SRC_Y: return s->y;
+    case SRC_ISR: return s->isr;
+    case SRC_OSR: return s->osr;
+    default: return 0;
+    }
+}
+
+static void step(sm *s)
+{
+    const instr *in = &s->p->code[s->pc];
+    int next = (s->pc == s->p->wrap) ? s->p->wrap_target : s->pc + 1;
+    uint32_t v;
+
+    switch (in->op) {
+    case OP_JMP: {
+        bool take = true;
+        switch (in->cond) {
+        case COND_NOT_X: take = !s->x; break;
+        case COND_X_DEC: take = s->x; s->x--; break;
+        case COND_NOT_Y: take = !s->y; break;
+        case COND_Y_DEC: take = s->y; s->y--; break;
+        case COND_X_NE_Y: take = s->x != s->y; break;
+        case COND_PIN: take = (gpio_sync[0] >> s->jmp_pin) & 1; break;
+        case COND_NOT_OSRE: take = s->osr_count < 32; break;
+        }
+        if (take) next = in->target;
+        break;
+    }
+    case OP_WAIT:
+        if (((gpio_sync[0] >> in->bits) & 1) != in->polarity)
+            return;     // stalled
+        break;
+    case OP_IN:
+        v = source(s, in->reg) & mask(in->bits);
+        if (s->in_shift_right)
+            s->isr = (in->bits >= 32) ? v : (s->isr >> in->bits) | (v << (32 - in->bits));
+        else
+            s->isr = (in->bits >= 32) ? v : (s->isr << in->bits) | v;
+        s->isr_count += in->bits;
+        if (s->isr_count > 32) s->isr_count = 32;
+        break;
+    case OP_OUT:
+        if (s->out_shift_right) {
+            v = s->osr & mask(in->bits);
+            s->osr = (in->bits >= 32) ? 0 : s->osr >> in->bits;
+        }
+        else {
+            v = (in->bits >= 32) ? s->osr : s->osr >> (32 - in->bits);
+            s->osr = (in->bits >= 32) ? 0 : s->osr << in->bits;
+        }
+        s->osr_count += in->bits;
+        if (s->osr_count > 32) s->osr_count = 32;
+        switch (in->reg) {
+        case SRC_PINS: write_out(s, &out_pins, v, in->bits); break;
+        case SRC_PINDIRS: write_out(s, &out_dirs, v, in->bits); break;
+        case SRC_X: s->x = v; break;
+        case SRC_Y: s->y = v; break;
+        case SRC_ISR: s->isr = v; s->isr_count = in->bits; break;
+        case SRC_PC: next = v; break;
+        }
+        break;
+    case OP_PUSH:
+        if (s->rx_n == 4) {
+            if (in->block) return;
+        }
+        else
+            s->rx[s->rx_n++] = s->isr;
+        s->isr = 0;
+        s->isr_count = 0;
+        break;
+    case OP_PULL:
+        if (!s->tx_n) {
+            if (in->block) return;
+            s->osr = s->x;
+        }
+        else {
+            s->osr = s->tx[0];
+            memmove(s->tx, s->tx + 1, --s->tx_n * sizeof(uint32_t));
+        }
+        s->osr_count = 0;
+        break;
+    case OP_MOV:
+        v = source(s, in->src);
+        if (in->invert) v = ~v;
+        switch (in->reg) {
+        case SRC_PINS: write_out(s, &out_pins, v, 32); break;
+        case SRC_PINDIRS: write_out(s, &out_dirs, v, 32); break;
+        case SRC_X: s->x = v; break;
+        case SRC_Y: s->y = v; break;
+        case SRC_ISR: s->isr = v; s->isr_count = 0; break;
+        case SRC_OSR: s->osr = v; s->osr_count = 0; break;
+        case SRC_PC: next = v; break;
+        }
+        break;
+    case OP_SET:
+        switch (in->reg) {
+        case SRC_X: s->x = in->bits; break;
+        case SRC_Y: s->y = in->bits; break;
+        default: fail("unsupported set destination", NULL);
+        }
+        break;
+    }
+    s->pc = next;
+}
+
+/* Bus trace */
+
+typedef struct {
+    uint32_t t;     // ns
+    uint32_t pins;
+} trace_row;
+
+trace_row *trace;
+int trace_len;
+
+void load_trace(const char *filename)
+{
+    char line[256];
+    FILE *f = fopen(filename, "r");
+    int size = 0;
+    if (!f) fail("can't open", filename);
+    while (fgets(line, sizeof(line), f)) {
+        unsigned t, phi2, rw, s4, s5, cctl, addr;
+        if (sscanf(line, "%u,%u,%u,%u,%u,%u,%x", &t, &phi2, &rw, &s4, &s5, &cctl, &addr) != 7)
+            continue;   // comment or header
+        if (trace_len == size)
+            trace = realloc(trace, (size = size ? size * 2 : 1024) * sizeof(trace_row));
+        trace[trace_len].t = t;
+        trace[trace_len++].pins = (addr & 0x1FFF) | (cctl << CCTL_PIN) | (phi2 << PHI2_PIN) |
+            (rw << RW_PIN) | (s4 << S4_PIN) | (s5 << S5_PIN);
+    }
+    fclose(f);
+    if (!trace_len) fail("empty trace", filename);
+}
+
+uint32_t trace_pins(uint32_t t, int *row)
+{
+    // rows are in time order and t only goes forward
+    while (*row + 1 < trace_len && trace[*row + 1].t <= t)
+        (*row)++;
+    return trace[*row].pins;
+}
+
+/* Simulation */
+
+uint8_t cart_ram[RAM_SIZE];
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        fprintf(stderr, "usage: pio_sim <atari_cart.pio> <trace.csv> <program> <system clock kHz>\n");
+        return 2;
+    }
+    load_pio(argv[1]);
+    load_trace(argv[2]);
+    const program *prog = find_program(argv[3]);
+    bool is16k = strstr(argv[3], "16k") != NULL;
+    double ns_per_clock = 1e6 / atof(argv[4]);
+
+    for (int i=0; i<RAM_SIZE; i++)
+        cart_ram[i] = (i * 151 + (i >> 8) * 7 + (i >> 13) * 89) & 0xFF;
+
+    // as start_pio_cart()
+    sm addr_sm = { .p = prog, .pc = 0, .in_shift_right = false, .out_shift_right = true,
+        .in_base = 0, .jmp_pin = is16k ? PHI2_PIN : S5_PIN };
+    addr_sm.x = RAM_BASE >> (is16k ? 14 : 13);
+    sm data_sm = { .p = find_program("atari_cart_data"), .pc = 0, .out_shift_right = true,
+        .out_base = DATA_PIN_BASE, .out_count = 8 };
+
+    int dma_busy = 0;
+    uint32_t dma_byte = 0;
+
+    uint32_t end = trace[trace_len - 1].t;
+    int clocks = (int)(end / ns_per_clock);
+    uint8_t *dirs = malloc(clocks), *vals = malloc(clocks);
+    int row = 0;
+
+    for (int c=0; c<clocks; c++) {
+        uint32_t pins = trace_pins((uint32_t)(c * ns_per_clock), &row);
+        memmove(gpio_sync, gpio_sync + 1, SYNC_CYCLES * sizeof(uint32_t));
+        gpio_sync[SYNC_CYCLES] = pins;
+
+        step(&addr_sm);
+        step(&data_sm);
+
+        // chained DMA: address from the RX FIFO, byte to the TX FIFO
+        if (dma_busy) {
+            if (--dma_busy == 0) {
+                if (data_sm.tx_n < 4)
+                    data_sm.tx[data_sm.tx_n++] = dma_byte;
+                else
+                    dma_busy = 1;   // wait for room
+            }
+        }
+        else if (addr_sm.rx_n) {
+            uint32_t a = addr_sm.rx[0];
+            memmove(addr_sm.rx, addr_sm.rx + 1, --addr_sm.rx_n * sizeof(uint32_t));
+            if (a < RAM_BASE || a >= RAM_BASE + RAM_SIZE) {
+                fprintf(stderr, "clock %d: DMA read from %08x, outside cart_ram\n", c, a);
+                return 1;
+            }
+            dma_byte = cart_ram[a - RAM_BASE];
+            dma_busy = DMA_CYCLES;
+        }
+
+        dirs[c] = out_dirs >> DATA_PIN_BASE;
+        vals[c] = out_pins >> DATA_PIN_BASE;
+    }
+
+    // check each PHI2 high phase
+    int cycles = 0, reads = 0, errors = 0;
+    double worst_valid = 0, worst_release = 0, least_slack = 1e9;
+    row = 0;
+    for (int i=1; i<trace_len; i++) {
+        if (!((trace[i].pins >> PHI2_PIN) & 1) || ((trace[i-1].pins >> PHI2_PIN) & 1))
+            continue;   // not a rising edge
+        uint32_t rise = trace[i].t, fall = 0, next_rise = 0;
+        int j;
+        for (j=i+1; j<trace_len && ((trace[j].pins >> PHI2_PIN) & 1); j++) ;
+        if (j == trace_len) break;
+        fall = trace[j].t;
+        for (j++; j<trace_len && !((trace[j].pins >> PHI2_PIN) & 1); j++) ;
+        if (j == trace_len) break;
+        next_rise = trace[j].t;
+
+        uint32_t latch = fall - DATA_SETUP_NS;
+        int r = 0;
+        uint32_t pins = trace_pins(latch, &r);
+        bool s4 = !((pins >> S4_PIN) & 1), s5 = !((pins >> S5_PIN) & 1);
+        bool selected = is16k ? (s4 || s5) : s5;
+        bool read = (pins >> RW_PIN) & 1;
+        int offset = (pins & 0x1FFF) | ((is16k && !s4) ? 0x2000 : 0);
+        // when the select settled, if after phi2 rose
+        uint32_t sel_time = rise;
+        for (int k=0; k<trace_len && trace[k].t <= latch; k++) {
+            uint32_t p = trace[k].pins;
+            bool sel = is16k ? (!((p >> S4_PIN) & 1) || !((p >> S5_PIN) & 1)) : !((p >> S5_PIN) & 1);
+            if (trace[k].t > rise && sel && !(is16k ? (!((trace[k-1].pins >> S4_PIN) & 1) || !((trace[k-1].pins >> S5_PIN) & 1))
+                    : !((trace[k-1].pins >> S5_PIN) & 1)))
+                sel_time = trace[k].t;
+        }
+        cycles++;
+
+        int c_rise = (int)(rise / ns_per_clock) + 1, c_latch = (int)(latch / ns_per_clock);
+        int c_fall = (int)(fall / ns_per_clock) + 1, c_next = (int)(next_rise / ns_per_clock);
+        if (selected && !read) {
+            // a write to the cartridge area, what the data bus does then isn't checked
+        }
+        else if (selected) {
+            reads++;
+            uint8_t want = cart_ram[offset];
+            if (dirs[c_latch] != 0xFF || vals[c_latch] != want) {
+                printf("FAIL cycle at %uns ($%04X, select at %uns): D0-D7 %s %02X, wanted %02X\n",
+                    rise, (pins & 0x1FFF) | (s4 ? 0x8000 : 0xA000), sel_time,
+                    dirs[c_latch] == 0xFF ? "=" : "not driven,", vals[c_latch], want);
+                errors++;
+                continue;
+            }
+            int c = c_latch;
+            while (c > c_rise && dirs[c-1] == 0xFF && vals[c-1] == want)
+                c--;
+            double valid = c * ns_per_clock - sel_time;
+            if (valid > worst_valid) worst_valid = valid;
+            if (latch - c * ns_per_clock < least_slack) least_slack = latch - c * ns_per_clock;
+        }
+        else {
+            for (int c=c_rise; c<c_fall; c++)
+                if (dirs[c]) {
+                    printf("FAIL cycle at %uns: D0-D7 driven at %.0fns without a select\n", rise, c * ns_per_clock);
+                    errors++;
+                    break;
+                }
+        }
+        int c = c_fall;
+        while (c < c_next && dirs[c])
+            c++;
+        if (c == c_next) {
+            printf("FAIL cycle at %uns: D0-D7 still driven when phi2 rises again\n", rise);
+            errors++;
+        }
+        else if (c * ns_per_clock - fall > worst_release)
+            worst_release = c * ns_per_clock - fall;
+    }
+
+    printf("%s @ %.0fMHz: %d cycles, %d cart reads, %d errors\n", prog->name,
+        atof(argv[4]) / 1000, cycles, reads, errors);
+    printf("  data valid at worst %.0fns after phi2 rise/select, %.0fns before the 6502 latches it\n",
+        worst_valid, least_slack);
+    printf("  bus released at worst %.0fns after phi2 falls\n", worst_release);
+    return errors ? 1 : 0;
+}